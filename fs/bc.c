@@ -1,13 +1,68 @@
 
 #include "fs.h"
 
+// The block cache holds at most BC_NBLOCKS blocks.  Each resident block
+// has a slot in bc_slots, and when bc_pgfault needs room for another,
+// the CLOCK hand sweeps the slots for a victim: a block whose PTE_A bit
+// is set has been used since the hand last passed, so it gets a second
+// chance and its bit is cleared, by remapping the page or, if it is
+// dirty, by writing it back.  The superblock and the bitmap are never
+// evicted.  Blocks lent to other envs (see bc_lend) are, like any other:
+// that only drops our mapping, and the borrowers keep the page, so no
+// number of lent pages can fill the cache.  Slots whose block was
+// unmapped by other means are simply reused.
+static uint32_t bc_slots[BC_NBLOCKS];	// Block in each slot, or 0
+static uint32_t bc_hand;
+
+// A block is read into a staging page and mapped at DISKMAP only once
+// its data is there, so nothing sees it early, not even a pointer kept
+// into the cache, which would not fault.  Block b is staged in page
+// b % BC_NBLOCKS from BC_STAGEVA on, so adjacent blocks are staged in
+// adjacent pages and read with one disk command.  A block whose page
+// is taken waits for the block that has it.
+#define BC_STAGEVA	0x0f400000
+static uint32_t bc_staged[BC_NBLOCKS];	// Block staged in each page, or 0
+
+// Blocks are lent to other envs read-only, as their own pages (see
+// bc_lend), and running programs may map them for good.  A lent block
+// is always clean, so mapped read-only here, and the first write to it
+// moves the block to a copy made at BC_COPYVA, leaving the borrowers
+// the page as it was.  The same goes for a lent block that is freed and
+// reused.
+#define BC_COPYVA	(BC_STAGEVA + BC_NBLOCKS * PGSIZE)
+
+// Clean blocks are mapped read-only, so the first write to one faults,
+// and bc_pgfault adds it to bc_dirty before making it writable.
+// bc_writeback writes the blocks in bc_dirty back, runs of adjacent
+// blocks with one disk command each, and maps them read-only again.
+// Entries for blocks that were written back by flush_block or unmapped
+// since are skipped then.  A writer that finds BC_DIRTYMAX entries
+// already waits for a write-back.
+static uint32_t bc_dirty[BC_DIRTYMAX];
+static uint32_t bc_ndirty;
+
+static struct {
+	uint32_t hits;		// diskaddr of a block already resident
+	uint32_t misses;	// Blocks read in by bc_pgfault
+	uint32_t evictions;
+	uint32_t writebacks;	// Blocks written by flush_block
+	uint32_t readaheads;	// Blocks read in by bc_readahead
+} bc_stats;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
 {
+	char *va;
+
 	if (blockno == 0 || (super && blockno >= super->s_nblocks))
 		panic("bad block number %08x in diskaddr", blockno);
-	return (char*) (DISKMAP + blockno * BLKSIZE);
+	va = (char*) (DISKMAP + blockno * BLKSIZE);
+	// Another request thread may be reading it in.
+	bio_wait_block(blockno);
+	if (va_is_mapped(va))
+		bc_stats.hits++;
+	return va;
 }
 
 // Is this virtual address mapped?
@@ -24,14 +79,203 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Can block 'blockno', which is in the cache, be evicted?
+static bool
+bc_evictable(uint32_t blockno)
+{
+	if (super && blockno < 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE)
+		return 0;
+	return !bio_busy(blockno);
+}
+
+// Find a slot for a block about to be read in, evicting a block if
+// the cache is full.  Returns the slot's index.
+static uint32_t
+bc_slot_alloc(void)
+{
+	uint32_t n, slot, blockno;
+	void *va;
+	int r;
+
+	for (n = 0; n < 3 * BC_NBLOCKS; n++) {
+		slot = bc_hand;
+		bc_hand = (bc_hand + 1) % BC_NBLOCKS;
+		blockno = bc_slots[slot];
+		if (blockno == 0)
+			return slot;
+		va = (void *) (DISKMAP + blockno * BLKSIZE);
+		if (!va_is_mapped(va)) {
+			// Its block may be on the way in.
+			if (bio_busy(blockno))
+				continue;
+			return slot;
+		}
+		if (!bc_evictable(blockno))
+			continue;
+
+		if (uvpt[PGNUM(va)] & PTE_A) {
+			// Second chance.  Remapping the page clears PTE_A,
+			// and would clear PTE_D too, so a dirty block is
+			// written back instead, which remaps it.
+			if (va_is_dirty(va))
+				flush_block(va);
+			else if ((r = sys_page_map(0, va, 0, va,
+						   uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("bc_slot_alloc: sys_page_map: %e", r);
+			continue;
+		}
+
+		flush_block(va);
+		// Another request thread may have used it during the write.
+		if (va_is_dirty(va) || (uvpt[PGNUM(va)] & PTE_A))
+			continue;
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("bc_slot_alloc: sys_page_unmap: %e", r);
+		bc_stats.evictions++;
+		return slot;
+	}
+	panic("block cache is full of blocks that cannot be evicted");
+}
+
+static void *
+bc_stageva(uint32_t blockno)
+{
+	return (void *) (BC_STAGEVA + (blockno % BC_NBLOCKS) * BLKSIZE);
+}
+
+// Give block 'blockno' a slot and a fresh staging page, to be read into
+// (see bc_install).  Making room may wait for the disk, and another
+// request thread may start reading the block meanwhile.
+// Returns true if the staging page is ours to read into, false if the
+// block is mapped or on its way in already, or its staging page was
+// taken while we waited.
+static bool
+bc_map_block(uint32_t blockno)
+{
+	void *va = (void *) (DISKMAP + blockno * BLKSIZE);
+	uint32_t slot, i = blockno % BC_NBLOCKS;
+	int r;
+
+	for (;;) {
+		if (va_is_mapped(va) || bio_busy(blockno))
+			return 0;
+		if (!bc_staged[i])
+			break;
+		bio_wait_block(bc_staged[i]);
+	}
+	slot = bc_slot_alloc();
+	if (va_is_mapped(va) || bio_busy(blockno) || bc_staged[i])
+		return 0;
+	bc_slots[slot] = blockno;
+	bc_staged[i] = blockno;
+	if ((r = sys_page_alloc(0, bc_stageva(blockno), PTE_W | PTE_U | PTE_P)) < 0)
+		panic("bc_map_block: could not allocate page: %e", r);
+	return 1;
+}
+
+// Block 'blockno' has been read into its staging page: map it at its
+// place in the cache, clean.
+static void
+bc_install(uint32_t blockno)
+{
+	void *stage = bc_stageva(blockno);
+	int r;
+
+	if ((r = sys_page_map(0, stage, 0, (void *) (DISKMAP + blockno * BLKSIZE),
+			      PTE_U | PTE_P)) < 0)
+		panic("bc_install: sys_page_map: %e", r);
+	if ((r = sys_page_unmap(0, stage)) < 0)
+		panic("bc_install: sys_page_unmap: %e", r);
+	bc_staged[blockno % BC_NBLOCKS] = 0;
+}
+
+// Mark the block at 'va', which was just read from or written to disk,
+// clean: clear its dirty bit and map it read-only.
+static void
+bc_clean(void *va)
+{
+	int r;
+
+	if ((r = sys_page_map(0, va, 0, va,
+			      uvpt[PGNUM(va)] & PTE_SYSCALL & ~PTE_W)) < 0)
+		panic("bc_clean: sys_page_map: %e", r);
+}
+
+// The clean block 'blockno' at 'va' is about to be written.
+static void
+bc_mark_dirty(uint32_t blockno, void *va)
+{
+	int r;
+
+	if (bc_ndirty == BC_DIRTYMAX)
+		bc_writeback();
+	bc_dirty[bc_ndirty++] = blockno;
+	if (pageref(va) > 1) {
+		// Lent out: write to a copy.
+		if ((r = sys_page_alloc(0, (void *) BC_COPYVA, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("bc_mark_dirty: sys_page_alloc: %e", r);
+		memmove((void *) BC_COPYVA, va, BLKSIZE);
+		if ((r = sys_page_map(0, (void *) BC_COPYVA, 0, va,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			panic("bc_mark_dirty: sys_page_map: %e", r);
+		sys_page_unmap(0, (void *) BC_COPYVA);
+		return;
+	}
+	if ((r = sys_page_map(0, va, 0, va,
+			      (uvpt[PGNUM(va)] & PTE_SYSCALL) | PTE_W)) < 0)
+		panic("bc_mark_dirty: sys_page_map: %e", r);
+}
+
+// Get the block at 'va' ready to be lent out as a page of its own:
+// bring it into the cache, and write it back if it is dirty, so that it
+// is mapped read-only and no write of ours changes it under the
+// borrower.
+void
+bc_lend(void *va)
+{
+	for (;;) {
+		(void) *(volatile char *) va;
+		if (!va_is_dirty(va))
+			return;
+		flush_block(va);
+	}
+}
+
+// bio callbacks for blocks read in on a miss, read ahead, and written
+static void
+bc_read_done(uint32_t blockno, int r)
+{
+	if (r < 0)
+		panic("bc_pgfault: could not read sector from disk: %e", r);
+	bc_install(blockno);
+}
+
+static void
+bc_readahead_done(uint32_t blockno, int r)
+{
+	if (r < 0)
+		panic("bc_readahead: could not read from disk: %e", r);
+	bc_install(blockno);
+	bc_stats.readaheads++;
+}
+
+// A block is marked clean before it is written, so that a write to it
+// meanwhile makes it dirty again.
+static void
+bc_write_done(uint32_t blockno, int r)
+{
+	if (r < 0)
+		panic("could not write block %08x to disk: %e", blockno, r);
+	bc_stats.writebacks++;
+}
+
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk, evicting another if the cache is full.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-	int r;
 
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
@@ -42,31 +286,51 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
-	// Allocate a page in the disk map region, read the contents
-	// of the block from the disk into that page.
-	// first round addr to page boundary. fs/ide.c has code to read
-	// the disk.
-
-	void *alignedAdrr = ROUNDDOWN(addr, PGSIZE);
-	r = sys_page_alloc(0, addr, PTE_W | PTE_U | PTE_P);
-	if (r < 0)
-		panic("bc_pgfault: could not allocate page: %e", r);
+	// A write to a clean block.
+	if ((utf->utf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)) {
+		bc_mark_dirty(blockno, ROUNDDOWN(addr, PGSIZE));
+		return;
+	}
 
-	//read the wanted block from first to eight'th block
-	r = ide_read(FIRST_SECTOR_OF_BLOCK(blockno), addr, BLKSECTS);
-	if (r < 0)
-		panic("bc_pgfault: could not read sector from disk: %e", r);
+	// Allocate a staging page, read the contents of the block from
+	// the disk into that page, and map it in the disk map region.
+	if (!bc_map_block(blockno)) {
+		// Another request thread is reading it in, or has; or its
+		// staging page was taken, and the access faults again.
+		bio_wait_block(blockno);
+		return;
+	}
+	bc_stats.misses++;
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
+	// Read the block in, along with whatever else is queued.
+	bio_submit(blockno, bc_stageva(blockno), 0, bc_read_done);
+	bio_flush();
 
 	// Check that the block we read was allocated. 
 	if (bitmap && block_is_free(blockno))
 		panic("reading free block %08x\n", blockno);
 }
 
+// Read the 'n' blocks from 'blockno' on into the cache ahead of their
+// use.  bio_flush reads each run of them that is not resident yet with
+// a single disk command.  n is at most BC_RAMAX.
+void
+bc_readahead(uint32_t blockno, uint32_t n)
+{
+	uint32_t i;
+
+	assert(n <= BC_RAMAX);
+	if (super && blockno + n > super->s_nblocks)
+		n = blockno < super->s_nblocks ? super->s_nblocks - blockno : 0;
+
+	for (i = 0; i < n; i++)
+		if (!va_is_mapped((void *) (DISKMAP + (blockno + i) * BLKSIZE))
+		    && bc_map_block(blockno + i))
+			bio_submit(blockno + i, bc_stageva(blockno + i), 0,
+				   bc_readahead_done);
+	bio_flush();
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
@@ -81,22 +345,40 @@ flush_block(void *addr)
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %08x", addr);
 
-	// check if block needs to be written to disk
+	// check if block needs to be written to disk, once any write of
+	// it in progress is done
+	bio_wait_block(blockno);
 	if (!va_is_mapped(addr) || !va_is_dirty(addr))
 		return;
 
 	void *alignedAdrr = ROUNDDOWN(addr, PGSIZE);
 
-	//write block to disk
-	int r = ide_write(FIRST_SECTOR_OF_BLOCK(blockno), alignedAdrr ,BLKSECTS);
-	if (r < 0)
-		panic("flush_block: could write block to disk: %e", r);
+	//clear dirty, and write block to disk
+	bc_clean(alignedAdrr);
+	bio_submit(blockno, alignedAdrr, 1, bc_write_done);
+	bio_flush();
+}
 
-	//clear dirty
-	r = sys_page_map(0, alignedAdrr, 0, alignedAdrr, uvpt[PGNUM(addr)] & PTE_SYSCALL);
-	if (r < 0)
-		panic("flush_block: could not clear dirty: %e", r);
+// Write back every dirty block.  bio_flush puts the blocks in order and
+// writes runs of adjacent ones with one disk command each.
+void
+bc_writeback(void)
+{
+	uint32_t b;
+	void *va;
 
+	// Empty bc_dirty before bio_flush waits, since other request
+	// threads may add to it meanwhile.
+	while (bc_ndirty > 0) {
+		b = bc_dirty[--bc_ndirty];
+		va = (void *) (DISKMAP + b * BLKSIZE);
+		// Skip blocks clean by now, and repeats.
+		if (va_is_mapped(va) && va_is_dirty(va) && !bio_busy(b)) {
+			bc_clean(va);
+			bio_submit(b, va, 1, bc_write_done);
+		}
+	}
+	bio_flush();
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -129,6 +411,16 @@ check_bc(void)
 	cprintf("block cache is good\n");
 }
 
+void
+bc_print_stats(void)
+{
+	cprintf("block cache: %u hits, %u misses, %u read ahead, "
+		"%u evictions, %u writebacks\n",
+		bc_stats.hits, bc_stats.misses, bc_stats.readaheads,
+		bc_stats.evictions, bc_stats.writebacks);
+	bio_print_stats();
+}
+
 void
 bc_init(void)
 {
@@ -0,0 +1,251 @@
+// Block I/O requests.  The block cache does not talk to the disk
+// drivers directly: with bio_submit, it queues requests to read or
+// write blocks, each into or from a page of its own and with a function
+// to call when it is done, and bio_flush then carries out everything
+// queued.
+//
+// bio_flush serves the queue in C-SCAN order: ascending from the block
+// after the last one it reached, then around from the start of the
+// disk, so the disk head sweeps one way only.  Requests in the same
+// direction for adjacent blocks in adjacent pages are merged into one
+// disk command of up to BC_RAMAX blocks.  A virtio disk is kept
+// BIO_INFLIGHT commands deep; IDE does them one at a time.
+//
+// bio_flush takes the whole queue for itself, so while its commands
+// are on the disk, other request threads (see thread.c) can queue and
+// flush requests of their own.  A request stays busy until its callback
+// has run, and a block with a busy request must not be evicted or, if
+// it is being read, looked for (see bio_wait_block).
+
+#include "fs.h"
+
+// At most one request is outstanding for a resident block, so a pool
+// the size of the block cache is never short.
+#define BIO_NPOOL	BC_NBLOCKS
+
+// Most virtio commands outstanding per bio_flush
+#define BIO_INFLIGHT	16
+
+enum {
+	BIO_FREE = 0,
+	BIO_QUEUED,
+	BIO_ACTIVE,		// Its command is on the disk
+};
+
+struct Bio {
+	uint32_t blockno;
+	void *va;		// Page to read into or write from
+	bool write;
+	uint8_t state;		// BIO_FREE, BIO_QUEUED or BIO_ACTIVE
+	bio_done_t done;
+	struct Bio *next;	// Next in block order
+	struct Bio *busy_next;	// Next in bio_busy_list
+};
+
+// A disk command: n requests from 'first' on
+struct BioCmd {
+	struct Bio *first;
+	uint32_t n;
+	int tag;
+};
+
+static struct Bio bio_pool[BIO_NPOOL];
+static struct Bio *bio_free_list;
+static struct Bio *bio_queue;		// Queued requests, in block order
+static struct Bio *bio_busy_list;	// Requests queued or in flight
+static uint32_t bio_head;		// Where the last sweep left off
+
+static struct {
+	uint32_t requests;
+	uint32_t commands;
+} bio_stats;
+
+// Queue a request to read block 'blockno' into the page at 'va', or to
+// write it from there, and to call 'done' once it is carried out.
+// 'done' must not submit requests itself.  The page must stay mapped
+// until then, and there must be no other request for the block.
+void
+bio_submit(uint32_t blockno, void *va, bool write, bio_done_t done)
+{
+	static bool inited;
+	struct Bio *b, **pb;
+	uint32_t i;
+
+	if (!inited) {
+		for (i = 0; i < BIO_NPOOL; i++) {
+			bio_pool[i].next = bio_free_list;
+			bio_free_list = &bio_pool[i];
+		}
+		inited = 1;
+	}
+	if (!(b = bio_free_list))
+		panic("bio_submit: more requests than cached blocks");
+	bio_free_list = b->next;
+
+	b->blockno = blockno;
+	b->va = va;
+	b->write = write;
+	b->state = BIO_QUEUED;
+	b->done = done;
+	// After any others for the same block, so they stay in order.
+	for (pb = &bio_queue; *pb && (*pb)->blockno <= blockno; pb = &(*pb)->next)
+		/* do nothing */;
+	b->next = *pb;
+	*pb = b;
+	b->busy_next = bio_busy_list;
+	bio_busy_list = b;
+	bio_stats.requests++;
+}
+
+static struct Bio *
+bio_lookup(uint32_t blockno)
+{
+	struct Bio *b;
+
+	for (b = bio_busy_list; b; b = b->busy_next)
+		if (b->blockno == blockno)
+			return b;
+	return NULL;
+}
+
+// Is a request for block 'blockno' queued or in flight?
+bool
+bio_busy(uint32_t blockno)
+{
+	return bio_lookup(blockno) != NULL;
+}
+
+// Wait until no request for block 'blockno' is queued or in flight,
+// so that its page holds what it should.
+void
+bio_wait_block(uint32_t blockno)
+{
+	struct Bio *b;
+	uint32_t gen;
+
+	for (;;) {
+		gen = fs_gen();
+		if (!(b = bio_lookup(blockno)))
+			return;
+		if (b->state == BIO_QUEUED)
+			bio_flush();
+		else
+			fs_wait(gen);
+	}
+}
+
+// Start the disk command for 'c' and, unless the disk is virtio,
+// finish it too.
+// Returns a virtio tag, 0 if the command is finished, < 0 on error.
+static int
+bio_start(struct BioCmd *c)
+{
+	struct Bio *b = c->first;
+	uint32_t nsecs = c->n * BLKSECTS;
+	void *va = b->va;
+
+	if (virtio_blk_present())
+		return virtio_blk_submit(FIRST_SECTOR_OF_BLOCK(b->blockno), va,
+					 nsecs, b->write);
+	if (b->write)
+		return ide_write(FIRST_SECTOR_OF_BLOCK(b->blockno), va, nsecs);
+	return ide_read(FIRST_SECTOR_OF_BLOCK(b->blockno), va, nsecs);
+}
+
+// Call back the requests of the command 'c', which finished with 'r',
+// and free them.
+static void
+bio_finish(struct BioCmd *c, int r)
+{
+	struct Bio *b, *next, **pb;
+	uint32_t i;
+
+	for (i = 0, b = c->first; i < c->n; i++, b = next) {
+		next = b->next;
+		b->done(b->blockno, r);
+		for (pb = &bio_busy_list; *pb != b; pb = &(*pb)->busy_next)
+			/* do nothing */;
+		*pb = b->busy_next;
+		b->state = BIO_FREE;
+		b->next = bio_free_list;
+		bio_free_list = b;
+	}
+	fs_wake();
+}
+
+// Carry out every queued request and call it back.
+void
+bio_flush(void)
+{
+	struct BioCmd cmds[BIO_INFLIGHT];
+	struct Bio *q, *b, *p, **pb;
+	uint32_t n, ncmds = 0, oldest = 0, j, gen;
+	int r;
+
+	// Take the queue, and turn it around to start at the head: the
+	// C-SCAN order.
+	q = bio_queue;
+	bio_queue = NULL;
+	for (pb = &q; *pb && (*pb)->blockno < bio_head; pb = &(*pb)->next)
+		/* do nothing */;
+	if (*pb && pb != &q) {
+		for (p = *pb; p->next; p = p->next)
+			/* do nothing */;
+		p->next = q;
+		q = *pb;
+		*pb = NULL;
+	}
+	for (p = q; p; p = p->next)
+		p->state = BIO_ACTIVE;
+
+	while (q) {
+		b = q;
+		for (n = 1, p = b->next; p && n < BC_RAMAX; n++, p = p->next)
+			if (p->write != b->write || p->blockno != b->blockno + n
+			    || p->va != b->va + n * BLKSIZE)
+				break;
+		q = p;
+		bio_head = b->blockno + n;
+
+		if (ncmds == BIO_INFLIGHT) {
+			bio_finish(&cmds[oldest], virtio_blk_wait(cmds[oldest].tag));
+			oldest = (oldest + 1) % BIO_INFLIGHT;
+			ncmds--;
+		}
+		j = (oldest + ncmds) % BIO_INFLIGHT;
+		cmds[j].first = b;
+		cmds[j].n = n;
+		for (;;) {
+			gen = fs_gen();
+			if ((r = bio_start(&cmds[j])) != -E_AGAIN)
+				break;
+			// Every virtio request is taken.  Collect our oldest
+			// command, which frees one, rather than wait for other
+			// threads while we hold requests too; holding none,
+			// wait for the threads that do.  j stays the same.
+			if (ncmds > 0) {
+				bio_finish(&cmds[oldest], virtio_blk_wait(cmds[oldest].tag));
+				oldest = (oldest + 1) % BIO_INFLIGHT;
+				ncmds--;
+			} else
+				fs_wait(gen);
+		}
+		bio_stats.commands++;
+		if (virtio_blk_present() && r >= 0) {
+			cmds[j].tag = r;
+			ncmds++;
+		} else
+			bio_finish(&cmds[j], r < 0 ? r : 0);
+	}
+	for (; ncmds > 0; ncmds--) {
+		bio_finish(&cmds[oldest], virtio_blk_wait(cmds[oldest].tag));
+		oldest = (oldest + 1) % BIO_INFLIGHT;
+	}
+}
+
+void
+bio_print_stats(void)
+{
+	cprintf("block I/O: %u requests in %u disk commands\n",
+		bio_stats.requests, bio_stats.commands);
+}
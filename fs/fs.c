@@ -24,6 +24,36 @@ check_super(void)
 // Free block bitmap
 // --------------------------------------------------------------
 
+// alloc_block searches next-fit, a word at a time, from the word where
+// the last search ended.  Changes to the bitmap are not written back
+// one block at a time: the range of bitmap blocks changed is remembered
+// and bitmap_flush writes them once, at the end of each request.
+static uint32_t bitmap_next;		// Word to start the next search at
+static uint32_t bitmap_dirty_lo = ~0;	// Bitmap blocks changed since
+static uint32_t bitmap_dirty_hi;	//	the last bitmap_flush
+
+// Note that the bitmap word 'word' has changed.
+static void
+bitmap_touch(uint32_t word)
+{
+	uint32_t b = word / (BLKBITSIZE / 32);
+
+	bitmap_dirty_lo = MIN(bitmap_dirty_lo, b);
+	bitmap_dirty_hi = MAX(bitmap_dirty_hi, b + 1);
+}
+
+// Write the bitmap blocks changed since the last call back to disk.
+void
+bitmap_flush(void)
+{
+	uint32_t b, lo = bitmap_dirty_lo, hi = bitmap_dirty_hi;
+
+	bitmap_dirty_lo = ~0;
+	bitmap_dirty_hi = 0;
+	for (b = lo; b < hi; b++)
+		flush_block(diskaddr(2 + b));
+}
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -44,11 +74,11 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free zero block");
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	bitmap_touch(blockno / 32);
 }
 
-// Search the bitmap for a free block and allocate it.  When
-// allocating a block, immediately flushs the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it.  The changed
+// bitmap block is written back by the next bitmap_flush.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
@@ -59,22 +89,40 @@ alloc_block(void)
 	// The bitmap consists of one or more blocks.  A single bitmap block
 	// contains the in-use bits for BLKBITSIZE blocks.  There are
 	// super->s_nblocks blocks in the disk altogether.
+	uint32_t nwords, word, n, blockno;
 
-	//for each block check if free, and if so mark as used and return bn
-	int blockno = 0;
 	if (super == NULL)
 		panic("alloc_block: super is not allocated");
 
-	for (; blockno < super->s_nblocks; blockno++){
-		if (block_is_free(blockno)){
-			bitmap[blockno/32] &= ~(1 << (blockno%32)); // mark offset bit as used (0)
-			flush_block(&bitmap[blockno/32]); //flush bitmap relevent back to disk
-			return blockno;
-		}
+	nwords = ROUNDUP(super->s_nblocks, 32) / 32;
+	word = bitmap_next < nwords ? bitmap_next : 0;
+	for (n = 0; n < nwords; n++, word = word + 1 < nwords ? word + 1 : 0) {
+		if (!bitmap[word])
+			continue;
+		// The lowest set bit is the first free block in the word.
+		// Only the last word has bits past the end of the disk.
+		blockno = word * 32 + __builtin_ctz(bitmap[word]);
+		if (blockno >= super->s_nblocks)
+			continue;
+		bitmap[word] &= ~(1 << (blockno % 32));
+		bitmap_touch(word);
+		bitmap_next = word;
+		return blockno;
 	}
 	return -E_NO_DISK;
 }
 
+// Allocate block 'blockno', which must be free.
+// Returns 'blockno'.
+int
+alloc_block_at(uint32_t blockno)
+{
+	assert(block_is_free(blockno));
+	bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+	bitmap_touch(blockno / 32);
+	return blockno;
+}
+
 // Validate the file system bitmap.
 //
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
@@ -107,11 +155,15 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-       // Find a JOS disk.  Use the second IDE disk (number 1) if availabl
-       if (ide_probe_disk1())
-               ide_set_disk(1);
-       else
-               ide_set_disk(0);
+	// Find a JOS disk.  Use a virtio disk if there is one, otherwise
+	// the second IDE disk (number 1) if available.
+	if (!virtio_blk_init()) {
+		if (ide_probe_disk1())
+			ide_set_disk(1);
+		else
+			ide_set_disk(0);
+		ide_dma_init();
+	}
 	bc_init();
 
 	// Set "super" to point to the super block.
@@ -124,11 +176,38 @@ fs_init(void)
 	
 }
 
+// Make sure the pointer block '*pbno' exists, allocating and clearing
+// one if 'alloc' is set, and return where it is in memory.
+//
+// Returns NULL and sets *r if it does not exist: to -E_NOT_FOUND if
+// 'alloc' was 0, to -E_NO_DISK if there was no space for it.
+static uint32_t *
+block_ptrs(uint32_t *pbno, bool alloc, int *r)
+{
+	int blockno;
+
+	if (*pbno == 0) {
+		if (!alloc) {
+			*r = -E_NOT_FOUND;
+			return NULL;
+		}
+		if ((blockno = alloc_block()) < 0) {
+			*r = -E_NO_DISK;
+			return NULL;
+		}
+		memset(diskaddr(blockno), 0, BLKSIZE);
+		flush_block(diskaddr(blockno));
+		*pbno = blockno;
+	}
+	return diskaddr(*pbno);
+}
+
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in one of the indirect blocks that the
+// double-indirect block points to.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -136,55 +215,41 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= MAXFILEBLOCKS).
 //
 // Analogy: This is like pgdir_walk for files.
 // (clears any block we allocate)
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
-{	
-	assert(filebno >= 0);
-    if (filebno >= NDIRECT + NINDIRECT)
+{
+	uint32_t *ptrs;
+	int r;
+
+	if (filebno >= MAXFILEBLOCKS)
 		return -E_INVAL;
 
-	//handle direct block case
-	if (filebno < NDIRECT){
-		if (ppdiskbno != NULL)
-			*ppdiskbno = &(f->f_direct[filebno]);
-	} 
-	
-	//handle indirect block case
-	else{
-		//no valid inderction pointer in the file struct
-		if (f->f_indirect == 0){  
-			
-			if (!alloc)
-				return -E_NOT_FOUND;
-
-			else { //allocate new block for indirect block
-				int indirectionBlockNumber = alloc_block();
-				if (indirectionBlockNumber < 0)
-					return -E_NO_DISK; //could not allocate new block for indirect
-
-				memset(diskaddr(indirectionBlockNumber), 0, BLKSIZE); //set block to 0's
-				flush_block(diskaddr(indirectionBlockNumber)); //sync with disk
-				f->f_indirect = indirectionBlockNumber; //
-			}
-		}
-		
-		//now we that have an indirection block, search for the requested block
-		if (ppdiskbno != NULL){
-			uint32_t* indirectBlock;
-			indirectBlock =  (uint32_t*) diskaddr(f->f_indirect);
-			*ppdiskbno = &(indirectBlock[filebno-NDIRECT]); //annanas: debug
-		}
+	if (filebno < NDIRECT) {
+		ptrs = f->f_direct;
+	} else if ((filebno -= NDIRECT) < NINDIRECT) {
+		if (!(ptrs = block_ptrs(&f->f_indirect, alloc, &r)))
+			return r;
+	} else {
+		filebno -= NINDIRECT;
+		if (!(ptrs = block_ptrs(&f->f_dindirect, alloc, &r))
+		    || !(ptrs = block_ptrs(&ptrs[filebno / NINDIRECT], alloc, &r)))
+			return r;
+		filebno %= NINDIRECT;
 	}
-
+	if (ppdiskbno != NULL)
+		*ppdiskbno = &ptrs[filebno];
 	return 0;
 }
 
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
+// A block allocated here goes right after the file's previous block on
+// disk if that is free, so a file written front to back is contiguous
+// but for its indirect blocks, and is read back in long runs.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
@@ -193,28 +258,48 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-	   uint32_t *diskbnoPtr;
-
-		// find block slot
-		int res;
-		res = file_block_walk(f, filebno, &diskbnoPtr, true);
-		if (res < 0){
-			assert(res != -E_NOT_FOUND);
-			return res;
-		}
+	uint32_t *pdiskbno, *pprev;
+	int r, blockno;
 
-	   	int blockno;
-		if (*diskbnoPtr == 0){ // if no block in slot
-			blockno = alloc_block();
-			if (blockno < 0)
-				return -E_NO_DISK; //could not allocate new block
-			
-			*diskbnoPtr = (uint32_t) blockno;
-			memset(diskaddr(*diskbnoPtr), 0, BLKSIZE);
-		}
+	if ((r = file_block_walk(f, filebno, &pdiskbno, 1)) < 0)
+		return r;
+
+	if (*pdiskbno == 0) {
+		blockno = -E_NO_DISK;
+		if (filebno > 0
+		    && file_block_walk(f, filebno - 1, &pprev, 0) == 0
+		    && *pprev && block_is_free(*pprev + 1))
+			blockno = alloc_block_at(*pprev + 1);
+		if (blockno < 0 && (blockno = alloc_block()) < 0)
+			return blockno;
+		*pdiskbno = blockno;
+		memset(diskaddr(blockno), 0, BLKSIZE);
+	}
 
-		*blk = diskaddr(*diskbnoPtr);
-		return 0;       
+	*blk = diskaddr(*pdiskbno);
+	return 0;
+}
+
+// Set *blk to the address in memory of the filebno'th block of file
+// 'f', like file_get_block, but allocate nothing: set it to NULL if the
+// block is a hole.  Requests that only read the file system run side
+// by side (see fs_begin) and must use this.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if filebno is out of range.
+//
+int
+file_lookup_block(struct File *f, uint32_t filebno, char **blk)
+{
+	uint32_t *pdiskbno;
+	int r;
+
+	*blk = NULL;
+	if ((r = file_block_walk(f, filebno, &pdiskbno, 0)) < 0)
+		return r == -E_NOT_FOUND ? 0 : r;
+	if (*pdiskbno)
+		*blk = diskaddr(*pdiskbno);
+	return 0;
 }
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
@@ -235,8 +320,10 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+		if ((r = file_lookup_block(dir, i, &blk)) < 0)
 			return r;
+		if (!blk)
+			continue;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (strcmp(f[j].f_name, name) == 0) {
@@ -376,6 +463,7 @@ file_open(const char *path, struct File **pf)
 
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
+// Holes read as zeros, and are left holes.
 // Returns the number of bytes read, < 0 on error.
 ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
@@ -390,10 +478,13 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	count = MIN(count, f->f_size - offset);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_lookup_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(buf, blk + pos % BLKSIZE, bn);
+		if (blk)
+			memmove(buf, blk + pos % BLKSIZE, bn);
+		else
+			memset(buf, 0, bn);
 		pos += bn;
 		buf += bn;
 	}
@@ -401,6 +492,34 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Bring blocks filebno through filebno + n - 1 of f into the block
+// cache before they are read, stopping at the first hole.  Blocks that
+// lie next to each other on disk are read together.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t *pdiskbno, nblocks, start, len;
+
+	nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+	if (filebno >= nblocks)
+		return;
+	n = MIN(n, nblocks - filebno);
+	start = len = 0;
+	for (; n > 0; filebno++, n--) {
+		if (file_block_walk(f, filebno, &pdiskbno, 0) < 0 || !*pdiskbno)
+			break;
+		if (len > 0 && *pdiskbno == start + len && len < BC_RAMAX) {
+			len++;
+			continue;
+		}
+		if (len > 0)
+			bc_readahead(start, len);
+		start = *pdiskbno;
+		len = 1;
+	}
+	if (len > 0)
+		bc_readahead(start, len);
+}
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -439,7 +558,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	uint32_t *ptr;
 
 	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
+		return r == -E_NOT_FOUND ? 0 : r;
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
@@ -451,16 +570,19 @@ file_free_block(struct File *f, uint32_t filebno)
 // but not necessary for a file of size 'newsize'.
 // For both the old and new sizes, figure out the number of blocks required,
 // and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then frees the indirect block too.
-// (* f->f_indirect pointer is cleared so we'll know
-// 	  whether it's valid!
+// Then frees the indirect blocks that no longer map any of the file:
+// the indirect block if new_nblocks is no more than NDIRECT, the
+// indirect blocks under the double-indirect block past new_nblocks, and
+// the double-indirect block itself if new_nblocks is no more than
+// NDIRECT + NINDIRECT.
+// (* Their pointers are cleared so we'll know
+// 	  whether they're valid!
 //	* f->f_size is not changed.)
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
 	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, i, *dind;
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
@@ -472,12 +594,26 @@ file_truncate_blocks(struct File *f, off_t newsize)
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
 	}
+	if (f->f_dindirect) {
+		dind = diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (dind[i] && new_nblocks <= NDIRECT + NINDIRECT + i * NINDIRECT) {
+				free_block(dind[i]);
+				dind[i] = 0;
+			}
+		if (new_nblocks <= NDIRECT + NINDIRECT) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
+	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
@@ -486,33 +622,20 @@ file_set_size(struct File *f, off_t newsize)
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translates the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// The block cache knows which blocks are dirty but not whose they are,
+// so this writes back every dirty block, which costs no more than
+// finding f's would.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
-	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	bc_writeback();
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system.  Costs as much as there is dirty data.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_writeback();
 }
 
@@ -12,29 +12,76 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Most blocks the block cache keeps in memory at once (4MB) */
+#define BC_NBLOCKS	1024
+
+/* Most blocks read ahead with one disk command (256 sectors) */
+#define BC_RAMAX	32
+
+/* Most dirty blocks before writers must wait for write-back */
+#define BC_DIRTYMAX	(BC_NBLOCKS / 4)
+
+/* Milliseconds between background write-backs */
+#define BC_WRITEBACK_MS	1000
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
+void	ide_dma_init(void);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* virtio.c */
+bool	virtio_blk_init(void);
+bool	virtio_blk_present(void);
+int	virtio_blk_submit(uint32_t secno, void *buf, size_t nsecs, bool write);
+int	virtio_blk_wait(int tag);
+int	virtio_blk_read(uint32_t secno, void *dst, size_t nsecs);
+int	virtio_blk_write(uint32_t secno, const void *src, size_t nsecs);
+
+/* bio.c */
+typedef void (*bio_done_t)(uint32_t blockno, int r);
+void	bio_submit(uint32_t blockno, void *va, bool write, bio_done_t done);
+void	bio_flush(void);
+bool	bio_busy(uint32_t blockno);
+void	bio_wait_block(uint32_t blockno);
+void	bio_print_stats(void);
+
+/* thread.c */
+extern pthread_mutex_t fs_lock;
+extern bool fs_threaded;
+uint32_t fs_gen(void);
+void	fs_wait(uint32_t gen);
+void	fs_wake(void);
+void	fs_irq_register(int irq, void (*ack)(void));
+void	fs_irq_wait(int irq, uint32_t gen);
+void	fs_threads_start(void);
+void	fs_begin(bool write);
+void	fs_end(bool write);
+
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
 void	bc_init(void);
+void	bc_readahead(uint32_t blockno, uint32_t n);
+void	bc_writeback(void);
+void	bc_lend(void *va);
+void	bc_print_stats(void);
 
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_lookup_block(struct File *f, uint32_t filebno, char **blk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t n);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
@@ -44,6 +91,8 @@ void	fs_sync(void);
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_at(uint32_t blockno);
+void	bitmap_flush(void);
 
 /* test.c */
 void	fs_test(void);
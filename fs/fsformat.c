@@ -33,6 +33,8 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+// The file server maps at most DISKSIZE bytes of disk (see fs/fs.h)
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
 
 struct Dir
 {
@@ -134,17 +136,28 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	int i, j;
+	uint32_t n, *ind, *dind;
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
+	n = ROUNDUP(len, BLKSIZE) / BLKSIZE;
+	for (i = 0; i < n && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
+	if (i < n) {
+		ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < n && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i < n) {
+		dind = alloc(BLKSIZE);
+		f->f_dindirect = blockof(dind);
+		for (j = 0; i < n; ++j) {
+			ind = alloc(BLKSIZE);
+			dind[j] = blockof(ind);
+			for (; i < n && i < NDIRECT + NINDIRECT + (j + 1) * NINDIRECT; ++i)
+				ind[(i - NDIRECT - NINDIRECT) % NINDIRECT] = start + i;
+		}
+	}
 }
 
 void
@@ -161,6 +174,7 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	struct File *out = &d->ents[d->n++];
 	if (d->n > MAX_DIR_ENTS)
 		panic("too many directory entries");
+	memset(out, 0, sizeof *out);
 	strcpy(out->f_name, name);
 	out->f_type = type;
 	return out;
@@ -228,7 +242,7 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
 
 	opendisk(argv[1]);
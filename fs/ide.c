@@ -1,5 +1,10 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers use bus-master DMA when the
+ * kernel found a controller that can do it (see kern/idedma.c): the
+ * disk moves the data by itself while we sleep until its interrupt.
+ * Otherwise, or for a buffer that is not all mapped, they fall back to
+ * PIO with polling.  The disk does one command at a time, so request
+ * threads (see thread.c) take turns with it.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,7 +17,31 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+// Bus-master registers of the primary channel, from dma_port
+#define BM_CMD		0
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08		// The controller writes to memory
+#define BM_STATUS	2
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_INTR	0x04
+#define BM_PRDT		4
+
+// The physical region descriptor table, which tells the controller
+// where in memory a transfer goes: one entry per page of the buffer.
+#define PRDVA		0x0fe00000
+#define PRD_EOT		0x8000
+
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_count;
+	uint16_t prd_flags;
+};
+
 static int diskno = 1;
+static int dma_port;			// Bus-master base port, or 0 for PIO
+static struct Prd *prdt = (struct Prd *) PRDVA;
+static uint32_t prdt_pa;
+static bool ide_busy;			// A request thread has a command going
 
 static int
 ide_wait_ready(bool check_error)
@@ -60,6 +89,117 @@ ide_set_disk(int d)
 }
 
 
+// Reading the status register acknowledges the interrupt.
+static void
+ide_intr_ack(void)
+{
+	inb(0x1F7);
+}
+
+// Wait for the disk to be free, and claim it.
+static void
+ide_claim(void)
+{
+	uint32_t gen;
+
+	for (;;) {
+		gen = fs_gen();
+		if (!ide_busy)
+			break;
+		fs_wait(gen);
+	}
+	ide_busy = 1;
+}
+
+static void
+ide_release(void)
+{
+	ide_busy = 0;
+	fs_wake();
+}
+
+// Set up DMA if the kernel found a bus-master controller.
+void
+ide_dma_init(void)
+{
+	int r;
+
+	if ((r = sys_ide_bmbase()) < 0) {
+		cprintf("IDE: no bus-master DMA, using PIO\n");
+		return;
+	}
+	if (sys_page_alloc(0, prdt, PTE_P|PTE_U|PTE_W) < 0
+	    || (int) (prdt_pa = sys_dma_paddr(prdt)) < 0)
+		panic("ide_dma_init: cannot set up the PRD table");
+	dma_port = r;
+
+	// Let the drive interrupt (clear nIEN).
+	outb(0x3F6, 0);
+	fs_irq_register(IRQ_IDE, ide_intr_ack);
+}
+
+// Point the PRD table at the 'nsecs' sectors at 'buf'.
+// Returns 0 on success, < 0 if some page of 'buf' is not mapped.
+static int
+ide_dma_prepare(const void *buf, size_t nsecs)
+{
+	uintptr_t va, end;
+	uint32_t n;
+	int pa;
+
+	va = (uintptr_t) buf;
+	end = va + nsecs * SECTSIZE;
+	for (n = 0; va < end; n++, va = ROUNDDOWN(va, PGSIZE) + PGSIZE) {
+		if ((pa = sys_dma_paddr((void *) va)) < 0)
+			return pa;
+		prdt[n].prd_addr = pa;
+		prdt[n].prd_count = MIN(end, ROUNDDOWN(va, PGSIZE) + PGSIZE) - va;
+		prdt[n].prd_flags = 0;
+	}
+	prdt[n - 1].prd_flags = PRD_EOT;
+	return 0;
+}
+
+// Run a DMA transfer of 'nsecs' sectors from 'secno' on, to or from the
+// buffer ide_dma_prepare set up, and sleep until the disk is done.
+static int
+ide_dma(uint32_t secno, size_t nsecs, bool write)
+{
+	uint8_t dir = write ? 0 : BM_CMD_READ;
+	uint32_t gen;
+	int bmstat, r;
+
+	ide_wait_ready(0);
+
+	outb(dma_port + BM_CMD, 0);
+	outl(dma_port + BM_PRDT, prdt_pa);
+	outb(dma_port + BM_STATUS, BM_STATUS_INTR | BM_STATUS_ERR);
+	outb(dma_port + BM_CMD, dir);
+
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, write ? 0xCA : 0xC8);	// WRITE DMA or READ DMA
+	outb(dma_port + BM_CMD, dir | BM_CMD_START);
+
+	for (;;) {
+		gen = fs_gen();
+		if ((bmstat = inb(dma_port + BM_STATUS)) & BM_STATUS_INTR)
+			break;
+		fs_irq_wait(IRQ_IDE, gen);
+	}
+
+	outb(dma_port + BM_CMD, 0);
+	outb(dma_port + BM_STATUS, BM_STATUS_INTR | BM_STATUS_ERR);
+	// Reading the status register acknowledges the interrupt.
+	r = inb(0x1F7);
+	if ((bmstat & BM_STATUS_ERR) || (r & (IDE_DF|IDE_ERR)))
+		return -1;
+	return 0;
+}
+
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
 {
@@ -67,6 +207,17 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	if (dma_port) {
+		ide_claim();
+		if (ide_dma_prepare(dst, nsecs) == 0) {
+			r = ide_dma(secno, nsecs, 0);
+			ide_release();
+			return r;
+		}
+		// The disk is free, and PIO never lets another thread run.
+		ide_release();
+	}
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -92,6 +243,16 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	if (dma_port) {
+		ide_claim();
+		if (ide_dma_prepare(src, nsecs) == 0) {
+			r = ide_dma(secno, nsecs, 1);
+			ide_release();
+			return r;
+		}
+		ide_release();
+	}
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
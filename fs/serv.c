@@ -34,8 +34,52 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	bool o_reading;		// A serve_read of it is in progress
+	off_t o_ra_off;		// Offset a sequential read would start at
+	uint32_t o_ra_win;	// Blocks to read ahead; 0 if reads are random
+	uint32_t o_ra_end;	// File block read ahead up to
 };
 
+// Read-ahead.  A read that starts where the last one on the same open
+// file ended is sequential, and the window of blocks to read ahead of
+// it grows from RA_MINWIN up to BC_RAMAX; any other read closes the
+// window.  Each time a sequential reader gets past the middle of the
+// window, the next window is read with one disk command, after the
+// reply has gone out (see serve_request).
+#define RA_MINWIN	4
+
+// Requests are served by NWORKERS request threads (see thread.c), so
+// that one waiting for the disk does not hold up the rest.  serve, in
+// the main thread, receives each request and hands it to an idle
+// worker.  A worker has its own pages, in the window at WORKERVA: the
+// request page, IPC_MAXPAGES pages from which serve_map lends block
+// cache pages to the client, and a page on which serve_pagein
+// assembles pages it cannot lend.
+#define NWORKERS	8
+#define WORKERVA	0x0f000000
+#define WORKERSIZE	((IPC_MAXPAGES + 2) * PGSIZE)
+
+struct Worker {
+	pthread_t w_thread;
+	bool w_busy;		// Has a request to serve
+	uint32_t w_req;		// The request,
+	envid_t w_whom;		//	who sent it,
+	int w_perm;		//	and the perm of its page, if any
+	union Fsipc *w_page;	// Where its page is
+	char *w_mapva;		// Window serve_map lends pages from,
+	int w_map_npages;	//	and how many it lent last time
+	char *w_pageinva;
+	struct {
+		struct File *f;		// Read ahead in f, if not NULL,
+		uint32_t filebno;	//	from block filebno
+		uint32_t n;		//	for n blocks
+	} w_ra;
+	union Fsipc w_small;	// Small requests arrive as IPC words (see
+				// fsipc_small) and are copied here
+};
+
+static struct Worker workers[NWORKERS];
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
@@ -58,6 +102,26 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	va = WORKERVA;
+	for (i = 0; i < NWORKERS; i++) {
+		workers[i].w_page = (union Fsipc *) va;
+		workers[i].w_mapva = (char *) va + PGSIZE;
+		workers[i].w_pageinva = (char *) va + (IPC_MAXPAGES + 1) * PGSIZE;
+		va += WORKERSIZE;
+	}
+}
+
+// The worker the calling thread is.
+static struct Worker *
+worker_self(void)
+{
+	pthread_t self = pthread_self();
+	int i;
+
+	for (i = 0; i < NWORKERS; i++)
+		if (workers[i].w_thread == self)
+			return &workers[i];
+	panic("worker_self: not a request thread");
 }
 
 // Allocates an open file.
@@ -75,6 +139,9 @@ openfile_alloc(struct OpenFile **o)
 			/* fall through */
 		case 1:
 			opentab[i].o_fileid += MAXOPEN;
+			opentab[i].o_ra_off = 0;
+			opentab[i].o_ra_win = 0;
+			opentab[i].o_ra_end = 0;
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
 			return (*o)->o_fileid;
@@ -92,6 +159,9 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	o = &opentab[fileid % MAXOPEN];
 	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
 		return -E_INVAL;
+	// Another request thread may be reading in the block that holds
+	// the file's struct File.
+	bio_wait_block(((uintptr_t) o->o_file - DISKMAP) / BLKSIZE);
 	*po = o;
 	return 0;
 }
@@ -116,14 +186,6 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
 
-	// Find an open file ID
-	if ((r = openfile_alloc(&o)) < 0) {
-		if (debug)
-			cprintf("openfile_alloc failed: %e", r);
-		return r;
-	}
-	fileid = r;
-
 	// Opens the file
 	if (req->req_omode & O_CREAT) {
 		if ((r = file_create(path, &f)) < 0) {
@@ -156,6 +218,16 @@ try_open:
 		return r;
 	}
 
+	// Find an open file ID.  Only now: the file system calls above may
+	// wait for the disk, and another request thread would take an
+	// entry that is not handed out yet.
+	if ((r = openfile_alloc(&o)) < 0) {
+		if (debug)
+			cprintf("openfile_alloc failed: %e", r);
+		return r;
+	}
+	fileid = r;
+
 	// Save the file pointer
 	o->o_file = f;
 
@@ -200,6 +272,33 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Note a read of 'n' bytes at 'offset' of o, and plan read-ahead if it
+// is sequential.
+static void
+read_ahead(struct OpenFile *o, off_t offset, size_t n)
+{
+	struct Worker *w;
+	uint32_t next;
+
+	if (offset != o->o_ra_off || n == 0) {
+		o->o_ra_win = 0;
+		o->o_ra_end = 0;
+		o->o_ra_off = offset + n;
+		return;
+	}
+	o->o_ra_off = offset + n;
+
+	next = ROUNDUP(offset + n, BLKSIZE) / BLKSIZE;
+	if (next + o->o_ra_win / 2 < o->o_ra_end)
+		return;
+	o->o_ra_win = o->o_ra_win ? MIN(2 * o->o_ra_win, BC_RAMAX) : RA_MINWIN;
+	w = worker_self();
+	w->w_ra.f = o->o_file;
+	w->w_ra.filebno = MAX(next, o->o_ra_end);
+	w->w_ra.n = next + o->o_ra_win - w->w_ra.filebno;
+	o->o_ra_end = next + o->o_ra_win;
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -214,18 +313,32 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
 	
 	int res;
+	uint32_t gen;
 	struct OpenFile* openFile;
 	res = openfile_lookup(envid, req->req_fileid, &openFile);
 	if (res < 0)
 		return res;
-	
+
+	// Reads run side by side, and file_read may wait for the disk, so
+	// reads of one open file take turns: each must see the seek
+	// position the last one left.
+	for (;;) {
+		gen = fs_gen();
+		if (!openFile->o_reading)
+			break;
+		fs_wait(gen);
+	}
+	openFile->o_reading = 1;
+
 	ssize_t bitsRead;
 	bitsRead = file_read(openFile->o_file, ret->ret_buf, req->req_n, openFile->o_fd->fd_offset);
-	if (bitsRead < 0)
-		return bitsRead;
-	
-	openFile->o_fd->fd_offset += bitsRead;
+	if (bitsRead >= 0) {
+		read_ahead(openFile, openFile->o_fd->fd_offset, bitsRead);
+		openFile->o_fd->fd_offset += bitsRead;
+	}
 
+	openFile->o_reading = 0;
+	fs_wake();
 	return bitsRead;
 }
 
@@ -296,13 +409,139 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 }
 
 
+// Map the blocks of req->req_fileid read-only into the caller, starting
+// with the block at req->req_offset and covering at most req->req_npages
+// pages.  The caller gets the block cache's own pages, so no data is
+// copied, except for a last block that runs past the end of the file:
+// its bytes beyond the end are not the caller's to see, so it gets a
+// copy with them zeroed.  Sets *pg_store and *perm_store to send them as a page vector.
+// Returns the number of file bytes the pages hold (0 at end of file),
+// or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct Worker *w = worker_self();
+	struct OpenFile *o;
+	struct File *f;
+	char *blk;
+	int r, i, npages;
+	off_t valid;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x %d\n",
+			envid, req->req_fileid, req->req_offset, req->req_npages);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (req->req_offset < 0 || PGOFF(req->req_offset) != 0
+	    || req->req_npages <= 0 || req->req_npages > IPC_MAXPAGES)
+		return -E_INVAL;
+
+	// The client holds its own references to what we lent last time.
+	for (i = 0; i < w->w_map_npages; i++)
+		sys_page_unmap(0, w->w_mapva + i * PGSIZE);
+	w->w_map_npages = 0;
+
+	f = o->o_file;
+	if (req->req_offset >= f->f_size)
+		return 0;
+	npages = MIN(req->req_npages,
+		     ROUNDUP(f->f_size - req->req_offset, PGSIZE) / PGSIZE);
+
+	for (i = 0; i < npages; i++) {
+		if ((r = file_lookup_block(f, req->req_offset / BLKSIZE + i, &blk)) < 0)
+			return r;
+		valid = f->f_size - (req->req_offset + i * BLKSIZE);
+		if (!blk || valid < BLKSIZE) {
+			// A hole, or the file's tail: lend fresh zeros
+			// holding just the file's bytes instead.
+			r = sys_page_alloc(0, w->w_mapva + i * PGSIZE,
+					   PTE_P|PTE_W|PTE_U);
+			if (r >= 0 && blk)
+				memcpy(w->w_mapva + i * PGSIZE, blk, valid);
+		} else {
+			bc_lend(blk);
+			r = sys_page_map(0, blk, 0, w->w_mapva + i * PGSIZE,
+					 PTE_P|PTE_U);
+		}
+		if (r < 0)
+			return r;
+		w->w_map_npages++;
+	}
+
+	*pg_store = w->w_mapva;
+	*perm_store = PTE_P|PTE_U|IPC_PERM_PAGES(npages);
+	return MIN(npages * PGSIZE, f->f_size - req->req_offset);
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
 	fs_sync();
+	if (debug)
+		bc_print_stats();
 	return 0;
 }
 
+// Supply page req_va of demand-paged env 'envid', which faulted on it,
+// from its executable (see kern/pager.c).  A read-only page that is a
+// whole block of the file is lent from the block cache, as serve_map
+// does; any other is a fresh copy of the bytes it needs.  If the page
+// cannot be had, the kernel is told so, and destroys the env.
+// Returns 0 on success, < 0 on failure.
+int
+serve_pagein(envid_t envid, struct Fsreq_pagein *req)
+{
+	char *pageinva = worker_self()->w_pageinva;
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_pagein %08x %08x %08x %08x\n",
+			envid, req->req_fileid, req->req_offset, req->req_va);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0
+	    || req->req_offset < 0 || req->req_pgoff >= PGSIZE
+	    || req->req_len > PGSIZE - req->req_pgoff
+	    || req->req_offset + req->req_len > o->o_file->f_size) {
+		r = r < 0 ? r : -E_INVAL;
+		goto fail;
+	}
+
+	if (!(req->req_perm & PTE_W) && req->req_pgoff == 0
+	    && req->req_len == PGSIZE && PGOFF(req->req_offset) == 0) {
+		if ((r = file_lookup_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+			goto fail;
+		// A hole is copied, as zeros, below.
+		if (blk) {
+			bc_lend(blk);
+			return sys_pager_supply(envid, (void *) req->req_va, blk,
+						req->req_perm);
+		}
+	}
+
+	if ((r = sys_page_alloc(0, pageinva, PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	if ((r = file_read(o->o_file, pageinva + req->req_pgoff,
+			   req->req_len, req->req_offset)) != req->req_len) {
+		sys_page_unmap(0, pageinva);
+		r = r < 0 ? r : -E_INVAL;
+		goto fail;
+	}
+	r = sys_pager_supply(envid, (void *) req->req_va, pageinva,
+			     req->req_perm);
+	sys_page_unmap(0, pageinva);
+	return r;
+
+fail:
+	sys_pager_supply(envid, (void *) req->req_va, (void *) UTOP, 0);
+	return r;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -317,13 +556,103 @@ fshandler handlers[] = {
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
-void
-serve(void)
+// Does request 'req' change the file system?  Such a request runs
+// alone (see fs_begin).  The others run side by side, so they look
+// blocks up with file_lookup_block, which allocates nothing, and
+// serve_read keeps a file's seek position to one read at a time.
+static bool
+request_writes(uint32_t req, union Fsipc *args)
+{
+	switch (req) {
+	case FSREQ_OPEN:
+		return (args->open.req_omode & (O_CREAT | O_TRUNC)) != 0;
+	case FSREQ_READ:
+	case FSREQ_STAT:
+	case FSREQ_MAP:
+	case FSREQ_PAGEIN:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+// Serve w's request, holding fs_lock.
+static void
+serve_request(struct Worker *w)
 {
-	uint32_t req, whom;
+	uint32_t req = w->w_req;
+	envid_t whom = w->w_whom;
+	union Fsipc *args;
+	bool write;
 	int perm, r;
 	void *pg;
 
+	args = (w->w_perm & PTE_P) ? w->w_page : &w->w_small;
+	write = request_writes(req, args);
+	fs_begin(write);
+
+	pg = NULL;
+	perm = 0;
+	if (req == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)args, &pg, &perm);
+	} else if (req == FSREQ_MAP) {
+		r = serve_map(whom, (struct Fsreq_map*)args, &pg, &perm);
+	} else if (req == FSREQ_PAGEIN) {
+		// Answered with sys_pager_supply, not with a reply.
+		serve_pagein(whom, (struct Fsreq_pagein*)args);
+		fs_end(write);
+		return;
+	} else if (req < NHANDLERS && handlers[req]) {
+		r = handlers[req](whom, args);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+	}
+	// Write back the bitmap blocks the request changed before
+	// answering it.
+	bitmap_flush();
+	if (args == w->w_page)
+		sys_page_unmap(0, w->w_page);
+
+	// Never block on the reply: a client whose IPC queue is full would
+	// stall the server.  It is dropped instead, as ipc_reply_wait used
+	// to.  Then read ahead for the client, once it has gone on.
+	sys_ipc_try_send(whom, r, pg ? pg : (void *) UTOP + 1, perm);
+	if (w->w_ra.f)
+		file_readahead(w->w_ra.f, w->w_ra.filebno, w->w_ra.n);
+	w->w_ra.f = NULL;
+	fs_end(write);
+}
+
+// Body of a request thread.
+static void *
+worker_main(void *arg)
+{
+	struct Worker *w = arg;
+	uint32_t gen;
+
+	pthread_mutex_lock(&fs_lock);
+	while (1) {
+		gen = fs_gen();
+		if (!w->w_busy) {
+			fs_wait(gen);
+			continue;
+		}
+		serve_request(w);
+		w->w_busy = 0;
+		// serve may be waiting for an idle worker.
+		fs_wake();
+	}
+	return NULL;
+}
+
+void
+serve(void)
+{
+	uint32_t req, whom, gen;
+	struct Worker *w;
+	int perm, i, r;
+
 	while (1) {
 		perm = 0;
 		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
@@ -331,30 +660,63 @@ serve(void)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All requests must contain an argument page or words
+		if (thisenv->env_ipc_nwords == 0 && !(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+		pthread_mutex_lock(&fs_lock);
+		for (;;) {
+			gen = fs_gen();
+			for (i = 0; i < NWORKERS && workers[i].w_busy; i++)
+				/* do nothing */;
+			if (i < NWORKERS)
+				break;
+			fs_wait(gen);
+		}
+		w = &workers[i];
+		w->w_req = req;
+		w->w_whom = whom;
+		w->w_perm = 0;
+		if (ipc_get_words((uint32_t *) &w->w_small) == 0) {
+			// Hand the request page over.
+			if ((r = sys_page_map(0, fsreq, 0, w->w_page, perm & PTE_SYSCALL)) < 0)
+				panic("serve: sys_page_map: %e", r);
+			sys_page_unmap(0, fsreq);
+			w->w_perm = perm;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		w->w_busy = 1;
+		fs_wake();
+		pthread_mutex_unlock(&fs_lock);
+	}
+}
+
+// Body of the flusher thread, which writes back dirty blocks every
+// BC_WRITEBACK_MS.
+static void *
+flusher_main(void *arg)
+{
+	uint32_t never = 0;
+
+	while (1) {
+		sys_futex_wait(&never, 0, BC_WRITEBACK_MS);
+		pthread_mutex_lock(&fs_lock);
+		fs_begin(1);
+		bc_writeback();
+		fs_end(1);
+		pthread_mutex_unlock(&fs_lock);
 	}
+	return NULL;
 }
 
 void
 umain(int argc, char **argv)
 {
+	pthread_t flusher_thread;
+	int i;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
@@ -365,6 +727,12 @@ umain(int argc, char **argv)
 
 	serve_init();
 	fs_init();
+	fs_threads_start();
+	for (i = 0; i < NWORKERS; i++)
+		if (pthread_create(&workers[i].w_thread, worker_main,
+				   &workers[i]) < 0)
+			panic("cannot start request thread %d", i);
+	if (pthread_create(&flusher_thread, flusher_main, NULL) < 0)
+		panic("cannot start the flusher thread");
 	serve();
 }
-
@@ -0,0 +1,153 @@
+// Request threads.  Once the file system is up, each client request is
+// served by one of a pool of worker threads (see serve in serv.c), so
+// that a request waiting for the disk does not hold up the others.
+//
+// The threads are cooperative: all of the server's state is guarded by
+// fs_lock, which a thread gives up only while it waits in fs_wait, for
+// a disk command or for another thread.  fs_wait sleeps until the next
+// fs_wake after the caller sampled fs_gen, which the disk interrupt
+// threads call when their IRQ arrives and the other threads call when
+// they have changed something a waiter may be waiting for.  Code that
+// waits therefore takes the form
+//
+//	for (;;) {
+//		gen = fs_gen();
+//		if (what we want has happened)
+//			break;
+//		fs_wait(gen);
+//	}
+//
+// Requests that only read the file system run side by side; one that
+// changes it runs alone, through its disk waits too (see fs_begin).
+
+#include "fs.h"
+
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+bool fs_threaded;
+
+static volatile uint32_t fs_events;
+
+// Disk interrupts, and how to acknowledge each to its device.
+#define FS_MAXIRQS	2
+
+static struct {
+	int irq;
+	void (*ack)(void);
+} fs_irqs[FS_MAXIRQS];
+static int fs_nirqs;
+
+// Requests in progress: readers, whether a writer is running, and how
+// many writers wait for it.
+static uint32_t fs_readers;
+static bool fs_writer;
+static uint32_t fs_writers_waiting;
+
+uint32_t
+fs_gen(void)
+{
+	return fs_events;
+}
+
+// Wake the threads in fs_wait.
+void
+fs_wake(void)
+{
+	__sync_fetch_and_add(&fs_events, 1);
+	if (fs_threaded)
+		sys_futex_wake(&fs_events, PTHREAD_MAX);
+}
+
+// Give up fs_lock until fs_wake is called, unless it has been since
+// fs_gen returned 'gen'.  Before the threads start there is nobody to
+// wait for, and it returns at once.
+void
+fs_wait(uint32_t gen)
+{
+	if (!fs_threaded)
+		return;
+	pthread_mutex_unlock(&fs_lock);
+	sys_futex_wait(&fs_events, gen, 0);
+	pthread_mutex_lock(&fs_lock);
+}
+
+// Have the interrupt thread started by fs_threads_start wait for 'irq'
+// and call 'ack' to acknowledge it.
+void
+fs_irq_register(int irq, void (*ack)(void))
+{
+	assert(fs_nirqs < FS_MAXIRQS && !fs_threaded);
+	fs_irqs[fs_nirqs].irq = irq;
+	fs_irqs[fs_nirqs++].ack = ack;
+}
+
+// A driver waits for its device's interrupt 'irq'.  Request threads
+// leave that to the interrupt thread and wait in fs_wait; before they
+// start, the driver waits for the IRQ itself.
+void
+fs_irq_wait(int irq, uint32_t gen)
+{
+	if (fs_threaded)
+		fs_wait(gen);
+	else
+		sys_irq_wait(irq);
+}
+
+static void *
+irq_main(void *arg)
+{
+	int i = (int) arg;
+
+	while (1) {
+		sys_irq_wait(fs_irqs[i].irq);
+		fs_irqs[i].ack();
+		fs_wake();
+	}
+	return NULL;
+}
+
+// Start the disk interrupt threads; from now on the server runs
+// request threads.
+void
+fs_threads_start(void)
+{
+	pthread_t t;
+	int i;
+
+	fs_threaded = 1;
+	for (i = 0; i < fs_nirqs; i++)
+		if (pthread_create(&t, irq_main, (void *) i) < 0)
+			panic("cannot start the thread for irq %d", fs_irqs[i].irq);
+}
+
+// Start a request, holding fs_lock: one that changes the file system
+// ('write') once no other is running, and one that reads it once no
+// writer is running or waiting.
+void
+fs_begin(bool write)
+{
+	uint32_t gen;
+
+	if (write)
+		fs_writers_waiting++;
+	for (;;) {
+		gen = fs_gen();
+		if (!fs_writer && (write ? fs_readers == 0 : fs_writers_waiting == 0))
+			break;
+		fs_wait(gen);
+	}
+	if (write) {
+		fs_writers_waiting--;
+		fs_writer = 1;
+	} else
+		fs_readers++;
+}
+
+void
+fs_end(bool write)
+{
+	if (write)
+		fs_writer = 0;
+	else
+		fs_readers--;
+	fs_wake();
+}
@@ -0,0 +1,354 @@
+/*
+ * Driver for a legacy virtio block device, which QEMU offers in place
+ * of an IDE disk with -drive if=virtio.  Requests go to the device
+ * through a virtqueue in shared memory, so issuing one takes a single
+ * I/O port write however large it is, several can be outstanding at
+ * once, and the device says it is done with an interrupt.
+ * The kernel finds the device (see kern/virtio.c); everything else
+ * happens here.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+// Registers, from the base I/O port
+#define VIRTIO_DEV_FEATURES	0x00
+#define VIRTIO_GUEST_FEATURES	0x04
+#define VIRTIO_QUEUE_PFN	0x08
+#define VIRTIO_QUEUE_SIZE	0x0C
+#define VIRTIO_QUEUE_SEL	0x0E
+#define VIRTIO_QUEUE_NOTIFY	0x10
+#define VIRTIO_STATUS		0x12
+#define VIRTIO_ISR		0x13
+
+#define VIRTIO_STATUS_ACK	0x01
+#define VIRTIO_STATUS_DRIVER	0x02
+#define VIRTIO_STATUS_DRIVER_OK	0x04
+#define VIRTIO_STATUS_FAILED	0x80
+
+// The virtqueue: descriptors, which point at buffers and chain them
+// into requests, the ring of requests handed to the device, and the
+// ring of those the device has finished.
+#define VRING_DESC_NEXT		0x1
+#define VRING_DESC_WRITE	0x2	// The device writes the buffer
+
+struct VringDesc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct VringAvail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct VringUsed {
+	uint16_t flags;
+	uint16_t idx;
+	struct {
+		uint32_t id;
+		uint32_t len;
+	} ring[];
+};
+
+// A block request is a descriptor chain: this header, the data, one
+// descriptor per page of it, and a status byte the device fills in.
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+#define VIRTIO_BLK_S_OK		0
+
+struct VirtioBlkHdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+// The virtqueue is in physically contiguous pages at VRINGVA, and the
+// request headers and status bytes in a page at VREQVA.
+#define VRINGVA		0x0fd00000
+#define VRING_MAXSIZE	256
+#define VRING_MAXPAGES	3
+#define VREQVA		(VRINGVA + VRING_MAXPAGES * PGSIZE)
+
+// Most requests outstanding at once
+#define VIRTIO_NREQ	32
+
+struct VirtioReq {
+	struct VirtioBlkHdr hdr;
+	uint8_t status;
+	uint8_t state;		// REQ_FREE, REQ_BUSY or REQ_DONE
+	uint16_t head;		// First descriptor of the chain
+	uint32_t pad[2];
+};
+
+enum {
+	REQ_FREE = 0,
+	REQ_BUSY,
+	REQ_DONE,
+};
+
+static uint32_t port;			// Base I/O port, or 0 for no device
+static uint32_t irq;
+static uint16_t qsize;
+static volatile struct VringDesc *desc;
+static volatile struct VringAvail *avail;
+static volatile struct VringUsed *used;
+static uint16_t used_idx;		// Next entry of used to look at
+static uint16_t free_head;		// Chain of free descriptors
+static uint16_t nfree;
+static uint16_t desc_req[VRING_MAXSIZE];	// Request of each chain head
+static struct VirtioReq *reqs = (struct VirtioReq *) VREQVA;
+static uint32_t reqs_pa;
+
+// Reading the ISR acknowledges the interrupt.
+static void
+virtio_intr_ack(void)
+{
+	inb(port + VIRTIO_ISR);
+}
+
+// Set up the device, if the kernel found one.
+// Returns true if there is a virtio disk to use.
+bool
+virtio_blk_init(void)
+{
+	uint32_t ringsize, i;
+	int pa;
+
+	static_assert(sizeof(struct VirtioReq) * VIRTIO_NREQ <= PGSIZE);
+
+	if (sys_virtio_blk_info(&port, &irq) < 0) {
+		port = 0;
+		return 0;
+	}
+
+	outb(port + VIRTIO_STATUS, 0);
+	outb(port + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+	outb(port + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	// We need none of the optional features.
+	outl(port + VIRTIO_GUEST_FEATURES, 0);
+
+	// A legacy device dictates the size of its queue.
+	outw(port + VIRTIO_QUEUE_SEL, 0);
+	qsize = inw(port + VIRTIO_QUEUE_SIZE);
+	ringsize = ROUNDUP(sizeof(struct VringDesc) * qsize
+			   + sizeof(struct VringAvail) + 2 * (qsize + 1), PGSIZE)
+		+ ROUNDUP(sizeof(struct VringUsed) + 8 * qsize + 2, PGSIZE);
+	if (qsize == 0 || qsize > VRING_MAXSIZE
+	    || ringsize > VRING_MAXPAGES * PGSIZE) {
+		cprintf("virtio-blk: cannot use queue of size %d\n", qsize);
+		goto fail;
+	}
+	if ((pa = sys_dma_alloc((void *) VRINGVA, ringsize / PGSIZE)) < 0
+	    || sys_page_alloc(0, reqs, PTE_P|PTE_U|PTE_W) < 0
+	    || (int) (reqs_pa = sys_dma_paddr(reqs)) < 0) {
+		cprintf("virtio-blk: cannot allocate the queue\n");
+		goto fail;
+	}
+
+	desc = (struct VringDesc *) VRINGVA;
+	avail = (struct VringAvail *) (VRINGVA + sizeof(struct VringDesc) * qsize);
+	used = (struct VringUsed *) (VRINGVA + ROUNDUP(
+		sizeof(struct VringDesc) * qsize
+		+ sizeof(struct VringAvail) + 2 * (qsize + 1), PGSIZE));
+	for (i = 0; i < qsize; i++)
+		desc[i].next = i + 1;
+	free_head = 0;
+	nfree = qsize;
+	used_idx = 0;
+
+	outl(port + VIRTIO_QUEUE_PFN, (uint32_t) pa / PGSIZE);
+	outb(port + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER
+	     | VIRTIO_STATUS_DRIVER_OK);
+	fs_irq_register(irq, virtio_intr_ack);
+	cprintf("virtio-blk: queue of %d\n", qsize);
+	return 1;
+
+fail:
+	outb(port + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+	port = 0;
+	return 0;
+}
+
+bool
+virtio_blk_present(void)
+{
+	return port != 0;
+}
+
+// Take the requests the device has finished off the used ring and
+// free their descriptors.
+static void
+virtio_reap(void)
+{
+	struct VirtioReq *req;
+	uint16_t d, start = used_idx;
+
+	while (used_idx != used->idx) {
+		// Read the entry only after seeing the index move.
+		__sync_synchronize();
+		d = used->ring[used_idx % qsize].id;
+		req = &reqs[desc_req[d]];
+		req->state = REQ_DONE;
+		for (;;) {
+			nfree++;
+			if (!(desc[d].flags & VRING_DESC_NEXT))
+				break;
+			d = desc[d].next;
+		}
+		desc[d].next = free_head;
+		free_head = req->head;
+		used_idx++;
+	}
+	// Request threads may be waiting for these.
+	if (used_idx != start)
+		fs_wake();
+}
+
+// Sleep until the device finishes some request.
+static void
+virtio_sleep(void)
+{
+	uint16_t idx = used_idx;
+	uint32_t gen = fs_gen();
+
+	virtio_reap();
+	if (used_idx != idx)
+		return;
+	// Reading the ISR acknowledges the interrupt, and the kernel
+	// leaves the IRQ masked until we wait again.
+	inb(port + VIRTIO_ISR);
+	virtio_reap();
+	if (used_idx == idx)
+		fs_irq_wait(irq, gen);
+}
+
+// Start a transfer of 'nsecs' sectors from 'secno' on, to the disk
+// from 'buf' if 'write' is set and the other way if not, and return
+// without waiting for it.  Waits for the device to give descriptors
+// back if the queue is short of them.
+// Returns a tag to pass to virtio_blk_wait on success, < 0 on error.
+// Errors are:
+//	-E_AGAIN if every request is taken.  Some may be done and only
+//		waiting for virtio_blk_wait, perhaps the caller's own, so
+//		the caller must collect one of its own or, holding none,
+//		wait for other threads to collect theirs.
+//	-E_INVAL if some page of 'buf' is not mapped.
+int
+virtio_blk_submit(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	struct VirtioReq *req;
+	uintptr_t va, end;
+	uint16_t d, ndesc;
+	int r, pa;
+
+	assert(port);
+	end = (uintptr_t) buf + nsecs * SECTSIZE;
+	ndesc = 2 + (ROUNDUP(end, PGSIZE) - ROUNDDOWN((uintptr_t) buf, PGSIZE))
+		/ PGSIZE;
+	assert(ndesc <= qsize);
+
+	for (;;) {
+		for (r = 0; r < VIRTIO_NREQ; r++)
+			if (reqs[r].state == REQ_FREE)
+				break;
+		if (r == VIRTIO_NREQ)
+			return -E_AGAIN;
+		if (nfree >= ndesc)
+			break;
+		// Only requests on the device hold descriptors.
+		virtio_sleep();
+	}
+
+	req = &reqs[r];
+	req->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	req->hdr.reserved = 0;
+	req->hdr.sector = secno;
+	req->status = 0xFF;
+
+	// The header
+	d = req->head = free_head;
+	desc[d].addr = reqs_pa + (uintptr_t) &req->hdr - VREQVA;
+	desc[d].len = sizeof(req->hdr);
+	desc[d].flags = VRING_DESC_NEXT;
+
+	// The data, a page at a time
+	for (va = (uintptr_t) buf; va < end;
+	     va = ROUNDDOWN(va, PGSIZE) + PGSIZE) {
+		if ((pa = sys_dma_paddr((void *) va)) < 0)
+			return pa;
+		d = desc[d].next;
+		desc[d].addr = pa;
+		desc[d].len = MIN(end, ROUNDDOWN(va, PGSIZE) + PGSIZE) - va;
+		desc[d].flags = VRING_DESC_NEXT | (write ? 0 : VRING_DESC_WRITE);
+	}
+
+	// The status byte
+	d = desc[d].next;
+	desc[d].addr = reqs_pa + (uintptr_t) &req->status - VREQVA;
+	desc[d].len = 1;
+	desc[d].flags = VRING_DESC_WRITE;
+
+	free_head = desc[d].next;
+	nfree -= ndesc;
+	desc_req[req->head] = r;
+	req->state = REQ_BUSY;
+
+	avail->ring[avail->idx % qsize] = req->head;
+	// The device must see the ring entry before the index moves,
+	// and the index before it is told to look.
+	__sync_synchronize();
+	avail->idx++;
+	__sync_synchronize();
+	outw(port + VIRTIO_QUEUE_NOTIFY, 0);
+	return r;
+}
+
+// Wait for the request 'tag' from virtio_blk_submit to finish.
+// Returns 0 on success, -E_UNSPECIFIED if the device failed it.
+int
+virtio_blk_wait(int tag)
+{
+	struct VirtioReq *req = &reqs[tag];
+
+	assert(tag >= 0 && tag < VIRTIO_NREQ && req->state != REQ_FREE);
+	while (req->state == REQ_BUSY)
+		virtio_sleep();
+	req->state = REQ_FREE;
+	fs_wake();
+	return req->status == VIRTIO_BLK_S_OK ? 0 : -E_UNSPECIFIED;
+}
+
+// Submit a transfer and wait for it.  The caller holds no requests,
+// so if they are all taken, it waits for their threads to free one.
+static int
+virtio_blk_rw(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	uint32_t gen;
+	int r;
+
+	for (;;) {
+		gen = fs_gen();
+		if ((r = virtio_blk_submit(secno, buf, nsecs, write)) != -E_AGAIN)
+			break;
+		fs_wait(gen);
+	}
+	if (r < 0)
+		return r;
+	return virtio_blk_wait(r);
+}
+
+int
+virtio_blk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return virtio_blk_rw(secno, dst, nsecs, 0);
+}
+
+int
+virtio_blk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return virtio_blk_rw(secno, (void *) src, nsecs, 1);
+}
@@ -0,0 +1,59 @@
+// Single-producer/single-consumer record channels between environments.
+// See lib/channel.c.
+
+#ifndef JOS_INC_CHANNEL_H
+#define JOS_INC_CHANNEL_H 1
+
+#include <inc/types.h>
+
+#define CHAN_LINE	64		// Cache line size
+#define CHAN_MAGIC	0x4348414e	// "CHAN"
+
+// Flags for chan_create
+#define CHAN_BLOCK	0x1		// Support chan_send_wait/chan_recv_wait
+
+// The header page at the start of a channel's shared region.
+// Each side writes only its own cache line, so in the common case the
+// two sides never bounce a line between their CPUs.  The exception is
+// the other side's sleep flag, which is cleared when waking it.
+struct ChanShared {
+	// Producer's line
+	volatile uint32_t cs_head;	// Records published so far
+	volatile uint32_t cs_closed;	// Producer is done sending
+	volatile uint32_t cs_pevent;	// Bumped when waking the consumer
+	volatile uint32_t cs_psleep;	// Producer sleeps on cs_cevent
+	uint8_t cs_pad0[CHAN_LINE - 4 * sizeof(uint32_t)];
+
+	// Consumer's line
+	volatile uint32_t cs_tail;	// Records consumed so far
+	volatile uint32_t cs_cevent;	// Bumped when waking the producer
+	volatile uint32_t cs_csleep;	// Consumer sleeps on cs_pevent
+	uint8_t cs_pad1[CHAN_LINE - 3 * sizeof(uint32_t)];
+
+	// Set up once by chan_create
+	uint32_t cs_magic;
+	uint32_t cs_flags;
+	uint32_t cs_recsize;		// Bytes per record
+	uint32_t cs_nrecs;		// Records in the ring, a power of 2
+} __attribute__((aligned(CHAN_LINE)));
+
+// One side's private handle on a channel.
+struct Chan {
+	struct ChanShared *ch_shared;
+	uint8_t *ch_ring;		// Record slots, after the header page
+	uint32_t ch_recsize;
+	uint32_t ch_mask;		// cs_nrecs - 1
+	uint32_t ch_cached;		// Last peer index we read
+};
+
+int	chan_create(struct Chan *ch, void *va, size_t recsize, size_t nrecs, int flags);
+int	chan_attach(struct Chan *ch, void *va);
+size_t	chan_size(size_t recsize, size_t nrecs);
+size_t	chan_send(struct Chan *ch, const void *recs, size_t n);
+size_t	chan_recv(struct Chan *ch, void *recs, size_t n);
+int	chan_send_wait(struct Chan *ch, const void *recs, size_t n);
+int	chan_recv_wait(struct Chan *ch, void *recs, size_t n);
+void	chan_close(struct Chan *ch);
+void	chan_destroy(struct Chan *ch);
+
+#endif	// !JOS_INC_CHANNEL_H
@@ -45,6 +45,61 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Service registry (see kern/registry.c): an env can register itself
+// under a name of up to SVC_NAMELEN - 1 characters, and up to
+// SVC_MAXINST envs can serve the same name.
+#define SVC_NAMELEN		16
+#define SVC_MAXINST		4
+
+// Demand paging (see kern/pager.c): a spawned env's executable segments
+// are recorded rather than loaded, and their pages are faulted in from
+// the file server on first touch.  The env keeps a private mapping of
+// its executable's Fd page at ENV_EXECFD so the file stays open.
+#define ENV_NSEGMENTS		4
+#define ENV_EXECFD		0xCFFFF000
+
+struct EnvSegment {
+	uintptr_t seg_va;		// First byte of the segment
+	uint32_t seg_memsz;		// Bytes in memory
+	uint32_t seg_filesz;		// Leading bytes backed by the file
+	uint32_t seg_offset;		// File offset of seg_va's byte
+	int seg_perm;			// PTE permissions of its pages
+};
+
+// Number of messages the kernel buffers for an env that is not
+// currently blocked in sys_ipc_recv.
+#define IPC_QUEUE_LEN		8
+
+// Instead of a page, a message can carry up to IPC_NWORDS words, which
+// the kernel copies into the receiver's env_ipc_words.  To send them,
+// point srcva at the words and pass IPC_PERM_WORDS(nwords) as perm.
+#define IPC_NWORDS		8
+#define IPC_PERM_WORDS(n)	((n) << 12)
+#define IPC_PERM_NWORDS(perm)	(((perm) >> 12) & 0xF)
+
+// A message can also carry up to IPC_MAXPAGES consecutive pages starting
+// at srcva: add IPC_PERM_PAGES(n) to the page perm bits.  The receiver
+// takes at most as many pages as it asked for (see sys_ipc_recv, and
+// IPC_RECV_PAGES(n) in the perm of sys_ipc_call and sys_ipc_reply_wait)
+// and finds the number it got in env_ipc_npages.
+#define IPC_MAXPAGES		16
+#define IPC_PERM_PAGES(n)	((n) << 16)
+#define IPC_PERM_NPAGES(perm)	(((perm) >> 16) & 0x1F)
+#define IPC_RECV_PAGES(n)	((n) << 24)
+#define IPC_PERM_RECVPAGES(perm)	(((perm) >> 24) & 0x1F)
+
+// A message buffered by the kernel on behalf of its receiver.
+// 'im_pages' hold a reference on each page being transferred.
+struct IpcMsg {
+	envid_t im_from;		// envid of the sender
+	uint32_t im_value;		// Data value
+	uint32_t im_npages;		// Number of pages to transfer
+	struct PageInfo *im_pages[IPC_MAXPAGES];	// Pages to transfer
+	int im_perm;			// Perm to map 'im_pages' with
+	uint32_t im_nwords;		// Number of words carried
+	uint32_t im_words[IPC_NWORDS];	// Words carried instead of a page
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -61,14 +116,46 @@ struct Env {
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_uxstacktop;	// Top of our user exception stack
+
+	// Threads (see sys_thread_create)
+	uintptr_t env_tls;		// Base of the GS segment, for TLS
 
 	// IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
+	uint32_t env_ipc_maxpages;	// Number of pages we take at dstva
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_ipc_npages;	// Number of pages received
+	uint32_t env_ipc_nwords;	// Number of words received
+	uint32_t env_ipc_words[IPC_NWORDS];	// Words received
+	struct IpcMsg env_ipc_queue[IPC_QUEUE_LEN];	// Buffered messages
+	uint32_t env_ipc_qhead;		// Index of the oldest buffered message
+	uint32_t env_ipc_qcount;	// Number of buffered messages
+	struct Env *env_ipc_waiters;	// Envs blocked sending to us
+	struct Env *env_ipc_sendto;	// Env we are blocked sending to
+	struct Env *env_ipc_waitlink;	// Next env on sendto's waiters list
+	struct IpcMsg env_ipc_pending;	// Message we are blocked sending
+	bool env_ipc_calling;		// Receive once the blocked send is taken
 	bool env_net_blocked;
+
+	// Blocking on user memory (futexes) and timeouts
+	physaddr_t env_futex_key;	// Futex we sleep on, 0 if none
+	struct Env *env_futex_link;	// Next env in our futex bucket
+	uint32_t env_deadline;		// time_msec() to give up at, 0 if none
+	struct Env *env_timeout_link;	// Next env with a deadline
+
+	// Service registry
+	uint32_t env_nservices;		// Names we are registered under
+
+	// Demand paging
+	struct EnvSegment env_segs[ENV_NSEGMENTS];	// Segments still paged in lazily
+	uint32_t env_nsegs;		// Number of env_segs in use
+	envid_t env_pager;		// Env that supplies file-backed pages
+	uint32_t env_pager_file;	// Pager's file id for our executable
+	uintptr_t env_pagein_va;	// Page we wait for from the pager, 0 if none
 };
 
 #endif // !JOS_INC_ENV_H
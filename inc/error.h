@@ -27,6 +27,8 @@ enum {
 	E_NOT_SUPP	,	// Operation not supported
 	E_NET_ERROR	,
 	E_MONITORED_FULL,
+	E_AGAIN		,	// Value changed before we could wait on it
+	E_TIMEOUT	,	// Timed out while waiting
 	MAXERROR
 };
 
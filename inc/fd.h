@@ -12,6 +12,10 @@ struct Fd;
 struct Stat;
 struct Dev;
 
+// Size of the data area each file descriptor gets (see fd2data).
+// Devices map as many pages of it as they need.
+#define FDDATASIZE	0x20000
+
 // Per-device-class file descriptor operations
 struct Dev {
 	int dev_id;
@@ -23,8 +23,14 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks the double-indirect block reaches: it points to
+// NINDIRECT indirect blocks
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Most blocks a file can have
+#define MAXFILEBLOCKS	(NDIRECT + NINDIRECT + NDINDIRECT)
+// The block map reaches past 4GB, but a file size must fit in an off_t.
+#define MAXFILESIZE	0x7FFFF000
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -35,10 +41,11 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// double-indirect block
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 8];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -70,7 +77,12 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map replies with file pages, read-only, as a page vector
+	FSREQ_MAP,
+	// Pagein is sent by the kernel for an env faulting on its
+	// executable, and answered with sys_pager_supply instead of a reply
+	FSREQ_PAGEIN
 };
 
 union Fsipc {
@@ -108,6 +120,19 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;	// Page-aligned file offset
+		int req_npages;
+	} map;
+	struct Fsreq_pagein {
+		int req_fileid;
+		off_t req_offset;	// File offset of the first byte
+		uintptr_t req_va;	// Page being faulted in
+		uint32_t req_pgoff;	// Where in the page the bytes go
+		uint32_t req_len;	// Bytes from the file; the rest is zero
+		int req_perm;		// Perm to supply the page with
+	} pagein;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -22,6 +22,8 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/channel.h>
+#include <inc/pthread.h>
 
 #define USED(x)		(void)(x)
 
@@ -30,10 +32,30 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
+// Per-thread data, found at the base of the GS segment (see
+// sys_env_set_tls).  The main thread's block lives in libmain's frame,
+// and other threads' at the top of their stacks (see lib/pthread.c).
+struct Tls {
+	struct Tls *tls_self;			// This block, for tls()
+	const volatile struct Env *tls_env;	// The thread's own Env
+	struct pthread *tls_thread;		// NULL in the main thread
+};
+
+static inline struct Tls *
+tls(void)
+{
+	struct Tls *t;
+
+	asm("movl %%gs:0,%0" : "=r" (t));
+	return t;
+}
+
+// Each thread's own Env
+#define thisenv		(tls()->tls_env)
+
 // exit.c
 void	exit(void);
 
@@ -53,12 +75,31 @@ static envid_t sys_exofork(void); //XXX
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_tls(envid_t env, void *tls);
+envid_t	sys_thread_create(void *eip, void *esp, void *tls, void *uxstacktop);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_pages(void *rcv_pg, int npages);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected, unsigned int timeout);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+int	sys_svc_register(const char *name);
+int	sys_svc_unregister(const char *name);
+envid_t	sys_svc_lookup(const char *name);
+envid_t	sys_spawn_elf(const void *binary, size_t size, void *stackva, uintptr_t esp,
+		      struct Fd *fd);
+int	sys_pager_supply(envid_t envid, void *va, void *srcva, int perm);
+int	sys_ide_bmbase(void);
+int	sys_irq_wait(int irq);
+int	sys_dma_paddr(void *va);
+int	sys_dma_alloc(void *va, size_t npages);
+int	sys_virtio_blk_info(uint32_t *port, uint32_t *irq);
 unsigned int sys_time_msec(void);
 int sys_set_priority(int priority);
 int sys_transmit(void* addr, size_t size);
@@ -99,7 +140,15 @@ sys_monitored_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, int npages,
+		       int *npages_store);
+int	ipc_get_words(uint32_t *words);
 envid_t	ipc_find_env(enum EnvType type);
+envid_t	ipc_find_service(const char *name);
 
 // fork.c
 #define	PTE_SHARE	0x400
@@ -124,6 +173,7 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	file_map(int fdnum, off_t offset, void *dstva, int npages);
 
 // pageref.c
 int	pageref(void *addr);
@@ -145,8 +195,14 @@ int     nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
+int     nsipc_send_pages(int s, void *pg, int npages, int off, int size,
+			 unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
 
+// splice.c
+ssize_t	splice(int fdin, int fdout, size_t n);
+ssize_t	vmsplice(int fdout, const void *buf, size_t n);
+
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
@@ -158,7 +214,9 @@ int	iscons(int fd);
 int	opencons(void);
 
 // pipe.c
+#define PIPE_MAXSIZE	(64 * 1024)	// Largest ring pipe_sized allows
 int	pipe(int pipefds[2]);
+int	pipe_sized(int pipefds[2], size_t size);
 int	pipeisclosed(int pipefd);
 
 // wait.c
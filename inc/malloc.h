@@ -3,5 +3,22 @@
 
 void *malloc(size_t size);
 void free(void *addr);
+void malloc_stats(void);
+int malloc_trace(bool on);
+
+// IPC values that make any program print its malloc_stats, or start or
+// stop tracing, when it next receives a message (see lib/ipc.c).
+#define MALLOC_IPC_STATS	0x6d537473	// "mSts"
+#define MALLOC_IPC_TRACE_ON	0x6d54724e	// "mTrN"
+#define MALLOC_IPC_TRACE_OFF	0x6d547246	// "mTrF"
+
+// Arenas hand out memory by bumping a pointer through chunks taken from
+// malloc, and release all of it at once.  See lib/arena.c.
+struct Arena;
+
+struct Arena *arena_create(void);
+void *arena_alloc(struct Arena *a, size_t size);
+void arena_reset(struct Arena *a);
+void arena_destroy(struct Arena *a);
 
 #endif
@@ -26,6 +26,8 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// Send data from the pages that follow the request page
+	NSREQ_SENDPAGES,
 
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
@@ -91,6 +93,13 @@ union Nsipc {
 		char req_buf[0];
 	} send;
 
+	struct Nsreq_sendpages {
+		int req_s;
+		int req_off;		// Offset of the data in the first data page
+		int req_size;
+		unsigned int req_flags;
+	} sendpages;
+
 	struct Nsreq_socket {
 		int req_domain;
 		int req_type;
@@ -0,0 +1,39 @@
+// Threads sharing an environment's address space, with a small subset
+// of the POSIX interface.  See lib/pthread.c.
+
+#ifndef JOS_INC_PTHREAD_H
+#define JOS_INC_PTHREAD_H 1
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Thread i lives in the slot of PTHREAD_SLOTSIZE bytes at
+// PTHREAD_BASE + i * PTHREAD_SLOTSIZE: a guard page, its exception
+// stack, a page it copies copy-on-write pages through (see
+// pthread_pftemp), unmapped guard pages, and its stack of
+// PTHREAD_STKPAGES pages at the top.
+#define PTHREAD_BASE		0xE0000000
+#define PTHREAD_MAX		64
+#define PTHREAD_SLOTSIZE	(16 * PGSIZE)
+#define PTHREAD_STKPAGES	8
+
+typedef struct pthread *pthread_t;
+
+typedef struct {
+	volatile uint32_t m_state;	// 0 free, 1 held, 2 held with waiters
+} pthread_mutex_t;
+
+#define PTHREAD_MUTEX_INITIALIZER	{ 0 }
+
+int	pthread_create(pthread_t *thread, void *(*fn)(void *), void *arg);
+int	pthread_join(pthread_t thread, void **retval);
+void	pthread_exit(void *retval) __attribute__((noreturn));
+pthread_t	pthread_self(void);
+void	*pthread_pftemp(void);
+
+int	pthread_mutex_init(pthread_mutex_t *m);
+int	pthread_mutex_lock(pthread_mutex_t *m);
+int	pthread_mutex_trylock(pthread_mutex_t *m);
+int	pthread_mutex_unlock(pthread_mutex_t *m);
+
+#endif /* !JOS_INC_PTHREAD_H */
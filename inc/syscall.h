@@ -29,6 +29,23 @@ enum {
 	SYS_kill_monitored_envs,
 	SYS_get_monitored_env_amount,
 	SYS_kill_flag,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_svc_register,
+	SYS_svc_unregister,
+	SYS_svc_lookup,
+	SYS_spawn_elf,
+	SYS_pager_supply,
+	SYS_thread_create,
+	SYS_env_set_tls,
+	SYS_ide_bmbase,
+	SYS_irq_wait,
+	SYS_dma_paddr,
+	SYS_dma_alloc,
+	SYS_virtio_blk_info,
 	NSYSCALLS
 };
 
@@ -293,4 +293,18 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically store newval at addr if it holds oldval.
+// Returns the value addr held.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0" :
+			"+m" (*addr), "=a" (result) :
+			"r" (newval), "1" (oldval) :
+			"cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -14,6 +14,10 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/ipc.h>
+#include <kern/futex.h>
+#include <kern/time.h>
+#include <kern/registry.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -21,6 +25,9 @@ static struct Env *env_free_list;	// Free environment list
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
+// Software PTE bit the user library marks shared pages with (inc/lib.h)
+#define PTE_SHARE	0x400
+
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -36,7 +43,11 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 
-struct Segdesc gdt[NCPU + 5] =
+// Per-CPU thread-local storage segments, loaded into GS with the base
+// set to the running env's env_tls (see env_run).
+#define GD_TLS0		(GD_TSS0 + (NCPU << 3))
+
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +66,10 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU TLS descriptors (starting from GD_TLS0) are set in env_run()
+	[GD_TLS0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -257,6 +271,27 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_pgfault_upcall = 0;
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	// Start with an empty message queue.
+	e->env_ipc_qhead = 0;
+	e->env_ipc_qcount = 0;
+	e->env_ipc_waiters = NULL;
+	e->env_ipc_sendto = NULL;
+	e->env_ipc_waitlink = NULL;
+	e->env_ipc_pending.im_npages = 0;
+	e->env_ipc_calling = 0;
+	// Not sleeping on anything.
+	e->env_futex_key = 0;
+	e->env_futex_link = NULL;
+	e->env_deadline = 0;
+	e->env_timeout_link = NULL;
+	e->env_nservices = 0;
+	// One thread, with the usual exception stack and no TLS yet.
+	e->env_uxstacktop = UXSTACKTOP;
+	e->env_tls = 0;
+	// Fully loaded until a lazy spawn says otherwise.
+	e->env_nsegs = 0;
+	e->env_pager = 0;
+	e->env_pagein_va = 0;
 
 
 	//net block init
@@ -299,6 +334,191 @@ region_alloc(struct Env *e, void *va, size_t len)
 }
 
 
+// Pages of the read-only segments of binaries embedded in the kernel,
+// shared by all the envs env_create makes from the same binary.
+#define ICACHE_SIZE	256
+static struct {
+	const uint8_t *ic_binary;	// Image the page came from
+	uintptr_t ic_va;		// Where the image wants the page
+	struct PageInfo *ic_page;	// Holds a reference
+} icache[ICACHE_SIZE];
+static int icache_used;
+
+// Return a page that can be mapped read-only at 'va', which lies in
+// segment 'ph' of the ELF image at 'binary', instead of a copy: one
+// whose page of the segment needs no zeroing.  A user image (in curenv's address space) lends its own page,
+// which for spawn is the file server's cache page for the program, so
+// all instances of a program share it.  A kernel image gets a page
+// from icache.  Returns NULL if the page must be copied.
+static struct PageInfo *
+elf_shared_page(const uint8_t *binary, const struct Proghdr *ph,
+		uintptr_t va, bool user)
+{
+	const uint8_t *src;
+	struct PageInfo *pp;
+	uintptr_t lo, hi;
+	int i;
+
+	if ((ph->p_flags & ELF_PROG_FLAG_WRITE)
+	    || PGOFF(ph->p_offset) != PGOFF(ph->p_va)
+	    || (va + PGSIZE > ph->p_va + ph->p_filesz && ph->p_memsz != ph->p_filesz))
+		return NULL;
+
+	if (user) {
+		src = binary + ROUNDDOWN(ph->p_offset, PGSIZE)
+			+ (va - ROUNDDOWN(ph->p_va, PGSIZE));
+		return PGOFF(binary) ? NULL
+			: page_lookup(curenv->env_pgdir, (void *) src, NULL);
+	}
+
+	for (i = 0; i < icache_used; i++)
+		if (icache[i].ic_binary == binary && icache[i].ic_va == va)
+			return icache[i].ic_page;
+	if (icache_used == ICACHE_SIZE || !(pp = page_alloc(ALLOC_ZERO)))
+		return NULL;
+	// Copy only the segment's own bytes, so no kernel memory leaks in.
+	lo = MAX(va, ph->p_va);
+	hi = MIN(va + PGSIZE, ph->p_va + ph->p_filesz);
+	memcpy((uint8_t *) page2kva(pp) + PGOFF(lo),
+	       binary + ph->p_offset + (lo - ph->p_va), hi - lo);
+	pp->pp_ref++;
+	icache[icache_used].ic_binary = binary;
+	icache[icache_used].ic_va = va;
+	icache[icache_used++].ic_page = pp;
+	return pp;
+}
+
+// Does a load segment of 'elf' other than 'ph' touch page 'va'?  Such a
+// page cannot be shared, as loading the other segment writes to it.
+static bool
+elf_page_overlaps(const struct Elf *elf, const struct Proghdr *ph,
+		  uintptr_t va)
+{
+	const struct Proghdr *q;
+	int i;
+
+	q = (const struct Proghdr *) ((const uint8_t *) elf + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++, q++)
+		if (q != ph && q->p_type == ELF_PROG_LOAD && q->p_memsz
+		    && va < q->p_va + q->p_memsz && q->p_va < va + PGSIZE)
+			return 1;
+	return 0;
+}
+
+// Record segment 'ph' of e's executable in env_segs to be paged in on
+// demand (see kern/pager.c).
+// Returns 0 on success, -E_NOT_SUPP if e has no room for the segment
+// or it shares a page with one already recorded, as the pager fills
+// each page from a single segment.
+static int
+elf_lazy_segment(struct Env *e, const struct Proghdr *ph, int perm)
+{
+	struct EnvSegment *seg;
+	uint32_t i;
+
+	for (i = 0; i < e->env_nsegs; i++) {
+		seg = &e->env_segs[i];
+		if (ROUNDDOWN(ph->p_va, PGSIZE) < ROUNDUP(seg->seg_va + seg->seg_memsz, PGSIZE)
+		    && ROUNDDOWN(seg->seg_va, PGSIZE) < ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE))
+			return -E_NOT_SUPP;
+	}
+	if (e->env_nsegs == ENV_NSEGMENTS)
+		return -E_NOT_SUPP;
+
+	seg = &e->env_segs[e->env_nsegs++];
+	seg->seg_va = ph->p_va;
+	seg->seg_memsz = ph->p_memsz;
+	seg->seg_filesz = ph->p_filesz;
+	seg->seg_offset = ph->p_offset;
+	seg->seg_perm = perm;
+	return 0;
+}
+
+// Load the ELF image of 'size' bytes at 'binary' into the fresh env
+// 'e', and point its eip at the entry point.  A 'user' image lives in
+// curenv's address space and is checked field by field; a kernel image
+// (load_icode) is trusted.  Page tables are never switched: segments
+// are copied into e's new pages through the kernel mapping of physical
+// memory, or their pages shared where elf_shared_page allows and no
+// other segment touches the page.
+// A 'lazy' image is only the headers: its segments are recorded with
+// elf_lazy_segment, and the file server checks them against the file.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_FAULT if [binary, binary+size) is not readable by the user.
+//	-E_NOT_EXEC if the image is malformed.
+//	-E_NO_MEM if we run out of memory.
+//	-E_NOT_SUPP if a lazy image's segments cannot be paged in.
+// On error, the pages already loaded are left for env_free.
+static int
+elf_load(struct Env *e, const uint8_t *binary, size_t size, bool user,
+	 bool lazy)
+{
+	const struct Elf *elf = (const struct Elf *) binary;
+	const struct Proghdr *ph;
+	struct PageInfo *pp;
+	uintptr_t va, lo, hi;
+	int i, perm, r;
+
+	if (user && user_mem_check(curenv, binary, size, PTE_U) < 0)
+		return -E_FAULT;
+	if (size < sizeof(*elf) || elf->e_magic != ELF_MAGIC)
+		return -E_NOT_EXEC;
+	// A lazy image whose program headers lie past the part we were
+	// given has to be loaded whole.
+	if (elf->e_phoff > size
+	    || elf->e_phnum > (size - elf->e_phoff) / sizeof(*ph))
+		return lazy ? -E_NOT_SUPP : -E_NOT_EXEC;
+
+	ph = (const struct Proghdr *) (binary + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++, ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		if (ph->p_filesz > ph->p_memsz
+		    || (!lazy && (ph->p_offset > size
+				  || ph->p_filesz > size - ph->p_offset))
+		    || ph->p_va >= USTACKTOP - PGSIZE
+		    || ph->p_memsz > USTACKTOP - PGSIZE - ph->p_va)
+			return -E_NOT_EXEC;
+
+		perm = PTE_P | PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			perm |= PTE_W;
+
+		if (lazy) {
+			if (ph->p_memsz && (r = elf_lazy_segment(e, ph, perm)) < 0)
+				return r;
+			continue;
+		}
+
+		for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < ph->p_va + ph->p_memsz; va += PGSIZE) {
+			if (!page_lookup(e->env_pgdir, (void *) va, NULL)
+			    && !elf_page_overlaps(elf, ph, va)
+			    && (pp = elf_shared_page(binary, ph, va, user))) {
+				if ((r = page_insert(e->env_pgdir, pp, (void *) va, perm)) < 0)
+					return r;
+				continue;
+			}
+			if (!(pp = page_lookup(e->env_pgdir, (void *) va, NULL))) {
+				if (!(pp = page_alloc(ALLOC_ZERO)))
+					return -E_NO_MEM;
+				if ((r = page_insert(e->env_pgdir, pp, (void *) va, perm)) < 0) {
+					page_free(pp);
+					return r;
+				}
+			}
+			// Copy the part of the file image that lands in this page.
+			lo = MAX(va, ph->p_va);
+			hi = MIN(va + PGSIZE, ph->p_va + ph->p_filesz);
+			if (lo < hi)
+				memcpy((uint8_t *) page2kva(pp) + PGOFF(lo),
+				       binary + ph->p_offset + (lo - ph->p_va), hi - lo);
+		}
+	}
+
+	e->env_tf.tf_eip = elf->e_entry;
+	return 0;
+}
+
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
 // This function is ONLY called during kernel initialization,
@@ -320,45 +540,12 @@ region_alloc(struct Env *e, void *va, size_t len)
 static void
 load_icode(struct Env *e, uint8_t *binary)
 {
-	//  We load each program segment into virtual memory
-	//  at the address specified in the ELF section header.
-	//  You should only load segments with ph->p_type == ELF_PROG_LOAD.
-	//  Each segment's virtual address can be found in ph->p_va
-	//  and its size in memory can be found in ph->p_memsz.
-	//  The ph->p_filesz bytes from the ELF binary, starting at
-	//  'binary + ph->p_offset', should be copied to virtual address
-	//  ph->p_va.  Any remaining memory bytes are cleared to zero.
-	//  (The ELF header should have ph->p_filesz <= ph->p_memsz.)
-	//
-	//  All page protection bits should be user read/write for now.
-	//  ELF segments are not necessarily page-aligned, 
-	//  assumming for this function that no two segments will touch the same virtual page.
-
-	struct Elf* elfHeader = (struct Elf*) binary;
-	struct Proghdr* start = (struct Proghdr*)(binary + elfHeader->e_phoff);
-	struct Proghdr* end = (struct Proghdr*)(start + elfHeader->e_phnum);
-	
-	if (elfHeader->e_magic != ELF_MAGIC)
-		panic("load_icode: bad magic number");
-	
-	lcr3(PADDR(e->env_pgdir)); //use env mapping
-
-	struct Proghdr* ph = start;
-	for (;ph < end; ph++){
-		if (ph->p_type != ELF_PROG_LOAD)
-			continue;
-		
-		if (ph->p_filesz > ph->p_memsz){
-			panic("load_icode: not enough mem for files");
-		}
+	int r;
 
-		region_alloc(e, (void*)ph->p_va, ph->p_memsz); // allocate env region in physical mem
-		memset((void*) ph->p_va, 0, ph->p_memsz); // init all mem as 0
-		memcpy((void*) ph->p_va, (binary + ph->p_offset), ph->p_filesz); // overide files with copied mem
-	}
-	
-	lcr3(PADDR(kern_pgdir)); //return to kernel mapping
-	e->env_tf.tf_eip = elfHeader->e_entry; // initilize program counter
+	// Read-only segments are shared with other envs created from the
+	// same binary (see elf_shared_page); the rest is copied.
+	if ((r = elf_load(e, binary, ~(size_t) 0, 0, 0)) < 0)
+		panic("load_icode: %e", r);
 
 	// Now map one page for the program's initial stack
 	// at virtual address USTACKTOP - PGSIZE.
@@ -367,6 +554,55 @@ load_icode(struct Env *e, uint8_t *binary)
 }
 
 
+// Load the ELF image of 'size' bytes at user address 'binary' in the
+// current address space into the fresh env 'e' (see elf_load).  If
+// 'lazy', 'binary' need only hold the headers, and e's segments are
+// left to be paged in on demand.
+int
+env_load_elf(struct Env *e, const uint8_t *binary, size_t size, bool lazy)
+{
+	return elf_load(e, binary, size, 1, lazy);
+}
+
+// Make the fresh env 'e' a thread of 'src': drop e's own empty page
+// directory and share src's, which env_free tears down only when the
+// last env using it is freed.
+void
+env_share_vm(struct Env *e, struct Env *src)
+{
+	page_decref(pa2page(PADDR(e->env_pgdir)));
+	e->env_pgdir = src->env_pgdir;
+	pa2page(PADDR(e->env_pgdir))->pp_ref++;
+}
+
+// Map every page that 'src' maps with PTE_SHARE (see inc/lib.h) below
+// USTACKTOP into 'dst' at the same address, as spawn does for the file
+// descriptor table and other library state.
+// Returns 0 on success, < 0 on error.
+int
+env_copy_shared(struct Env *dst, struct Env *src)
+{
+	pte_t *pt;
+	uint32_t pdeno, pteno;
+	int r;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(src->env_pgdir[pdeno] & PTE_P))
+			continue;
+		pt = (pte_t *) KADDR(PTE_ADDR(src->env_pgdir[pdeno]));
+		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+			if ((pt[pteno] & (PTE_P | PTE_SHARE)) != (PTE_P | PTE_SHARE)
+			    || PGADDR(pdeno, pteno, 0) >= (void *) USTACKTOP)
+				continue;
+			if ((r = page_insert(dst->env_pgdir, pa2page(PTE_ADDR(pt[pteno])),
+					     PGADDR(pdeno, pteno, 0),
+					     pt[pteno] & PTE_SYSCALL)) < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
 // Allocates a new env with env_alloc, loads the named elf
 // binary into it with load_icode, and sets its env_type.
 // This function is ONLY called during kernel initialization,
@@ -389,6 +625,12 @@ env_create(uint8_t *binary, enum EnvType type)
 	if (type == ENV_TYPE_FS)
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
 
+	// Publish the system servers in the service registry.
+	if (type == ENV_TYPE_FS && (res = svc_register(e, "fs", 1)) < 0)
+		panic("env_create: registering fs: %e", res);
+	if (type == ENV_TYPE_NS && (res = svc_register(e, "ns", 1)) < 0)
+		panic("env_create: registering ns: %e", res);
+
 }
 
 // Frees env e and all memory it uses.
@@ -405,6 +647,18 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// Drop buffered messages and fail senders blocked on us.
+	ipc_cleanup(e);
+	futex_cancel(e);
+	time_clear_timeout(e);
+	svc_cleanup(e);
+
+	// Threads share their address space (see env_share_vm), and only
+	// the last one out takes it apart.
+	pa = PADDR(e->env_pgdir);
+	if (pa2page(pa)->pp_ref > 1)
+		goto free_pgdir;
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -429,6 +683,7 @@ env_free(struct Env *e)
 	}
 
 	// free the page directory
+free_pgdir:
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
@@ -437,6 +692,22 @@ env_free(struct Env *e)
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
+
+	// Wake anyone sleeping on our status word (see wait() in lib/wait.c).
+	futex_wake_key(PADDR(&e->env_status), NENV);
+}
+
+// Called when the deadline set with time_set_timeout passes while 'e'
+// is still blocked: abandon the wait and return -E_TIMEOUT from the
+// system call that blocked.
+void
+env_timeout(struct Env *e)
+{
+	futex_cancel(e);
+	if (e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+		e->env_status = ENV_RUNNABLE;
+	}
 }
 
 
@@ -517,6 +788,13 @@ env_run(struct Env *e)
 	curenv->env_status = ENV_RUNNING; // Set its status to ENV_RUNNING,
 	curenv->env_runs += 1; //Update its 'env_runs' counter
 
+	// Point GS at the env's thread-local storage.
+	gdt[(GD_TLS0 >> 3) + cpunum()] = SEG(STA_W, curenv->env_tls, PGSIZE - 1, 3);
+	asm volatile("movw %%ax,%%gs" :: "a" ((GD_TLS0 + (cpunum() << 3)) | 3));
+
+	// lcr3 below flushes whatever tlb_invalidate asked us to.
+	thiscpu->cpu_tlb_stale = 0;
+	thiscpu->cpu_in_user = 1;
 	unlock_kernel();
 
 	lcr3(PADDR(curenv->env_pgdir)); //Use lcr3() to switch to its address space
@@ -15,7 +15,11 @@ void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
+int	env_load_elf(struct Env *e, const uint8_t *binary, size_t size, bool lazy);
+int	env_copy_shared(struct Env *dst, struct Env *src);
+void	env_share_vm(struct Env *e, struct Env *src);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_timeout(struct Env *e);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
@@ -0,0 +1,139 @@
+// Blocking on user memory words ("futexes").
+//
+// An env that finds a word in memory holding a value it does not want
+// can sleep on the word with futex_wait, and whoever changes the word
+// wakes it with futex_wake.  Waiters are keyed by the physical address
+// of the word, so envs that map the same page (e.g. with PTE_SHARE)
+// at different addresses still meet.  Sleeping envs are simply
+// ENV_NOT_RUNNABLE, so the scheduler never looks at them.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+
+#define FUTEX_NBUCKETS	64
+#define FUTEX_HASH(key)	((((key) >> 2) ^ ((key) >> 12)) % FUTEX_NBUCKETS)
+
+// Sleeping envs, hashed by key and linked through env_futex_link
+// in the order they went to sleep.
+static struct Env *futex_buckets[FUTEX_NBUCKETS];
+
+// Find the key of the word at 'addr' in curenv's address space.
+// The word must be aligned and readable by the user; it may lie above
+// UTOP (e.g. in UENVS).
+static int
+futex_key(uint32_t *addr, physaddr_t *key)
+{
+	struct PageInfo *pp;
+
+	if ((uintptr_t) addr % sizeof(uint32_t) != 0)
+		return -E_INVAL;
+	if (user_mem_check(curenv, addr, sizeof(uint32_t), PTE_U) < 0)
+		return -E_FAULT;
+	if (!(pp = page_lookup(curenv->env_pgdir, addr, NULL)))
+		return -E_FAULT;
+
+	*key = page2pa(pp) + PGOFF(addr);
+	return 0;
+}
+
+// Unlink 'e' from its futex bucket, if it sleeps on a futex.
+void
+futex_cancel(struct Env *e)
+{
+	struct Env **pe;
+
+	if (!e->env_futex_key)
+		return;
+
+	pe = &futex_buckets[FUTEX_HASH(e->env_futex_key)];
+	for (; *pe; pe = &(*pe)->env_futex_link)
+		if (*pe == e) {
+			*pe = e->env_futex_link;
+			break;
+		}
+	e->env_futex_key = 0;
+	e->env_futex_link = NULL;
+}
+
+// Put curenv to sleep on the word at 'addr' if it still holds
+// 'expected'.  If 'timeout' is nonzero, give up after that many
+// milliseconds.
+//
+// Returns 0 if curenv now sleeps; the system call then returns 0 when
+// woken by futex_wake, or -E_TIMEOUT.  Otherwise returns < 0:
+//	-E_AGAIN if *addr != expected.
+//	-E_INVAL if addr is not aligned.
+//	-E_FAULT if addr is not readable by curenv.
+int
+futex_wait(uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	struct Env **pe;
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(addr, &key)) < 0)
+		return r;
+
+	// We run in curenv's address space, and nobody can change the
+	// word's mapping while we hold the kernel lock.
+	if (*(volatile uint32_t *) addr != expected)
+		return -E_AGAIN;
+
+	curenv->env_futex_key = key;
+	curenv->env_futex_link = NULL;
+	for (pe = &futex_buckets[FUTEX_HASH(key)]; *pe; pe = &(*pe)->env_futex_link)
+		;
+	*pe = curenv;
+
+	if (timeout)
+		time_set_timeout(curenv, timeout);
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Wake up to 'n' envs sleeping on the word with physical address 'key',
+// oldest first.  Returns the number woken.
+int
+futex_wake_key(physaddr_t key, int n)
+{
+	struct Env **pe, *e;
+	int woken = 0;
+
+	pe = &futex_buckets[FUTEX_HASH(key)];
+	while (*pe && woken < n) {
+		e = *pe;
+		if (e->env_futex_key != key) {
+			pe = &e->env_futex_link;
+			continue;
+		}
+		*pe = e->env_futex_link;
+		e->env_futex_key = 0;
+		e->env_futex_link = NULL;
+		time_clear_timeout(e);
+		if (e->env_status == ENV_NOT_RUNNABLE) {
+			e->env_tf.tf_regs.reg_eax = 0;
+			e->env_status = ENV_RUNNABLE;
+		}
+		woken++;
+	}
+	return woken;
+}
+
+// Wake up to 'n' envs sleeping on the word at 'addr' in curenv's
+// address space.  Returns the number woken, or < 0 on error (see
+// futex_wait).
+int
+futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(addr, &key)) < 0)
+		return r;
+	return futex_wake_key(key, n);
+}
@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int futex_wait(uint32_t *addr, uint32_t expected, uint32_t timeout);
+int futex_wake(uint32_t *addr, int n);
+int futex_wake_key(physaddr_t key, int n);
+void futex_cancel(struct Env *e);
+
+#endif /* !JOS_KERN_FUTEX_H */
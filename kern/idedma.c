@@ -0,0 +1,41 @@
+// The kernel's part in bus-master IDE DMA.
+//
+// The file system server drives the disk itself, through the I/O ports
+// its IOPL lets it use.  All it needs from the kernel is what it cannot
+// find or do in user mode: the base port of the controller's bus-master
+// registers, found on the PCI bus (ide_bmbase), the physical addresses
+// of its buffers (sys_dma_paddr), and a way to sleep until the disk
+// interrupts (sys_irq_wait).
+
+#include <inc/stdio.h>
+#include <inc/error.h>
+#include <inc/trap.h>
+
+#include <kern/idedma.h>
+#include <kern/pci.h>
+#include <kern/picirq.h>
+
+static uint32_t bmbase;		// Bus-master register ports, or 0
+
+int
+ide_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+
+	// BAR 4 holds the bus-master registers of both channels.
+	if (!pcif->reg_base[4] || pcif->reg_size[4] < 16)
+		return 0;
+	bmbase = pcif->reg_base[4];
+	cprintf("IDE bus master at port 0x%x\n", bmbase);
+
+	irq_claim(IRQ_IDE);
+	return 1;
+}
+
+// Returns the base port of the bus-master registers, or -E_NOT_SUPP if
+// the IDE controller cannot do DMA.
+int
+ide_bmbase(void)
+{
+	return bmbase ? bmbase : -E_NOT_SUPP;
+}
@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_IDEDMA_H
+#define JOS_KERN_IDEDMA_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct pci_func;
+
+int	ide_attach(struct pci_func *pcif);
+int	ide_bmbase(void);
+
+#endif /* !JOS_KERN_IDEDMA_H */
@@ -0,0 +1,292 @@
+// Kernel side of IPC.
+//
+// A message is handed straight to its receiver when the receiver is
+// blocked in sys_ipc_recv.  Otherwise it is buffered in the receiver's
+// queue (env_ipc_queue), so the sender can carry on without waiting.
+// Senders that find the queue full either get -E_IPC_NOT_RECV
+// (sys_ipc_try_send) or sleep on the receiver's waiters list
+// (sys_ipc_send) until a slot frees up.
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/ipc.h>
+#include <kern/pager.h>
+
+// Check that curenv may send the page at 'srcva' with 'perm' and fill in
+// 'm'.  If srcva >= UTOP no page is sent.  Otherwise 'm' holds a reference
+// on the page until it is delivered or released, so the sender is free to
+// unmap it as soon as the send returns.
+// If perm carries IPC_PERM_PAGES(n), the n pages starting at srcva are
+// sent; the perm bits are checked once and apply to all of them.
+// If perm carries IPC_PERM_WORDS(n), the n words at srcva are copied
+// into 'm' instead and no page is sent.
+// Any IPC_RECV_PAGES bits in perm concern the receive half of a call and
+// are ignored here.
+//
+// Errors are the page errors of sys_ipc_try_send, plus
+//	-E_INVAL if more than IPC_NWORDS words or IPC_MAXPAGES pages are
+//		sent, or the pages run past UTOP.
+//	-E_FAULT if the words are not readable by curenv.
+int
+ipc_msg_build(struct IpcMsg *m, uint32_t value, void *srcva, unsigned perm)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	uint32_t i, nwords, npages;
+
+	m->im_from = curenv->env_id;
+	m->im_value = value;
+	m->im_npages = 0;
+	m->im_perm = 0;
+	m->im_nwords = 0;
+
+	perm &= ~IPC_RECV_PAGES(0x1F);
+	if ((nwords = IPC_PERM_NWORDS(perm)) != 0) {
+		if (nwords > IPC_NWORDS || (perm & ~IPC_PERM_WORDS(0xF)))
+			return -E_INVAL;
+		if (user_mem_check(curenv, srcva, nwords * sizeof(uint32_t), PTE_U) < 0)
+			return -E_FAULT;
+		memcpy(m->im_words, srcva, nwords * sizeof(uint32_t));
+		m->im_nwords = nwords;
+		return 0;
+	}
+
+	if ((uintptr_t) srcva >= UTOP)
+		return 0;
+
+	if ((npages = IPC_PERM_NPAGES(perm)) == 0)
+		npages = 1;
+	perm &= ~IPC_PERM_PAGES(0x1F);
+
+	if (PGOFF(srcva) != 0) // not page-aligned
+		return -E_INVAL;
+	if (npages > IPC_MAXPAGES || npages > (UTOP - (uintptr_t) srcva) / PGSIZE)
+		return -E_INVAL;
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P))
+		return -E_INVAL;
+	if (perm & ~PTE_SYSCALL)
+		return -E_INVAL;
+
+	// Bring in lazy pages before taking references, as pager_fill may
+	// restart the system call.
+	for (i = 0; i < npages; i++)
+		pager_fill(curenv, srcva + i * PGSIZE);
+	for (i = 0; i < npages; i++) {
+		pp = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, &pte);
+		// not mapped, or asked for write on a read-only page
+		if (!pp || ((perm & PTE_W) && !(*pte & PTE_W))) {
+			ipc_msg_release(m);
+			return -E_INVAL;
+		}
+		pp->pp_ref++;
+		m->im_pages[m->im_npages++] = pp;
+	}
+	m->im_perm = perm;
+	return 0;
+}
+
+// Drop the page references held by 'm', if any.
+void
+ipc_msg_release(struct IpcMsg *m)
+{
+	uint32_t i;
+
+	for (i = 0; i < m->im_npages; i++)
+		page_decref(m->im_pages[i]);
+	m->im_npages = 0;
+}
+
+// Copy 'm' into the ipc fields of 'dst', mapping its pages at
+// dst->env_ipc_dstva if dst asked for them.  Pages beyond the
+// env_ipc_maxpages dst is willing to take are dropped.  Consumes m's
+// page references on success.  On failure 'm' and dst's mappings are
+// left untouched: the page tables for every slot are made first, so no
+// page_insert, which would replace what is mapped there, can fail
+// part way.  dst may keep some new, empty page tables.
+static int
+ipc_deliver(struct Env *dst, struct IpcMsg *m)
+{
+	uint32_t i, n = 0;
+	int r;
+
+	dst->env_ipc_perm = 0;
+	if (m->im_npages && (uintptr_t) dst->env_ipc_dstva < UTOP) {
+		n = MIN(m->im_npages, dst->env_ipc_maxpages);
+		for (i = 0; i < n; i++)
+			if (!pgdir_walk(dst->env_pgdir, dst->env_ipc_dstva + i * PGSIZE, 1))
+				return -E_NO_MEM;
+		for (i = 0; i < n; i++) {
+			r = page_insert(dst->env_pgdir, m->im_pages[i],
+					dst->env_ipc_dstva + i * PGSIZE, m->im_perm);
+			assert(r == 0);
+		}
+		dst->env_ipc_perm = m->im_perm;
+	}
+	ipc_msg_release(m);
+
+	dst->env_ipc_from = m->im_from;
+	dst->env_ipc_value = m->im_value;
+	dst->env_ipc_npages = n;
+	dst->env_ipc_nwords = m->im_nwords;
+	memcpy(dst->env_ipc_words, m->im_words, m->im_nwords * sizeof(uint32_t));
+	return 0;
+}
+
+// Make a blocked sender runnable again, returning 'r' from its send.
+// A sender blocked in sys_ipc_call instead goes on to receive its reply.
+static void
+ipc_wake_sender(struct Env *s, int r)
+{
+	s->env_ipc_sendto = NULL;
+	s->env_ipc_waitlink = NULL;
+	if (s->env_ipc_calling) {
+		s->env_ipc_calling = 0;
+		r = r ? r : ipc_recv_msg(s, s->env_ipc_dstva, s->env_ipc_maxpages);
+		if (r == 0) {
+			s->env_ipc_recving = 1;
+			return;
+		}
+		if (r > 0)
+			r = 0;
+	}
+	if (s->env_status == ENV_NOT_RUNNABLE) {
+		s->env_tf.tf_regs.reg_eax = r;
+		s->env_status = ENV_RUNNABLE;
+	}
+}
+
+static void
+ipc_enqueue(struct Env *dst, struct IpcMsg *m)
+{
+	assert(dst->env_ipc_qcount < IPC_QUEUE_LEN);
+	dst->env_ipc_queue[(dst->env_ipc_qhead + dst->env_ipc_qcount) % IPC_QUEUE_LEN] = *m;
+	dst->env_ipc_qcount++;
+	m->im_npages = 0;
+}
+
+// Send 'm' from curenv to 'dst'.
+// If the queue is full and 'block' is set, curenv is put to sleep on dst's
+// waiters list; the syscall then returns once dst has room for the message.
+// On success 'm' no longer owns a page reference.
+int
+ipc_send_msg(struct Env *dst, struct IpcMsg *m, bool block)
+{
+	struct Env **pe;
+	int r;
+
+	if (dst->env_ipc_recving) {
+		if ((r = ipc_deliver(dst, m)) < 0)
+			return r;
+		dst->env_ipc_recving = 0;
+		dst->env_status = ENV_RUNNABLE;
+		return 0;
+	}
+
+	if (dst->env_ipc_qcount < IPC_QUEUE_LEN) {
+		ipc_enqueue(dst, m);
+		return 0;
+	}
+
+	// Nobody could ever drain our own queue while we sleep on it.
+	if (!block || dst == curenv)
+		return -E_IPC_NOT_RECV;
+
+	curenv->env_ipc_pending = *m;
+	m->im_npages = 0;
+	curenv->env_ipc_sendto = dst;
+	curenv->env_ipc_waitlink = NULL;
+	for (pe = &dst->env_ipc_waiters; *pe; pe = &(*pe)->env_ipc_waitlink)
+		;
+	*pe = curenv;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Receive the oldest buffered message into e's ipc fields, mapping
+// up to 'maxpages' of its pages at 'dstva' if dstva < UTOP.  The first
+// blocked sender, if any, then moves its message into the freed slot
+// and is woken.
+//
+// Returns 1 if a message was received, 0 if the queue is empty,
+// or < 0 if the page could not be mapped (the message stays queued).
+int
+ipc_recv_msg(struct Env *e, void *dstva, uint32_t maxpages)
+{
+	struct Env *s;
+	int r;
+
+	if (e->env_ipc_qcount == 0)
+		return 0;
+
+	e->env_ipc_dstva = dstva;
+	e->env_ipc_maxpages = maxpages;
+	if ((r = ipc_deliver(e, &e->env_ipc_queue[e->env_ipc_qhead])) < 0)
+		return r;
+	e->env_ipc_qhead = (e->env_ipc_qhead + 1) % IPC_QUEUE_LEN;
+	e->env_ipc_qcount--;
+
+	if ((s = e->env_ipc_waiters)) {
+		e->env_ipc_waiters = s->env_ipc_waitlink;
+		ipc_enqueue(e, &s->env_ipc_pending);
+		ipc_wake_sender(s, 0);
+	}
+	return 1;
+}
+
+// Receive into curenv at 'dstva' (up to 'maxpages' pages), taking a
+// buffered message if there is one and otherwise marking curenv as
+// blocked in receive.
+// Returns 1 if a message was received at once, 0 if curenv now sleeps,
+// or < 0 on error.
+int
+ipc_wait(void *dstva, uint32_t maxpages)
+{
+	int r;
+
+	if ((r = ipc_recv_msg(curenv, dstva, maxpages)) != 0)
+		return r;
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_maxpages = maxpages;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Called when 'e' is freed.  Drops every message buffered for e, fails
+// the senders sleeping on e with -E_BAD_ENV, and withdraws e's own
+// blocked send, if any.
+void
+ipc_cleanup(struct Env *e)
+{
+	struct Env *s, **pe;
+
+	while (e->env_ipc_qcount > 0) {
+		ipc_msg_release(&e->env_ipc_queue[e->env_ipc_qhead]);
+		e->env_ipc_qhead = (e->env_ipc_qhead + 1) % IPC_QUEUE_LEN;
+		e->env_ipc_qcount--;
+	}
+
+	while ((s = e->env_ipc_waiters)) {
+		e->env_ipc_waiters = s->env_ipc_waitlink;
+		ipc_msg_release(&s->env_ipc_pending);
+		ipc_wake_sender(s, -E_BAD_ENV);
+	}
+
+	if (e->env_ipc_sendto) {
+		pe = &e->env_ipc_sendto->env_ipc_waiters;
+		for (; *pe; pe = &(*pe)->env_ipc_waitlink)
+			if (*pe == e) {
+				*pe = e->env_ipc_waitlink;
+				break;
+			}
+		ipc_msg_release(&e->env_ipc_pending);
+		e->env_ipc_sendto = NULL;
+		e->env_ipc_waitlink = NULL;
+	}
+	e->env_ipc_calling = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int ipc_msg_build(struct IpcMsg *m, uint32_t value, void *srcva, unsigned perm);
+void ipc_msg_release(struct IpcMsg *m);
+int ipc_send_msg(struct Env *dst, struct IpcMsg *m, bool block);
+int ipc_recv_msg(struct Env *e, void *dstva, uint32_t maxpages);
+int ipc_wait(void *dstva, uint32_t maxpages);
+void ipc_cleanup(struct Env *e);
+
+#endif /* !JOS_KERN_IPC_H */
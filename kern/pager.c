@@ -0,0 +1,193 @@
+// Demand paging of spawned executables.
+//
+// A lazy spawn (see sys_spawn_elf) records an executable's segments in
+// env_segs instead of loading them.  The first touch of a page in one
+// of them faults into pager_fault: a page with nothing of the file in
+// it (bss) is zero-filled on the spot, and any other is asked of the
+// env's pager, the file server, with an FSREQ_PAGEIN message.  The env
+// sleeps until the pager hands the page over with sys_pager_supply,
+// then retries the faulting instruction.  Read-only pages that line up
+// with file blocks come straight from the file server's block cache,
+// so every instance of a program shares them.
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/fd.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/ipc.h>
+#include <kern/sched.h>
+#include <kern/pager.h>
+
+// Find the segment of e's executable that covers page 'va'.
+static struct EnvSegment *
+pager_segment(struct Env *e, uintptr_t va)
+{
+	struct EnvSegment *seg;
+	uint32_t i;
+
+	for (i = 0; i < e->env_nsegs; i++) {
+		seg = &e->env_segs[i];
+		if (va >= ROUNDDOWN(seg->seg_va, PGSIZE)
+		    && va < seg->seg_va + seg->seg_memsz)
+			return seg;
+	}
+	return NULL;
+}
+
+// Bring in the page of e's executable at 'va', which is not mapped.
+// Pages without file bytes are zero-filled at once.  For the others,
+// if 'async', ask e's pager for the page and put e to sleep until it
+// arrives; if the pager's queue is full, e is left runnable to fault
+// again.
+// Returns 0 if the page is mapped now, 1 if e must wait for it,
+// < 0 if 'va' is not a lazy page or on error.
+static int
+pager_page(struct Env *e, uintptr_t va, bool async)
+{
+	struct EnvSegment *seg;
+	struct Fsreq_pagein *req;
+	struct PageInfo *pp;
+	struct IpcMsg m;
+	struct Env *pager;
+	uintptr_t lo, hi;
+	pte_t *pte;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (va >= UTOP || !(seg = pager_segment(e, va)))
+		return -E_INVAL;
+	if ((pte = pgdir_walk(e->env_pgdir, (void *) va, 0)) && (*pte & PTE_P))
+		return -E_INVAL;
+
+	lo = MAX(va, seg->seg_va);
+	hi = MIN(va + PGSIZE, seg->seg_va + seg->seg_filesz);
+	if (lo >= hi) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		if ((r = page_insert(e->env_pgdir, pp, (void *) va, seg->seg_perm)) < 0) {
+			page_free(pp);
+			return r;
+		}
+		return 0;
+	}
+
+	if (!async)
+		return -E_INVAL;
+	if ((r = envid2env(e->env_pager, &pager, 0)) < 0)
+		return r;
+
+	m.im_from = e->env_id;
+	m.im_value = FSREQ_PAGEIN;
+	m.im_npages = 0;
+	m.im_perm = 0;
+	m.im_nwords = sizeof(*req) / sizeof(uint32_t);
+	req = (struct Fsreq_pagein *) m.im_words;
+	req->req_fileid = e->env_pager_file;
+	req->req_offset = seg->seg_offset + (lo - seg->seg_va);
+	req->req_va = va;
+	req->req_pgoff = PGOFF(lo);
+	req->req_len = hi - lo;
+	req->req_perm = seg->seg_perm;
+
+	if ((r = ipc_send_msg(pager, &m, 0)) == -E_IPC_NOT_RECV)
+		return 1;
+	if (r < 0)
+		return r;
+	e->env_pagein_va = va;
+	e->env_status = ENV_NOT_RUNNABLE;
+	return 1;
+}
+
+// Handle a not-present page fault by curenv at 'va'.
+// Returns 0 if the fault was a lazy page, which is mapped now or on its
+// way, and < 0 if it must be handled as an ordinary fault.
+int
+pager_fault(uintptr_t va)
+{
+	int r;
+
+	if ((r = pager_page(curenv, va, 1)) < 0)
+		return r;
+	return 0;
+}
+
+// Make the page at 'va' of e present, as the kernel is about to access
+// it on e's behalf.  A lazy page that must come from the pager can only
+// be waited for when e is curenv in a system call: the call is rewound
+// so that it restarts once the page is in, and pager_fill does not
+// return.
+// Returns 0 if the page is present, < 0 if it is not.
+int
+pager_fill(struct Env *e, const void *va)
+{
+	pte_t *pte;
+	int r;
+
+	if ((pte = pgdir_walk(e->env_pgdir, va, 0)) && (*pte & PTE_P))
+		return 0;
+	if ((r = pager_page(e, (uintptr_t) va, e == curenv
+			    && e->env_tf.tf_trapno == T_SYSCALL)) <= 0)
+		return r;
+
+	// Back up over the 'int $T_SYSCALL' instruction; the system call
+	// number is still in eax.
+	e->env_tf.tf_eip -= 2;
+	sched_yield();
+}
+
+// Set up e to page its recorded segments in from the file whose client
+// Fd page is 'fdpage', which e keeps a mapping of at ENV_EXECFD so the
+// file server keeps the file open.
+// Returns 0 on success, < 0 on error.
+int
+pager_attach(struct Env *e, envid_t pager, struct PageInfo *fdpage)
+{
+	int r;
+
+	if ((r = page_insert(e->env_pgdir, fdpage, (void *) ENV_EXECFD,
+			     PTE_P | PTE_U)) < 0)
+		return r;
+	e->env_pager = pager;
+	e->env_pager_file = ((struct Fd *) page2kva(fdpage))->fd_file.id;
+	return 0;
+}
+
+// The pager hands over page 'pp' for 'va' of e, mapped with 'perm'.
+// A null 'pp' says the pager could not produce the page, and e, which
+// cannot go on without it, is destroyed.
+// Any thread of the pager (an env sharing its page tables) may answer.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv is not e's pager or e is not waiting for 'va',
+//		or if 'perm' is inappropriate.
+//	-E_NO_MEM if we run out of memory for page tables.
+int
+pager_supply(struct Env *e, uintptr_t va, struct PageInfo *pp, int perm)
+{
+	struct Env *pager;
+	int r;
+
+	if (envid2env(e->env_pager, &pager, 0) < 0
+	    || pager->env_pgdir != curenv->env_pgdir
+	    || e->env_pagein_va != va || !va)
+		return -E_INVAL;
+	if (!pp) {
+		e->env_pagein_va = 0;
+		cprintf("[%08x] page-in of %08x failed\n", e->env_id, va);
+		env_destroy(e);
+		return 0;
+	}
+
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	// A thread sharing e's page tables may have had the page first.
+	if (!page_lookup(e->env_pgdir, (void *) va, NULL)
+	    && (r = page_insert(e->env_pgdir, pp, (void *) va, perm)) < 0)
+		return r;
+	e->env_pagein_va = 0;
+	if (e->env_status == ENV_NOT_RUNNABLE)
+		e->env_status = ENV_RUNNABLE;
+	return 0;
+}
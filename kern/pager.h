@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_PAGER_H
+#define JOS_KERN_PAGER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+struct PageInfo;
+
+int pager_fault(uintptr_t va);
+int pager_fill(struct Env *e, const void *va);
+int pager_attach(struct Env *e, envid_t pager, struct PageInfo *fdpage);
+int pager_supply(struct Env *e, uintptr_t va, struct PageInfo *pp, int perm);
+
+#endif /* !JOS_KERN_PAGER_H */
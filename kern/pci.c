@@ -4,6 +4,8 @@
 #include <kern/pci.h>
 #include <kern/pcireg.h>
 #include <kern/e1000.h>
+#include <kern/idedma.h>
+#include <kern/virtio.h>
 
 // Flag to do "lspci" at bootup
 static int pci_show_devs = 1;
@@ -25,6 +27,7 @@ struct pci_driver {
 // pci_attach_class matches the class and subclass of a PCI device
 struct pci_driver pci_attach_class[] = {
 	{ PCI_CLASS_BRIDGE, PCI_SUBCLASS_BRIDGE_PCI, &pci_bridge_attach },
+	{ PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_MASS_STORAGE_IDE, &ide_attach },
 	{ 0, 0, 0 },
 };
 
@@ -32,6 +35,7 @@ struct pci_driver pci_attach_class[] = {
 // and key2 should be the vendor ID and device ID respectively
 struct pci_driver pci_attach_vendor[] = {
 	{PCI_E1000_VENDOR, PCI_E1000_DEVICE, &e1000_attach},
+	{PCI_VIRTIO_VENDOR, PCI_VIRTIO_BLK_DEVICE, &virtio_blk_attach},
 	{ 0, 0, 0 },
 };
 
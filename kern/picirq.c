@@ -1,9 +1,11 @@
 /* See COPYRIGHT for copyright information. */
 
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/trap.h>
 
 #include <kern/picirq.h>
+#include <kern/env.h>
 
 
 // Current IRQ mask.
@@ -68,15 +70,23 @@ pic_init(void)
 		irq_setmask_8259A(irq_mask_8259A);
 }
 
-void
-irq_setmask_8259A(uint16_t mask)
+static void
+pic_setmask(uint16_t mask)
 {
-	int i;
 	irq_mask_8259A = mask;
 	if (!didinit)
 		return;
 	outb(IO_PIC1+1, (char)mask);
 	outb(IO_PIC2+1, (char)(mask >> 8));
+}
+
+void
+irq_setmask_8259A(uint16_t mask)
+{
+	int i;
+	pic_setmask(mask);
+	if (!didinit)
+		return;
 	cprintf("enabled interrupts:");
 	for (i = 0; i < 16; i++)
 		if (~mask & (1<<i))
@@ -95,3 +105,64 @@ irq_eoi(void)
 	outb(IO_PIC1, 0x20);
 	outb(IO_PIC2, 0x20);
 }
+
+// Interrupts of devices driven by user environments (see
+// sys_irq_wait).  A driver sleeps in irq_wait until its IRQ comes.
+// The IRQ is masked when it arrives, since the line stays asserted
+// until the driver has told the device it saw the interrupt, and
+// unmasked when the driver waits again.
+static uint16_t irq_user;		// IRQs claimed by user drivers
+static envid_t irq_waiter[MAX_IRQS];	// Env waiting for each, or 0
+static uint16_t irq_pending;		// Came while nobody was waiting
+
+// Hand 'irq' over to a user-level driver and enable it.
+void
+irq_claim(int irq)
+{
+	irq_user |= 1 << irq;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+}
+
+// Put curenv to sleep until 'irq' next arrives, unless it has arrived
+// since the last call.
+// Returns 0 on success, -E_INVAL if 'irq' is not claimed or if another
+// env is waiting for it.
+int
+irq_wait(int irq)
+{
+	struct Env *e;
+
+	if (irq < 0 || irq >= MAX_IRQS || !(irq_user & (1 << irq)))
+		return -E_INVAL;
+	if (irq_waiter[irq] && envid2env(irq_waiter[irq], &e, 0) == 0
+	    && e->env_status == ENV_NOT_RUNNABLE)
+		return -E_INVAL;
+
+	pic_setmask(irq_mask_8259A & ~(1 << irq));
+	if (irq_pending & (1 << irq)) {
+		irq_pending &= ~(1 << irq);
+		return 0;
+	}
+	irq_waiter[irq] = curenv->env_id;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Handle 'irq' if a user driver claimed it: mask it and wake the
+// driver.  Returns 1 if so, 0 if the kernel must handle it itself.
+int
+irq_notify(int irq)
+{
+	struct Env *e;
+
+	if (!(irq_user & (1 << irq)))
+		return 0;
+	pic_setmask(irq_mask_8259A | (1 << irq));
+	if (irq_waiter[irq] && envid2env(irq_waiter[irq], &e, 0) == 0
+	    && e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_status = ENV_RUNNABLE;
+		irq_waiter[irq] = 0;
+	} else
+		irq_pending |= 1 << irq;
+	return 1;
+}
@@ -24,6 +24,9 @@ extern uint16_t irq_mask_8259A;
 void pic_init(void);
 void irq_setmask_8259A(uint16_t mask);
 void irq_eoi(void);
+void irq_claim(int irq);
+int irq_wait(int irq);
+int irq_notify(int irq);
 #endif // !__ASSEMBLER__
 
 #endif // !JOS_KERN_PICIRQ_H
@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/pager.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -587,13 +588,32 @@ page_remove(pde_t *pgdir, void *va)
 
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Threads share page tables (see env_share_vm), so other CPUs may be
+// running them too: those are sent a T_TLBFLUSH interrupt, and we
+// wait until each has flushed or left user mode.  A CPU that entered
+// the kernel flushes before touching user memory again (see trap()).
 
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct CpuInfo *c;
+
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	if (pgdir == kern_pgdir || pa2page(PADDR(pgdir))->pp_ref < 2)
+		return;
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || !c->cpu_env || c->cpu_env->env_pgdir != pgdir)
+			continue;
+		c->cpu_tlb_stale = 1;
+		if (c->cpu_in_user)
+			lapic_ipi_cpu(c->cpu_id, T_TLBFLUSH);
+	}
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_stale && c->cpu_in_user)
+			;
 }
 
 
@@ -636,6 +656,28 @@ mmio_map_region(physaddr_t pa, size_t size)
 	return (void*) start;
 }
 
+// Memory for devices that need a buffer contiguous in physical memory,
+// such as a virtqueue.  It lives in the kernel's bss, whose pages are
+// never freed, so mapping them into user space and out again is safe.
+// Allocations are never given back.
+#define DMA_NPAGES	8
+static uint8_t dma_pool[DMA_NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+static uint32_t dma_used;
+
+// Return the first of 'npages' physically contiguous pages, or NULL if
+// the pool is used up.
+struct PageInfo *
+dma_alloc(size_t npages)
+{
+	struct PageInfo *pp;
+
+	if (npages > DMA_NPAGES - dma_used)
+		return NULL;
+	pp = pa2page(PADDR(dma_pool + dma_used * PGSIZE));
+	dma_used += npages;
+	memset(page2kva(pp), 0, npages * PGSIZE);
+	return pp;
+}
 
 // Check that an environment is allowed to access the range of memory
 // [va, va+len) with permissions 'perm | PTE_P'.
@@ -661,6 +703,9 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	pte_t* pte;
 	uintptr_t runningAddr = start;
 	for (; runningAddr < end; runningAddr += PGSIZE){
+		// Lazy pages of the env's executable are brought in first.
+		if (runningAddr < UTOP)
+			pager_fill(env, (void*)runningAddr);
 		pte = pgdir_walk(env->env_pgdir, (void*)runningAddr, 0);
 
 		if ((pte == NULL) || runningAddr > (uintptr_t)ULIM || !((*pte & (perm | PTE_U)))){
@@ -0,0 +1,165 @@
+// Service registry: maps names to the envs that serve them.
+//
+// Servers register under a name and clients look the name up, instead
+// of scanning envs[] for an env of a known type.  Several envs may
+// serve the same name; lookups hand them out round-robin, so clients
+// that look a service up once spread over its instances.  Names are
+// hashed into SVC_NBUCKETS chains, and an env's registrations are
+// dropped when it is freed.
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/registry.h>
+
+#define SVC_MAX		64		// Distinct names registered at once
+#define SVC_NBUCKETS	32
+
+struct Service {
+	char sv_name[SVC_NAMELEN];
+	envid_t sv_envs[SVC_MAXINST];	// Envs serving this name
+	uint32_t sv_ninst;		// Number of valid sv_envs
+	uint32_t sv_next;		// Instance the next lookup returns
+	bool sv_system;			// Registered by the kernel
+	struct Service *sv_link;	// Next in bucket or on free list
+};
+
+static struct Service services[SVC_MAX];
+static struct Service *svc_buckets[SVC_NBUCKETS];
+static struct Service *svc_free_list;
+static bool svc_inited;
+
+static uint32_t
+svc_hash(const char *name)
+{
+	uint32_t h = 5381;
+
+	while (*name)
+		h = h * 33 + (uint8_t) *name++;
+	return h % SVC_NBUCKETS;
+}
+
+static struct Service **
+svc_find(const char *name)
+{
+	struct Service **ps;
+
+	if (!svc_inited) {
+		int i;
+		for (i = SVC_MAX - 1; i >= 0; i--) {
+			services[i].sv_link = svc_free_list;
+			svc_free_list = &services[i];
+		}
+		svc_inited = 1;
+	}
+
+	for (ps = &svc_buckets[svc_hash(name)]; *ps; ps = &(*ps)->sv_link)
+		if (strcmp((*ps)->sv_name, name) == 0)
+			break;
+	return ps;
+}
+
+// Register 'e' as an instance of service 'name'.
+// Names registered by the kernel ('system' set, e.g. "fs") can only
+// be served by envs of a special type, so a user env cannot pose as
+// one of the system servers.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the name is empty or too long.
+//	-E_FILE_EXISTS if 'e' already serves 'name'.
+//	-E_BAD_ENV if 'name' is a system service and 'e' is a user env.
+//	-E_NO_MEM if the registry or the name's instance table is full.
+int
+svc_register(struct Env *e, const char *name, bool system)
+{
+	struct Service **ps, *s;
+	uint32_t i;
+
+	if (name[0] == '\0' || strlen(name) >= SVC_NAMELEN)
+		return -E_INVAL;
+
+	ps = svc_find(name);
+	if (!(s = *ps)) {
+		if (!svc_free_list)
+			return -E_NO_MEM;
+		s = svc_free_list;
+		svc_free_list = s->sv_link;
+		memset(s, 0, sizeof(*s));
+		strcpy(s->sv_name, name);
+		s->sv_system = system;
+		*ps = s;
+	} else if (s->sv_system && e->env_type == ENV_TYPE_USER)
+		return -E_BAD_ENV;
+
+	for (i = 0; i < s->sv_ninst; i++)
+		if (s->sv_envs[i] == e->env_id)
+			return -E_FILE_EXISTS;
+	if (s->sv_ninst == SVC_MAXINST)
+		return -E_NO_MEM;
+
+	s->sv_envs[s->sv_ninst++] = e->env_id;
+	e->env_nservices++;
+	return 0;
+}
+
+// Remove 'e' from the instances of service 'name', and forget the
+// name once nobody serves it.
+// Returns 0 on success, -E_NOT_FOUND if 'e' does not serve 'name'.
+int
+svc_unregister(struct Env *e, const char *name)
+{
+	struct Service **ps, *s;
+	uint32_t i;
+
+	if (!(s = *(ps = svc_find(name))))
+		return -E_NOT_FOUND;
+
+	for (i = 0; i < s->sv_ninst; i++)
+		if (s->sv_envs[i] == e->env_id)
+			break;
+	if (i == s->sv_ninst)
+		return -E_NOT_FOUND;
+
+	s->sv_envs[i] = s->sv_envs[--s->sv_ninst];
+	e->env_nservices--;
+	// System names stay reserved even while nobody serves them.
+	if (s->sv_ninst == 0 && !s->sv_system) {
+		*ps = s->sv_link;
+		s->sv_link = svc_free_list;
+		svc_free_list = s;
+	}
+	return 0;
+}
+
+// Return the envid of an env serving 'name', rotating among the
+// instances, or -E_NOT_FOUND.
+envid_t
+svc_lookup(const char *name)
+{
+	struct Service *s;
+
+	if (!(s = *svc_find(name)) || s->sv_ninst == 0)
+		return -E_NOT_FOUND;
+	if (s->sv_next >= s->sv_ninst)
+		s->sv_next = 0;
+	return s->sv_envs[s->sv_next++];
+}
+
+// Drop every registration of 'e'.  Called when 'e' is freed.
+void
+svc_cleanup(struct Env *e)
+{
+	uint32_t b, i;
+	struct Service *s, *next;
+
+	for (b = 0; b < SVC_NBUCKETS && e->env_nservices > 0; b++)
+		for (s = svc_buckets[b]; s; s = next) {
+			next = s->sv_link;
+			for (i = 0; i < s->sv_ninst; i++)
+				if (s->sv_envs[i] == e->env_id) {
+					svc_unregister(e, s->sv_name);
+					break;
+				}
+		}
+}
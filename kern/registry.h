@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_REGISTRY_H
+#define JOS_KERN_REGISTRY_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int svc_register(struct Env *e, const char *name, bool system);
+int svc_unregister(struct Env *e, const char *name);
+envid_t svc_lookup(const char *name);
+void svc_cleanup(struct Env *e);
+
+#endif /* !JOS_KERN_REGISTRY_H */
@@ -13,6 +13,13 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/ipc.h>
+#include <kern/futex.h>
+#include <kern/registry.h>
+#include <kern/pager.h>
+#include <kern/idedma.h>
+#include <kern/virtio.h>
+#include <kern/picirq.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -98,9 +105,131 @@ sys_exofork(void)
 	//the register set is copied from the current environment
 	newEnv->env_tf = curenv->env_tf;
 	newEnv->env_tf.tf_regs.reg_eax = 0; //set newEnv to return with 0;
+
+	// Pages of our executable not yet paged in are paged in for the
+	// child from the same file, whose Fd page fork maps along.
+	memcpy(newEnv->env_segs, curenv->env_segs, sizeof(newEnv->env_segs));
+	newEnv->env_nsegs = curenv->env_nsegs;
+	newEnv->env_pager = curenv->env_pager;
+	newEnv->env_pager_file = curenv->env_pager_file;
+	// Our TLS block is copied along with the rest of memory; the
+	// exception stack is the usual one (see fork).
+	newEnv->env_tls = curenv->env_tls;
 	return newEnv->env_id; //return from parent with child id
 }
 
+// Create a thread: a new environment that shares our address space
+// (see env_share_vm) and starts at 'eip' with stack pointer 'esp'.
+// It takes page faults on the exception stack below 'uxstacktop',
+// uses 'tls' as its TLS base, inherits our page fault upcall, and is
+// made runnable at once.  Each thread is scheduled on its own, and can
+// run on another CPU at the same time as us.
+// Returns the thread's envid, or < 0 on error.  Errors are:
+//	-E_INVAL if an address is at or above UTOP, or 'uxstacktop' is
+//		not page-aligned.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_thread_create(void *eip, void *esp, void *tls, void *uxstacktop)
+{
+	struct Env *e;
+	int r;
+
+	if ((uintptr_t) eip >= UTOP || (uintptr_t) esp > UTOP
+	    || (uintptr_t) tls >= UTOP || (uintptr_t) uxstacktop > UTOP
+	    || PGOFF(uxstacktop))
+		return -E_INVAL;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	env_share_vm(e, curenv);
+
+	e->env_tf.tf_eip = (uintptr_t) eip;
+	e->env_tf.tf_esp = (uintptr_t) esp;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_uxstacktop = (uintptr_t) uxstacktop;
+	e->env_tls = (uintptr_t) tls;
+	e->priority = curenv->priority;
+	// The executable's lazy pages belong to the shared address space.
+	memcpy(e->env_segs, curenv->env_segs, sizeof(e->env_segs));
+	e->env_nsegs = curenv->env_nsegs;
+	e->env_pager = curenv->env_pager;
+	e->env_pager_file = curenv->env_pager_file;
+	e->env_status = ENV_RUNNABLE;
+	return e->env_id;
+}
+
+// Create a child environment running the ELF image of 'size' bytes at
+// 'binary' in our address space, in one operation instead of spawn's
+// page-by-page loading.  The page at 'stackva' holds the child's
+// initial stack, laid out for USTACKTOP - PGSIZE; it is moved into
+// the child, which starts with stack pointer 'esp'.  Pages we map with
+// PTE_SHARE are shared with the child, as spawn does, and the child
+// is made runnable.
+// If 'fdva' is not null, it is the Fd page of the open executable, and
+// 'binary' need only hold its ELF headers: the child pages its segments
+// in from the file server on demand (see kern/pager.c), and gets its
+// own reference to the file in place of our descriptor.
+// Returns the child's envid, or < 0 on error.  Errors are:
+//	-E_INVAL if 'stackva' is not a writable page below UTOP,
+//		'esp' is not in the child's stack page, or 'fdva' is not
+//		a mapped page below UTOP.
+//	-E_NOT_SUPP if the executable cannot be paged in on demand.
+//	-E_NO_FREE_ENV, -E_NO_MEM, or an error from env_load_elf.
+static envid_t
+sys_spawn_elf(const void *binary, size_t size, void *stackva, uintptr_t esp,
+	      void *fdva)
+{
+	struct Env *e;
+	struct PageInfo *pp, *fdpage;
+	envid_t pager;
+	pte_t *pte;
+	int r;
+
+	if ((uintptr_t) stackva >= UTOP || PGOFF(stackva))
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, stackva, &pte))
+	    || (*pte & (PTE_U | PTE_W)) != (PTE_U | PTE_W))
+		return -E_INVAL;
+	if (esp <= USTACKTOP - PGSIZE || esp > USTACKTOP)
+		return -E_INVAL;
+	fdpage = NULL;
+	pager = 0;
+	if (fdva) {
+		if ((uintptr_t) fdva >= UTOP || PGOFF(fdva)
+		    || !(fdpage = page_lookup(curenv->env_pgdir, fdva, &pte))
+		    || !(*pte & PTE_U))
+			return -E_INVAL;
+		if ((pager = svc_lookup("fs")) < 0)
+			return -E_NOT_SUPP;
+	}
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	e->env_status = ENV_NOT_RUNNABLE;
+
+	if ((r = env_load_elf(e, binary, size, fdpage != NULL)) < 0
+	    || (r = page_insert(e->env_pgdir, pp, (void *) (USTACKTOP - PGSIZE),
+				PTE_P | PTE_U | PTE_W)) < 0
+	    || (r = env_copy_shared(e, curenv)) < 0) {
+		env_free(e);
+		return r;
+	}
+	if (fdpage) {
+		// Our descriptor for the executable is not the child's to close.
+		page_remove(e->env_pgdir, fdva);
+		if ((r = pager_attach(e, pager, fdpage)) < 0) {
+			env_free(e);
+			return r;
+		}
+	}
+	page_remove(curenv->env_pgdir, stackva);
+
+	e->env_tf.tf_esp = esp;
+	e->env_status = ENV_RUNNABLE;
+	return e->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -170,6 +299,26 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// Set the base of 'envid's thread-local storage segment, which the
+// env finds through GS (see inc/lib.h), to 'tls'.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if tls >= UTOP.
+static int
+sys_env_set_tls(envid_t envid, void *tls)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	if ((uintptr_t) tls >= UTOP)
+		return -E_INVAL;
+	e->env_tls = (uintptr_t) tls;
+	return 0;
+}
+
 
 
 // Allocate a page of memory and map it at 'va' with permission
@@ -262,6 +411,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	struct PageInfo* pp;
 	pte_t* pte;
+	if ((uintptr_t)srcva < UTOP)
+		pager_fill(srcEnv, srcva);
 	pp = page_lookup(srcEnv->env_pgdir, srcva, &pte);
 	if (!pp) //if srcva is not mapped in srcenvid's address space
 		return -E_INVAL;
@@ -309,20 +460,21 @@ sys_page_unmap(envid_t envid, void *va)
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// If perm includes IPC_PERM_PAGES(n), send the n pages starting at 'srcva'
+// (see sys_ipc_recv for how many the receiver takes).
+// If perm is IPC_PERM_WORDS(n), send the n words at 'srcva' instead;
+// they show up in the receiver's env_ipc_words and env_ipc_nwords.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
-//
-// The send also can fail for the other reasons listed below.
-//
-// Otherwise, the send succeeds, and the target's ipc fields are
+// If the target is blocked in sys_ipc_recv, its ipc fields are
 // updated as follows:
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
 //    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-// The target environment is marked runnable again, returning 0
-// from the paused sys_ipc_recv system call.  
+// and the target is marked runnable again, returning 0 from the paused
+// sys_ipc_recv system call.  Otherwise the message (with a reference to
+// the page) is buffered in the target's queue, and the target picks it up
+// on its next sys_ipc_recv.
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
@@ -332,8 +484,8 @@ sys_page_unmap(envid_t envid, void *va)
 // Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv
+//		and its message queue is full.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -343,78 +495,393 @@ sys_page_unmap(envid_t envid, void *va)
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//	-E_INVAL if more than IPC_NWORDS words or IPC_MAXPAGES pages are
+//		sent, or the pages run past UTOP.
+//	-E_FAULT if the words to send are not readable.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	struct Env *targetEnv;
-	struct PageInfo *pp;
-	pte_t* pte;
+	struct IpcMsg msg;
+	int res;
 
-	int res = envid2env(envid, &targetEnv, 0);
-	if (res < 0)
+	if (envid2env(envid, &targetEnv, 0) < 0)
 		return -E_BAD_ENV;
 
-	if (targetEnv->env_ipc_recving == 0)
-		return -E_IPC_NOT_RECV;
+	if ((res = ipc_msg_build(&msg, value, srcva, perm)) < 0)
+		return res;
 
-	if ((uintptr_t) srcva < UTOP){
-		if (PGOFF(srcva) != 0)// not page-aligned
-			return -E_INVAL;
-		
-		else if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P)) // not present or not with user premissions.
-			return -E_INVAL;
+	res = ipc_send_msg(targetEnv, &msg, false);
+	ipc_msg_release(&msg);
+	return res;
+}
 
-		else if ((perm & (~PTE_SYSCALL)) != 0) // holds invalid bits for syscall
-			return -E_INVAL;
+// Like sys_ipc_try_send, but if the target's queue is full, block until
+// the target receives and makes room instead of failing.
+//
+// This function returns 0 if the message was delivered or queued at once;
+// a blocked sender eventually returns 0 as well, or -E_BAD_ENV if the
+// target is destroyed before taking the message.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *targetEnv;
+	struct IpcMsg msg;
+	int res;
 
-		pp = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (pp == NULL) // could not find srcva in env pgdir 
-			return -E_INVAL;
+	if (envid2env(envid, &targetEnv, 0) < 0)
+		return -E_BAD_ENV;
 
-		if ((perm & PTE_W) && !(*pte & PTE_W)) // asked for writable permissions but srcva is read_only
-			return -E_INVAL;
-		
-		res = page_insert(targetEnv->env_pgdir, pp, targetEnv->env_ipc_dstva, perm);
-		if (res < 0)
-			return -E_NO_MEM;
-		
-		targetEnv->env_ipc_perm = perm;
-	}
-	else
-		targetEnv->env_ipc_perm = 0; // no page mapping is sent
+	if ((res = ipc_msg_build(&msg, value, srcva, perm)) < 0)
+		return res;
 
-	targetEnv->env_ipc_recving = 0;
-	targetEnv->env_ipc_from = curenv->env_id;
-	targetEnv->env_ipc_value = value;
-	targetEnv->env_status = ENV_RUNNABLE;
+	res = ipc_send_msg(targetEnv, &msg, true);
+	ipc_msg_release(&msg);
+	return res;
+}
 
+// Check the receive window of '*npages' pages at 'dstva', turning
+// a count of 0 into 1.
+static int
+ipc_check_dstva(void *dstva, uint32_t *npages)
+{
+	if (*npages == 0)
+		*npages = 1;
+	if (*npages > IPC_MAXPAGES)
+		return -E_INVAL;
+	if ((uintptr_t) dstva >= UTOP)
+		return 0;
+	if (PGOFF(dstva) != 0) // valid addr but not page-aligned
+		return -E_INVAL;
+	if (*npages > (UTOP - (uintptr_t) dstva) / PGSIZE)
+		return -E_INVAL;
 	return 0;
 }
 
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
+// If a message is already buffered, take it and return at once.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// 'npages' is how many consecutive pages from dstva on may be filled by
+// a page-vector message (0 means 1).
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if npages > IPC_MAXPAGES or the pages run past UTOP.
+//	-E_NO_MEM if a buffered page could not be mapped at dstva.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t npages)
 {
-	if (((uintptr_t) dstva < UTOP) && (PGOFF(dstva) != 0)) // valid addr but not page-aligned
-		return -E_INVAL;
+	int res;
 
-	curenv->env_ipc_recving = 1;
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE; //no need to yield - the clock interupt will cause returning from trap and yielding
-	
+	if ((res = ipc_check_dstva(dstva, &npages)) < 0)
+		return res;
+
+	//no need to yield if we block - returning from trap will yield
+	res = ipc_wait(dstva, npages);
+	return res < 0 ? res : 0;
+}
+
+// curenv just handed a message to 'e' and is now blocked receiving the
+// answer.  If 'e' can run, switch to it directly instead of going
+// through the scheduler.  Does not return in that case.
+static void
+ipc_switch_to(struct Env *e)
+{
+	if (e == NULL || e == curenv || e->env_status != ENV_RUNNABLE)
+		return;
+	if (curenv->env_status != ENV_NOT_RUNNABLE)
+		return;
+
+	// env_run never returns to syscall(), so set our result here.
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	env_run(e);
+}
+
+// Send a request to 'envid' and wait for the reply in one system call.
+// The send is done as in sys_ipc_send (blocking if envid's queue is
+// full), then curenv receives as in sys_ipc_recv(dstva, n), where n is
+// given by IPC_RECV_PAGES(n) in perm.  When the request went straight to
+// a waiting server, we switch to it at once.
+//
+// Returns 0 once the reply has arrived, < 0 on error.  Errors are those
+// of sys_ipc_send and sys_ipc_recv.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	struct Env *targetEnv;
+	struct IpcMsg msg;
+	uint32_t npages = IPC_PERM_RECVPAGES(perm);
+	int res;
+
+	if (envid2env(envid, &targetEnv, 0) < 0)
+		return -E_BAD_ENV;
+
+	if ((res = ipc_check_dstva(dstva, &npages)) < 0)
+		return res;
+
+	if ((res = ipc_msg_build(&msg, value, srcva, perm)) < 0)
+		return res;
+
+	res = ipc_send_msg(targetEnv, &msg, true);
+	ipc_msg_release(&msg);
+	if (res < 0)
+		return res;
+
+	if (curenv->env_ipc_sendto) {
+		// Blocked on a full queue; we start receiving when it drains.
+		curenv->env_ipc_calling = 1;
+		curenv->env_ipc_dstva = dstva;
+		curenv->env_ipc_maxpages = npages;
+		return 0;
+	}
+
+	if ((res = ipc_wait(dstva, npages)) != 0)
+		return res < 0 ? res : 0;
+	ipc_switch_to(targetEnv);
+	return 0;
+}
+
+// Reply to 'envid' and wait for the next request in one system call.
+// If 'envid' is 0 there is nothing to reply to.  The reply is
+// sent as in sys_ipc_try_send but never blocks the server: if the
+// client is gone or its queue is full, the reply is dropped.
+// curenv then receives as in sys_ipc_recv(dstva, n), where n is given by
+// IPC_RECV_PAGES(n) in perm.  If no request is waiting and the reply
+// woke the client, we switch to the client.
+//
+// Returns 0 once a request has arrived, < 0 on error.  Errors are the
+// page errors of sys_ipc_try_send and those of sys_ipc_recv.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	struct Env *targetEnv = NULL;
+	struct IpcMsg msg;
+	uint32_t npages = IPC_PERM_RECVPAGES(perm);
+	int res;
+
+	if ((res = ipc_check_dstva(dstva, &npages)) < 0)
+		return res;
+
+	if (envid != 0) {
+		if ((res = ipc_msg_build(&msg, value, srcva, perm)) < 0)
+			return res;
+		if (envid2env(envid, &targetEnv, 0) < 0
+		    || ipc_send_msg(targetEnv, &msg, false) < 0)
+			targetEnv = NULL;
+		ipc_msg_release(&msg);
+	}
+
+	if ((res = ipc_wait(dstva, npages)) != 0)
+		return res < 0 ? res : 0;
+	ipc_switch_to(targetEnv);
+	return 0;
+}
+
+
+// If the word at 'addr' still holds 'expected', sleep until another env
+// calls sys_futex_wake on the same word (possibly through a different
+// mapping of the same page).  If 'timeout' is nonzero, give up after
+// that many milliseconds.
+//
+// Returns 0 when woken, < 0 on error.  Errors are:
+//	-E_AGAIN if *addr != expected when we tried to sleep.
+//	-E_TIMEOUT if the timeout expired first.
+//	-E_INVAL if addr is not 4-byte aligned.
+//	-E_FAULT if addr is not readable.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	return futex_wait(addr, expected, timeout);
+}
+
+// Wake up to 'n' envs sleeping on the word at 'addr'.
+// Returns the number of envs woken, or < 0 on error (see sys_futex_wait).
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	return futex_wake(addr, n);
+}
+
+// Copy the service name [name, name+len) from the user into 'buf',
+// which holds SVC_NAMELEN bytes, and NUL-terminate it.
+static int
+svc_copyname(char *buf, const char *name, size_t len)
+{
+	if (len == 0 || len >= SVC_NAMELEN)
+		return -E_INVAL;
+	if (user_mem_check(curenv, name, len, PTE_U) < 0)
+		return -E_FAULT;
+	memmove(buf, name, len);
+	buf[len] = '\0';
+	if (strlen(buf) != len)
+		return -E_INVAL;
 	return 0;
 }
 
+// Register the current environment as a server of 'name'.
+// See svc_register for the errors.
+static int
+sys_svc_register(const char *name, size_t len)
+{
+	char buf[SVC_NAMELEN];
+	int r;
+
+	if ((r = svc_copyname(buf, name, len)) < 0)
+		return r;
+	return svc_register(curenv, buf, 0);
+}
+
+// Stop serving 'name'.
+static int
+sys_svc_unregister(const char *name, size_t len)
+{
+	char buf[SVC_NAMELEN];
+	int r;
+
+	if ((r = svc_copyname(buf, name, len)) < 0)
+		return r;
+	return svc_unregister(curenv, buf);
+}
+
+// Return the envid of an env serving 'name', or -E_NOT_FOUND.
+// Successive calls rotate among the instances of the service.
+static envid_t
+sys_svc_lookup(const char *name, size_t len)
+{
+	char buf[SVC_NAMELEN];
+	int r;
+
+	if ((r = svc_copyname(buf, name, len)) < 0)
+		return r;
+	return svc_lookup(buf);
+}
+
+// As the pager of env 'envid', supply our page at 'srcva' for the page
+// 'va' it waits for (see kern/pager.c), mapped with 'perm'.  An 'srcva'
+// at or above UTOP reports that the page cannot be had, and the env is
+// destroyed.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if we are not its pager, it does not wait for 'va',
+//		'srcva' is not mapped, or 'perm' is inappropriate
+//		(see sys_page_map).
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_pager_supply(envid_t envid, void *va, void *srcva, int perm)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if ((uintptr_t) srcva >= UTOP)
+		return pager_supply(e, (uintptr_t) va, NULL, 0);
+	if (PGOFF(srcva) || !(pp = page_lookup(curenv->env_pgdir, srcva, &pte)))
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+	return pager_supply(e, (uintptr_t) va, pp, perm);
+}
+
+// The device system calls are for environments with I/O privilege,
+// which drive devices themselves.
+static bool
+env_has_io(struct Env *e)
+{
+	return (e->env_tf.tf_eflags & FL_IOPL_MASK) == FL_IOPL_3;
+}
+
+// Return the base I/O port of the IDE controller's bus-master DMA
+// registers.
+// Returns the port on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no I/O privilege.
+//	-E_NOT_SUPP if the controller cannot do DMA.
+static int
+sys_ide_bmbase(void)
+{
+	if (!env_has_io(curenv))
+		return -E_INVAL;
+	return ide_bmbase();
+}
+
+// Sleep until hardware interrupt 'irq' arrives.  An interrupt that came
+// since the last call ends the next call at once.  Only the IRQs of
+// devices left to user drivers (see irq_claim) can be waited for.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no I/O privilege, if 'irq' is not a user
+//		driver's, or if another env is already waiting for it.
+static int
+sys_irq_wait(int irq)
+{
+	if (!env_has_io(curenv))
+		return -E_INVAL;
+	return irq_wait(irq);
+}
+
+// Return the physical address of the byte at 'va', for a device to
+// transfer to or from.
+// Returns the address on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no I/O privilege or if 'va' is not mapped.
+static int
+sys_dma_paddr(void *va)
+{
+	struct PageInfo *pp;
+
+	if (!env_has_io(curenv) || (uintptr_t) va >= UTOP
+	    || !(pp = page_lookup(curenv->env_pgdir, va, NULL)))
+		return -E_INVAL;
+	return page2pa(pp) + PGOFF(va);
+}
+
+// Map 'npages' pages that are contiguous in physical memory at 'va' in
+// curenv's address space, for a device to use, and return the physical
+// address of the first.  Such pages are scarce and never freed.
+// Returns the address on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no I/O privilege, or if 'va' is not
+//		page-aligned or the range not below UTOP.
+//	-E_NO_MEM if there are not enough such pages left, or no memory
+//		for page tables.
+static int
+sys_dma_alloc(void *va, size_t npages)
+{
+	struct PageInfo *pp;
+	size_t i;
+	int r;
+
+	if (!env_has_io(curenv) || PGOFF(va) || npages == 0
+	    || (uintptr_t) va >= UTOP || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	if (!(pp = dma_alloc(npages)))
+		return -E_NO_MEM;
+	for (i = 0; i < npages; i++)
+		if ((r = page_insert(curenv->env_pgdir, pp + i,
+				     (uint8_t *) va + i * PGSIZE,
+				     PTE_P | PTE_U | PTE_W)) < 0)
+			return r;
+	return page2pa(pp);
+}
+
+// Store the virtio-blk device's base I/O port in *port and IRQ in *irq.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv has no I/O privilege.
+//	-E_NOT_SUPP if there is no virtio-blk device.
+static int
+sys_virtio_blk_info(uint32_t *port, uint32_t *irq)
+{
+	if (!env_has_io(curenv))
+		return -E_INVAL;
+	user_mem_assert(curenv, port, sizeof(*port), PTE_U | PTE_W);
+	user_mem_assert(curenv, irq, sizeof(*irq), PTE_U | PTE_W);
+	return virtio_blk_info(port, irq);
+}
 
 static int sys_set_priority(int priority) {
 	curenv->priority = priority;
@@ -643,7 +1110,41 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_ipc_try_send:
 			return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void*) a3, (unsigned int) a4);
 		case SYS_ipc_recv:
-			return sys_ipc_recv((void*) a1);
+			return sys_ipc_recv((void*) a1, (uint32_t) a2);
+		case SYS_ipc_send:
+			return sys_ipc_send((envid_t) a1, (uint32_t) a2, (void*) a3, (unsigned int) a4);
+		case SYS_futex_wait:
+			return sys_futex_wait((uint32_t*) a1, a2, a3);
+		case SYS_futex_wake:
+			return sys_futex_wake((uint32_t*) a1, (int) a2);
+		case SYS_ipc_call:
+			return sys_ipc_call((envid_t) a1, (uint32_t) a2, (void*) a3, (unsigned int) a4, (void*) a5);
+		case SYS_ipc_reply_wait:
+			return sys_ipc_reply_wait((envid_t) a1, (uint32_t) a2, (void*) a3, (unsigned int) a4, (void*) a5);
+		case SYS_svc_register:
+			return sys_svc_register((const char*) a1, (size_t) a2);
+		case SYS_svc_unregister:
+			return sys_svc_unregister((const char*) a1, (size_t) a2);
+		case SYS_svc_lookup:
+			return sys_svc_lookup((const char*) a1, (size_t) a2);
+		case SYS_spawn_elf:
+			return sys_spawn_elf((const void*) a1, (size_t) a2, (void*) a3, (uintptr_t) a4, (void*) a5);
+		case SYS_thread_create:
+			return sys_thread_create((void*) a1, (void*) a2, (void*) a3, (void*) a4);
+		case SYS_env_set_tls:
+			return sys_env_set_tls((envid_t) a1, (void*) a2);
+		case SYS_pager_supply:
+			return sys_pager_supply((envid_t) a1, (void*) a2, (void*) a3, (int) a4);
+		case SYS_ide_bmbase:
+			return sys_ide_bmbase();
+		case SYS_irq_wait:
+			return sys_irq_wait((int) a1);
+		case SYS_dma_paddr:
+			return sys_dma_paddr((void*) a1);
+		case SYS_dma_alloc:
+			return sys_dma_alloc((void*) a1, (size_t) a2);
+		case SYS_virtio_blk_info:
+			return sys_virtio_blk_info((uint32_t*) a1, (uint32_t*) a2);
 		case SYS_set_priority:
 			return sys_set_priority(a1);
 		case SYS_env_set_trapframe:
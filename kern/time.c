@@ -1,8 +1,14 @@
 #include <kern/time.h>
+#include <kern/env.h>
 #include <inc/assert.h>
 
 static unsigned int ticks;
 
+// Envs blocked with a deadline, linked through env_timeout_link.
+static struct Env *timeout_list;
+
+static void time_expire(void);
+
 void
 time_init(void)
 {
@@ -17,6 +23,7 @@ time_tick(void)
 	ticks++;
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+	time_expire();
 }
 
 unsigned int
@@ -24,3 +31,52 @@ time_msec(void)
 {
 	return ticks * 10;
 }
+
+// Give up on whatever 'e' is about to block on after 'msec'
+// milliseconds: env_timeout(e) is called once the deadline passes,
+// unless time_clear_timeout(e) is called first.
+void
+time_set_timeout(struct Env *e, unsigned int msec)
+{
+	time_clear_timeout(e);
+	e->env_deadline = time_msec() + msec;
+	e->env_timeout_link = timeout_list;
+	timeout_list = e;
+}
+
+void
+time_clear_timeout(struct Env *e)
+{
+	struct Env **pe;
+
+	if (!e->env_deadline)
+		return;
+
+	for (pe = &timeout_list; *pe; pe = &(*pe)->env_timeout_link)
+		if (*pe == e) {
+			*pe = e->env_timeout_link;
+			break;
+		}
+	e->env_deadline = 0;
+	e->env_timeout_link = NULL;
+}
+
+// Time out every env whose deadline has passed.
+static void
+time_expire(void)
+{
+	struct Env **pe, *e;
+	unsigned int now = time_msec();
+
+	pe = &timeout_list;
+	while ((e = *pe)) {
+		if ((int) (e->env_deadline - now) > 0) {
+			pe = &e->env_timeout_link;
+			continue;
+		}
+		*pe = e->env_timeout_link;
+		e->env_deadline = 0;
+		e->env_timeout_link = NULL;
+		env_timeout(e);
+	}
+}
@@ -8,4 +8,8 @@ void time_init(void);
 void time_tick(void);
 unsigned int time_msec(void);
 
+struct Env;
+void time_set_timeout(struct Env *e, unsigned int msec);
+void time_clear_timeout(struct Env *e);
+
 #endif /* JOS_KERN_TIME_H */
@@ -15,6 +15,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/pager.h>
 
 static struct Taskstate ts;
 
@@ -186,6 +187,9 @@ trap_init(void)
 	void t_syscall();			//48: system call
 	SETGATE(idt[T_SYSCALL], INTERRUPT, GD_KT, &t_syscall, DPL_USER);
 
+	void t_tlbflush();			//49: TLB shootdown IPI
+	SETGATE(idt[T_TLBFLUSH], INTERRUPT, GD_KT, &t_tlbflush, DPL_KERN);
+
 	// Per-CPU setup 
 	trap_init_percpu();
 }
@@ -345,6 +349,14 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Interrupts of devices driven by user environments
+	if (trapNumber >= IRQ_OFFSET && trapNumber < IRQ_OFFSET + MAX_IRQS
+	    && irq_notify(trapNumber - IRQ_OFFSET)) {
+		irq_eoi();
+		lapic_eoi();
+		return;
+	}
+
 	if (trapNumber == IRQ_OFFSET + IRQ_E1000){
 		e1000_trap_handler(); 
 		irq_eoi(); // ACK IRQ
@@ -362,6 +374,21 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// Return from a trap frame, like env_pop_tf, but without touching
+// curenv, which there may not be.
+static void __attribute__((noreturn))
+trap_pop_tf(struct Trapframe *tf)
+{
+	__asm __volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("iret failed");  /* mostly to placate the compiler */
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -369,6 +396,19 @@ trap(struct Trapframe *tf)
 	// of GCC rely on DF being clear
 	asm volatile("cld" ::: "cc");
 
+	// A TLB shootdown (see tlb_invalidate) is answered without the big
+	// kernel lock, which the CPU asking for it holds.  It can also
+	// arrive in the kernel, once this CPU has left user mode, e.g. in
+	// sched_halt with no curenv; then go straight back to where it hit.
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		lcr3(rcr3());
+		thiscpu->cpu_tlb_stale = 0;
+		lapic_eoi();
+		if ((tf->tf_cs & 3) == 3 && curenv)
+			env_pop_tf(tf);
+		trap_pop_tf(tf);
+	}
+
 	// Halt the CPU if some other CPU has called panic()
 	extern char *panicstr;
 	if (panicstr)
@@ -385,8 +425,15 @@ trap(struct Trapframe *tf)
 		// Trapped from user mode.
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
+		thiscpu->cpu_in_user = 0;
 		lock_kernel();
 		assert(curenv);
+		// Another thread of curenv's may have changed our page
+		// tables while we waited for the lock.
+		if (thiscpu->cpu_tlb_stale) {
+			thiscpu->cpu_tlb_stale = 0;
+			lcr3(rcr3());
+		}
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
@@ -437,6 +484,11 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Pages of a demand-paged executable are missing until first
+	// touched; trap() resumes or parks curenv as pager_fault left it.
+	if (!(tf->tf_err & FEC_PR) && pager_fault(fault_va) == 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists. Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -459,7 +511,8 @@ page_fault_handler(struct Trapframe *tf)
 	
 	if (curenv->env_pgfault_upcall){ //Call the environment's page fault upcall, if one exists
 		struct UTrapframe* userTf;
-		if (tf->tf_esp < UXSTACKTOP && tf->tf_esp >= UXSTACKTOP-PGSIZE){ // nested exception
+		uintptr_t uxstacktop = curenv->env_uxstacktop; // per thread (see sys_thread_create)
+		if (tf->tf_esp < uxstacktop && tf->tf_esp >= uxstacktop-PGSIZE){ // nested exception
 			uint32_t* stackTop = (uint32_t*)(tf->tf_esp - 4);
 			*stackTop = 0x0; //push empty 32b word
 			//Set up a page fault stack frame on the user exception stack (after current TF in UXSTACK):
@@ -467,7 +520,7 @@ page_fault_handler(struct Trapframe *tf)
 			userTf = (struct UTrapframe*)(stackTop);
 		} 
 		else //Set up a page fault stack frame on the user exception stack (after UXSTACKTOP)
-			userTf = (struct UTrapframe*)(UXSTACKTOP - sizeof(struct UTrapframe)); 
+			userTf = (struct UTrapframe*)(uxstacktop - sizeof(struct UTrapframe)); 
 		
 		user_mem_assert(curenv, (void*) userTf, sizeof(struct UTrapframe), PTE_W); //assert write permissions for new tf.
 
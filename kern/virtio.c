@@ -0,0 +1,48 @@
+// The kernel's part in the virtio-blk driver, which is the file
+// system server's (see fs/virtio.c).  As for IDE DMA (kern/idedma.c),
+// the kernel only finds the device on the PCI bus and hands its
+// interrupt to the driver; the virtqueue lives in pages from dma_alloc.
+
+#include <inc/stdio.h>
+#include <inc/error.h>
+
+#include <kern/virtio.h>
+#include <kern/pci.h>
+#include <kern/picirq.h>
+#include <kern/e1000.h>
+
+static uint32_t blk_port;	// Base of the device's I/O ports, or 0
+static uint32_t blk_irq;
+
+int
+virtio_blk_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+
+	// A legacy device has its registers in I/O space at BAR 0.
+	if (!pcif->reg_base[0] || pcif->reg_size[0] < 0x18)
+		return 0;
+	// The interrupt must not be one the kernel handles itself.
+	if (pcif->irq_line == IRQ_E1000 || pcif->irq_line >= MAX_IRQS) {
+		cprintf("virtio-blk: cannot use irq %d\n", pcif->irq_line);
+		return 0;
+	}
+	blk_port = pcif->reg_base[0];
+	blk_irq = pcif->irq_line;
+	cprintf("virtio-blk at port 0x%x, irq %d\n", blk_port, blk_irq);
+
+	irq_claim(blk_irq);
+	return 1;
+}
+
+// Store the virtio-blk device's base I/O port and IRQ.
+// Returns 0 on success, -E_NOT_SUPP if there is no such device.
+int
+virtio_blk_info(uint32_t *port, uint32_t *irq)
+{
+	if (!blk_port)
+		return -E_NOT_SUPP;
+	*port = blk_port;
+	*irq = blk_irq;
+	return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef JOS_KERN_VIRTIO_H
+#define JOS_KERN_VIRTIO_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Legacy (transitional) virtio-blk PCI device
+#define PCI_VIRTIO_VENDOR	0x1AF4
+#define PCI_VIRTIO_BLK_DEVICE	0x1001
+
+struct pci_func;
+
+int	virtio_blk_attach(struct pci_func *pcif);
+int	virtio_blk_info(uint32_t *port, uint32_t *irq);
+
+#endif /* !JOS_KERN_VIRTIO_H */
@@ -0,0 +1,116 @@
+// Arena allocation for memory that all dies at the same time, such as
+// everything a server allocates while handling one request.
+//
+// An arena is a chain of chunks taken from malloc.  arena_alloc bumps a
+// pointer through the current chunk and moves on to the next one when
+// it fills up, taking a new chunk only at the end of the chain.
+// arena_reset just rewinds to the first chunk, so the chunks are kept
+// for the next round and a steady workload stops calling malloc at
+// all.  Objects too big for a chunk get a block of their own, which
+// arena_reset does free.
+
+#include <inc/lib.h>
+
+// Chunks are a few pages less a little room for malloc's page header,
+// so each is a page run with nothing wasted at its end.
+#define ARENA_CHUNKSIZE	(4 * PGSIZE - 64)
+#define ARENA_ALIGN	8
+
+struct ArenaChunk {
+	struct ArenaChunk *ac_next;
+	// malloc's blocks are ARENA_ALIGN-aligned, so this is too.
+	uint8_t ac_data[0] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct Arena {
+	struct ArenaChunk *a_first;	// The chain of chunks
+	struct ArenaChunk *a_cur;	// Chunk being allocated from
+	uint8_t *a_ptr;			// Next free byte in a_cur
+	uint8_t *a_end;			// End of a_cur
+	struct ArenaChunk *a_big;	// Oversized objects' blocks
+};
+
+struct Arena *
+arena_create(void)
+{
+	struct Arena *a;
+
+	if (!(a = malloc(sizeof(struct Arena))))
+		return 0;
+	memset(a, 0, sizeof(struct Arena));
+	return a;
+}
+
+// Move on to the chunk after a_cur, or the first if there is no a_cur,
+// adding one to the chain if we are at its end.
+// Returns 0 on success, -E_NO_MEM if malloc fails.
+static int
+arena_next_chunk(struct Arena *a)
+{
+	struct ArenaChunk **link, *c;
+
+	link = a->a_cur ? &a->a_cur->ac_next : &a->a_first;
+	if (!(c = *link)) {
+		if (!(c = malloc(ARENA_CHUNKSIZE)))
+			return -E_NO_MEM;
+		c->ac_next = 0;
+		*link = c;
+	}
+	a->a_cur = c;
+	a->a_ptr = c->ac_data;
+	a->a_end = (uint8_t *) c + ARENA_CHUNKSIZE;
+	return 0;
+}
+
+// Allocate 'size' bytes, aligned to ARENA_ALIGN, that live until the
+// next arena_reset.  Returns NULL if out of memory.
+void *
+arena_alloc(struct Arena *a, size_t size)
+{
+	struct ArenaChunk *c;
+	uint8_t *v;
+
+	size = ROUNDUP(size, ARENA_ALIGN);
+	if (size > ARENA_CHUNKSIZE - sizeof(struct ArenaChunk)) {
+		if (!(c = malloc(sizeof(struct ArenaChunk) + size)))
+			return 0;
+		c->ac_next = a->a_big;
+		a->a_big = c;
+		return c->ac_data;
+	}
+
+	while (!a->a_cur || ROUNDUP(a->a_ptr, ARENA_ALIGN) + size > a->a_end)
+		if (arena_next_chunk(a) < 0)
+			return 0;
+	v = ROUNDUP(a->a_ptr, ARENA_ALIGN);
+	a->a_ptr = v + size;
+	return v;
+}
+
+// Release everything allocated from 'a'.  The chunks stay in the arena
+// for reuse.
+void
+arena_reset(struct Arena *a)
+{
+	struct ArenaChunk *c;
+
+	while ((c = a->a_big)) {
+		a->a_big = c->ac_next;
+		free(c);
+	}
+	a->a_cur = 0;
+	a->a_ptr = a->a_end = 0;
+}
+
+void
+arena_destroy(struct Arena *a)
+{
+	struct ArenaChunk *c;
+
+	arena_reset(a);
+	while ((c = a->a_first)) {
+		a->a_first = c->ac_next;
+		free(c);
+	}
+	free(a);
+}
@@ -0,0 +1,238 @@
+// Single-producer/single-consumer record channels.
+//
+// A channel is a ring of fixed-size records in PTE_SHARE pages, so it
+// survives fork and spawn and both sides see the same memory.  The
+// producer only advances cs_head and the consumer only advances
+// cs_tail, each on its own cache line, so sending and receiving take
+// no locks and no system calls.  Each side also caches the other's
+// index and only rereads the shared line when the cached value says
+// the ring is full (or empty).
+//
+// Channels created with CHAN_BLOCK can also be waited on: a side that
+// runs out of room (or records) sets its sleep flag and sleeps on the
+// peer's event word with sys_futex_wait; the peer bumps the word and
+// wakes it only when it sees the flag set.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Full memory barrier: orders our index store before the load of the
+// peer's sleep flag (x86 may otherwise reorder a load before a store).
+static inline void
+chan_mb(void)
+{
+	asm volatile("lock; addl $0, 0(%%esp)" ::: "memory", "cc");
+}
+
+// Compiler barrier: keep record copies on the right side of index updates.
+#define chan_barrier()	asm volatile("" ::: "memory")
+
+// Return the number of bytes of address space a channel of 'nrecs'
+// records of 'recsize' bytes occupies, header page included.
+size_t
+chan_size(size_t recsize, size_t nrecs)
+{
+	return PGSIZE + ROUNDUP(recsize * nrecs, PGSIZE);
+}
+
+static void
+chan_init_handle(struct Chan *ch, struct ChanShared *cs)
+{
+	ch->ch_shared = cs;
+	ch->ch_ring = (uint8_t *) cs + PGSIZE;
+	ch->ch_recsize = cs->cs_recsize;
+	ch->ch_mask = cs->cs_nrecs - 1;
+	ch->ch_cached = cs->cs_tail;
+}
+
+// Create a channel of 'nrecs' records (a power of 2) of 'recsize' bytes
+// at page-aligned 'va', allocating chan_size(recsize, nrecs) bytes of
+// shared memory there.  The other side gets at it with chan_attach,
+// typically after fork or spawn.
+// Returns 0 on success, < 0 on error.
+int
+chan_create(struct Chan *ch, void *va, size_t recsize, size_t nrecs, int flags)
+{
+	struct ChanShared *cs = va;
+	size_t off, size;
+	int r;
+
+	if (PGOFF(va) || recsize == 0 || nrecs == 0 || (nrecs & (nrecs - 1)))
+		return -E_INVAL;
+
+	size = chan_size(recsize, nrecs);
+	for (off = 0; off < size; off += PGSIZE)
+		if ((r = sys_page_alloc(0, va + off, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0) {
+			while (off > 0)
+				sys_page_unmap(0, va + (off -= PGSIZE));
+			return r;
+		}
+
+	cs->cs_flags = flags;
+	cs->cs_recsize = recsize;
+	cs->cs_nrecs = nrecs;
+	cs->cs_magic = CHAN_MAGIC;
+	chan_init_handle(ch, cs);
+	return 0;
+}
+
+// Attach to the channel created at 'va'.
+// Returns 0 on success, -E_INVAL if there is no channel there.
+int
+chan_attach(struct Chan *ch, void *va)
+{
+	struct ChanShared *cs = va;
+
+	if (PGOFF(va) || !(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P))
+		return -E_INVAL;
+	if (cs->cs_magic != CHAN_MAGIC)
+		return -E_INVAL;
+	chan_init_handle(ch, cs);
+	return 0;
+}
+
+// The peer may be asleep: if its sleep flag is set, clear it, bump the
+// event word it sleeps on and wake it.
+static void
+chan_wake(volatile uint32_t *sleeping, volatile uint32_t *event)
+{
+	chan_mb();
+	if (*sleeping && xchg(sleeping, 0)) {
+		(*event)++;
+		sys_futex_wake(event, 1);
+	}
+}
+
+// Producer: append up to 'n' records from 'recs'.
+// Returns the number appended, which is less than n if the ring fills.
+size_t
+chan_send(struct Chan *ch, const void *recs, size_t n)
+{
+	struct ChanShared *cs = ch->ch_shared;
+	uint32_t head = cs->cs_head, size = ch->ch_mask + 1;
+	uint32_t slot, first;
+
+	if ((int32_t) (size - (head - ch->ch_cached)) < (int32_t) n)
+		ch->ch_cached = cs->cs_tail;
+	n = MIN(n, size - (head - ch->ch_cached));
+	if (n == 0)
+		return 0;
+
+	slot = head & ch->ch_mask;
+	first = MIN(n, size - slot);
+	memcpy(ch->ch_ring + slot * ch->ch_recsize, recs, first * ch->ch_recsize);
+	memcpy(ch->ch_ring, (const uint8_t *) recs + first * ch->ch_recsize,
+	       (n - first) * ch->ch_recsize);
+	chan_barrier();
+	cs->cs_head = head + n;
+
+	if (cs->cs_flags & CHAN_BLOCK)
+		chan_wake(&cs->cs_csleep, &cs->cs_pevent);
+	return n;
+}
+
+// Consumer: take up to 'n' records into 'recs'.
+// Returns the number taken, 0 if the ring is empty.
+size_t
+chan_recv(struct Chan *ch, void *recs, size_t n)
+{
+	struct ChanShared *cs = ch->ch_shared;
+	uint32_t tail = cs->cs_tail, size = ch->ch_mask + 1;
+	uint32_t slot, first;
+
+	if ((int32_t) (ch->ch_cached - tail) < (int32_t) n)
+		ch->ch_cached = cs->cs_head;
+	n = MIN(n, ch->ch_cached - tail);
+	if (n == 0)
+		return 0;
+
+	chan_barrier();
+	slot = tail & ch->ch_mask;
+	first = MIN(n, size - slot);
+	memcpy(recs, ch->ch_ring + slot * ch->ch_recsize, first * ch->ch_recsize);
+	memcpy((uint8_t *) recs + first * ch->ch_recsize, ch->ch_ring,
+	       (n - first) * ch->ch_recsize);
+	chan_barrier();
+	cs->cs_tail = tail + n;
+
+	if (cs->cs_flags & CHAN_BLOCK)
+		chan_wake(&cs->cs_psleep, &cs->cs_cevent);
+	return n;
+}
+
+// Producer: append all 'n' records, sleeping while the ring is full.
+// Returns 0, or -E_INVAL if the channel was not created with CHAN_BLOCK.
+int
+chan_send_wait(struct Chan *ch, const void *recs, size_t n)
+{
+	struct ChanShared *cs = ch->ch_shared;
+	uint32_t ev;
+	size_t done;
+
+	if (!(cs->cs_flags & CHAN_BLOCK))
+		return -E_INVAL;
+
+	while (n > 0) {
+		if ((done = chan_send(ch, recs, n)) > 0) {
+			recs = (const uint8_t *) recs + done * ch->ch_recsize;
+			n -= done;
+			continue;
+		}
+		// Full.  Announce that we sleep, then look once more: the
+		// consumer either sees our flag or we see its progress.
+		ev = cs->cs_cevent;
+		xchg(&cs->cs_psleep, 1);
+		if (cs->cs_head - cs->cs_tail == ch->ch_mask + 1)
+			sys_futex_wait(&cs->cs_cevent, ev, 0);
+	}
+	return 0;
+}
+
+// Consumer: take between 1 and 'n' records into 'recs', sleeping while
+// the ring is empty.  Returns the number taken, 0 once the producer has
+// closed the channel and it is drained, or -E_INVAL if the channel was
+// not created with CHAN_BLOCK.
+int
+chan_recv_wait(struct Chan *ch, void *recs, size_t n)
+{
+	struct ChanShared *cs = ch->ch_shared;
+	uint32_t ev;
+	size_t done;
+
+	if (!(cs->cs_flags & CHAN_BLOCK))
+		return -E_INVAL;
+
+	while ((done = chan_recv(ch, recs, n)) == 0) {
+		if (cs->cs_closed && cs->cs_head == cs->cs_tail)
+			return 0;
+		ev = cs->cs_pevent;
+		xchg(&cs->cs_csleep, 1);
+		if (cs->cs_head == cs->cs_tail && !cs->cs_closed)
+			sys_futex_wait(&cs->cs_pevent, ev, 0);
+	}
+	return done;
+}
+
+// Producer: no more records will be sent.
+void
+chan_close(struct Chan *ch)
+{
+	struct ChanShared *cs = ch->ch_shared;
+
+	cs->cs_closed = 1;
+	if (cs->cs_flags & CHAN_BLOCK)
+		chan_wake(&cs->cs_csleep, &cs->cs_pevent);
+}
+
+// Unmap our view of the channel.  The memory is freed once every
+// env that shares it has done so (or exited).
+void
+chan_destroy(struct Chan *ch)
+{
+	size_t off, size;
+
+	size = chan_size(ch->ch_recsize, ch->ch_mask + 1);
+	for (off = 0; off < size; off += PGSIZE)
+		sys_page_unmap(0, (uint8_t *) ch->ch_shared + off);
+	ch->ch_shared = NULL;
+}
@@ -6,14 +6,14 @@
 #define MAXFD		32
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
-// Bottom of file data area.  We reserve one data page for each FD,
-// which devices can use if they choose.
+// Bottom of file data area.  We reserve FDDATASIZE bytes of address
+// space for each FD, which devices can map pages in if they choose.
 #define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
 
 // Return the 'struct Fd*' for file descriptor index i
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + (i)*PGSIZE))
-// Return the file data page for file descriptor index i
-#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PGSIZE))
+// Return the file data area for file descriptor index i
+#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*FDDATASIZE))
 
 
 // --------------------------------------------------------------
@@ -175,8 +175,8 @@ int
 dup(int oldfdnum, int newfdnum)
 {
 	int r;
+	size_t off;
 	char *ova, *nva;
-	pte_t pte;
 	struct Fd *oldfd, *newfd;
 
 	if ((r = fd_lookup(oldfdnum, &oldfd)) < 0)
@@ -187,9 +187,11 @@ dup(int oldfdnum, int newfdnum)
 	ova = fd2data(oldfd);
 	nva = fd2data(newfd);
 
-	if ((uvpd[PDX(ova)] & PTE_P) && (uvpt[PGNUM(ova)] & PTE_P))
-		if ((r = sys_page_map(0, ova, 0, nva, uvpt[PGNUM(ova)] & PTE_SYSCALL)) < 0)
-			goto err;
+	for (off = 0; off < FDDATASIZE; off += PGSIZE)
+		if ((uvpd[PDX(ova + off)] & PTE_P) && (uvpt[PGNUM(ova + off)] & PTE_P))
+			if ((r = sys_page_map(0, ova + off, 0, nva + off,
+					      uvpt[PGNUM(ova + off)] & PTE_SYSCALL)) < 0)
+				goto err;
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
 
@@ -197,7 +199,8 @@ dup(int oldfdnum, int newfdnum)
 
 err:
 	sys_page_unmap(0, newfd);
-	sys_page_unmap(0, nva);
+	for (off = 0; off < FDDATASIZE; off += PGSIZE)
+		sys_page_unmap(0, nva + off);
 	return r;
 }
 
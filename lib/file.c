@@ -6,6 +6,18 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// The file server we talk to.  Look it up once, so that all of our
+// requests go to the same instance of the service.
+static envid_t
+fs_env(void)
+{
+	static envid_t fsenv;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_service("fs");
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,17 +27,31 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fs_env(), type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva, NULL);
+}
+
+// Like fsipc, for requests whose first 'reqlen' bytes of fsipcbuf fit in
+// IPC_NWORDS words and whose reply is just the result.  The request is
+// copied into the message itself, so no page is mapped into the server.
+static int
+fsipc_small(unsigned type, size_t reqlen)
+{
+	int nwords = ROUNDUP(reqlen, sizeof(uint32_t)) / sizeof(uint32_t);
+
+	// Even an empty request needs a word to tell it from a bad one.
+	if (nwords == 0)
+		nwords = 1;
+	assert(nwords <= IPC_NWORDS);
+
+	if (debug)
+		cprintf("[%08x] fsipc_small %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+
+	return ipc_call(fs_env(), type, &fsipcbuf, IPC_PERM_WORDS(nwords), NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -97,7 +123,7 @@ static int
 devfile_flush(struct Fd *fd)
 {
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	return fsipc_small(FSREQ_FLUSH, sizeof(fsipcbuf.flush));
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -167,9 +193,36 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 {
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	return fsipc_small(FSREQ_SET_SIZE, sizeof(fsipcbuf.set_size));
 }
 
+// Map up to 'npages' pages of the file open on 'fdnum' read-only at
+// 'dstva', starting with the page that holds 'offset'.  The pages are
+// the file server's block cache pages, so no data is copied; unmap
+// them when done.  The file's seek position is not used or changed.
+// Returns the number of file bytes from the start of the first page
+// that the mapped pages hold (0 at end of file), or < 0 on error.
+int
+file_map(int fdnum, off_t offset, void *dstva, int npages)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (npages <= 0 || npages > IPC_MAXPAGES)
+		return -E_INVAL;
+
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = ROUNDDOWN(offset, PGSIZE);
+	fsipcbuf.map.req_npages = npages;
+	static_assert(sizeof(fsipcbuf.map) <= IPC_NWORDS * sizeof(uint32_t));
+	return ipc_call(fs_env(), FSREQ_MAP, &fsipcbuf,
+			IPC_PERM_WORDS(sizeof(fsipcbuf.map) / sizeof(uint32_t))
+			| IPC_RECV_PAGES(npages), dstva, NULL);
+}
 
 // Synchronize disk with buffer cache
 int
@@ -178,6 +231,6 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_small(FSREQ_SYNC, 0);
 }
 
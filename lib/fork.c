@@ -24,21 +24,22 @@ pgfault(struct UTrapframe *utf)
 	if (!((err & FEC_WR) && (uvpt[PGNUM(addr)] & PTE_COW)))
 		panic("pgfault: not write fault or not COW\n");
 
-	// Allocates a new page, map it at a temporary location (PFTEMP),
-	// copies the data from the old page to the new page, then moves the new
-	// page to the old page's address.
+	// Allocates a new page, map it at a temporary location (the calling
+	// thread's own, see pthread_pftemp), copies the data from the old page
+	// to the new page, then moves the new page to the old page's address.
 
 	envid_t envid = sys_getenvid();
-	res = sys_page_alloc(envid, PFTEMP, (PTE_W | PTE_U | PTE_P));
+	void *tmp = pthread_pftemp();
+	res = sys_page_alloc(envid, tmp, (PTE_W | PTE_U | PTE_P));
 	if (res < 0)
 		panic("pgfault: cant allocate new page - %e\n", res);
 	
-	memcpy(PFTEMP, ROUNDDOWN(addr, PGSIZE), PGSIZE); //copy page
-	res = sys_page_map(envid, PFTEMP, envid, ROUNDDOWN(addr, PGSIZE), PTE_W | PTE_U | PTE_P); //remap to new location
+	memcpy(tmp, ROUNDDOWN(addr, PGSIZE), PGSIZE); //copy page
+	res = sys_page_map(envid, tmp, envid, ROUNDDOWN(addr, PGSIZE), PTE_W | PTE_U | PTE_P); //remap to new location
 	if (res < 0)
 		panic("pgfault: remapping failed - %e\n", res);
 
-	res =  sys_page_unmap(envid, PFTEMP); // unmap temp location
+	res =  sys_page_unmap(envid, tmp); // unmap temp location
 	if (res < 0)
 		panic("pgfault: unmmaping failed - %e\n", res);
 }
@@ -98,9 +99,10 @@ duppage(envid_t envid, unsigned pn)
 //   so we allocate a new page for the child's user exception stack.
 
 
+static void startChild(envid_t envid);
+
 void prepareChild(envid_t envid){
-	extern void _pgfault_upcall(void); 
-	intptr_t vadrr = 0;
+	uintptr_t vadrr = 0;
 	for (; vadrr < USTACKTOP; vadrr += PGSIZE)
 	{
 		if ((uvpd[PDX(vadrr)] & PTE_P) && (uvpt[PGNUM(vadrr)] & PTE_P)){
@@ -108,6 +110,12 @@ void prepareChild(envid_t envid){
 		}
 
 	}
+	startChild(envid);
+}
+
+// Give the child its exception stack and page fault upcall, and let it run.
+static void startChild(envid_t envid){
+	extern void _pgfault_upcall(void); 
 	int res = sys_page_alloc(envid, (void*) (UXSTACKTOP - PGSIZE), PTE_W | PTE_U | PTE_P); // allocate uxstack page
 	if (res < 0)
 		panic("prepareChild: cant allocate uxstack page -%e", res);
@@ -165,11 +173,69 @@ monitoredFork(void)
 	return envid; // child id for parent, 0 for child
 }
 
-int
+// Map our page at va into the child at the same address and with the
+// same permissions, so that both see each other's writes.  A
+// copy-on-write page is first made ours to write, by writing it.
+static void
+sharepage(envid_t envid, uintptr_t va)
+{
+	int res;
+
+	if (uvpt[PGNUM(va)] & PTE_COW)
+		*(volatile char *) va = *(volatile char *) va;
+	res = sys_page_map(0, (void *) va, envid, (void *) va,
+			   uvpt[PGNUM(va)] & PTE_SYSCALL);
+	if (res < 0)
+		panic("sharepage: cant map page to child - %e\n", res);
+}
+
+// Shared-memory fork: the child shares all our memory except the
+// stack, which is copy-on-write as in fork.  Each side still finds its
+// own thisenv, through the TLS block libmain keeps on the stack.
+// Only the main thread may sfork, as other threads' stacks are shared.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	const volatile struct EnvSegment *seg;
+	uintptr_t va;
+	envid_t envid;
+	uint32_t i;
+
+	if (tls()->tls_thread)
+		return -E_NOT_SUPP;
+
+	// Fault in what is left of our writable segments (see kern/pager.c),
+	// or each side would page in its own copy.
+	for (i = 0; i < thisenv->env_nsegs; i++) {
+		seg = &thisenv->env_segs[i];
+		if (!(seg->seg_perm & PTE_W))
+			continue;
+		for (va = ROUNDDOWN(seg->seg_va, PGSIZE); va < seg->seg_va + seg->seg_memsz; va += PGSIZE)
+			(void) *(volatile char *) va;
+	}
+
+	set_pgfault_handler(pgfault);
+	envid = sys_exofork();
+	if (envid < 0)
+		panic("sfork: sys_exofork failed - %e\n", envid);
+
+	if (envid == 0) {
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+
+	for (va = 0; va < USTACKTOP; va += PGSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P))
+			continue;
+		if (va >= USTACKTOP - PGSIZE || (uvpt[PGNUM(va)] & PTE_SHARE))
+			duppage(envid, PGNUM(va));
+		else
+			sharepage(envid, va);
+	}
+	startChild(envid);
+	return envid;
 }
 
  envid_t
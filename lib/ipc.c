@@ -2,6 +2,56 @@
 
 #include <inc/lib.h>
 
+// Collect the message received by a successful receive system call
+// (res == 0), or report its error.  See ipc_recv.
+static int32_t
+ipc_result(int res, envid_t *from_env_store, int *perm_store)
+{
+	if (!res){
+
+		if (from_env_store != NULL)
+			*from_env_store = thisenv->env_ipc_from;
+
+		if (perm_store != NULL)
+			*perm_store = thisenv->env_ipc_perm;
+
+		return thisenv->env_ipc_value;
+	}
+
+	else {
+		if (from_env_store != NULL)
+			*from_env_store = 0;
+
+		if (perm_store != NULL)
+			*perm_store = 0;
+		
+		return res;
+	}
+}
+
+// If the message just received by a successful receive system call is
+// a request for our malloc statistics (see inc/malloc.h), which may come
+// from any env at any time, answer it and return 1 so the caller goes
+// back to receiving.  Otherwise return 0.
+static int
+ipc_malloc_request(int res)
+{
+	if (res || thisenv->env_ipc_perm || thisenv->env_ipc_npages
+	    || thisenv->env_ipc_nwords)
+		return 0;
+	switch (thisenv->env_ipc_value) {
+	case MALLOC_IPC_STATS:
+		malloc_stats();
+		return 1;
+	case MALLOC_IPC_TRACE_ON:
+	case MALLOC_IPC_TRACE_OFF:
+		malloc_trace(thisenv->env_ipc_value == MALLOC_IPC_TRACE_ON);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -18,37 +68,88 @@
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
+	int res;
+
 	if (pg == NULL)
 		pg = (void*) UTOP + 0x1; //address bigger then UTOP means not sending page
-	
-	int res = sys_ipc_recv(pg);
 
-	if (!res){
+	while (ipc_malloc_request(res = sys_ipc_recv(pg)))
+		;
+	return ipc_result(res, from_env_store, perm_store);
+}
 
-		if (from_env_store != NULL)
-			*from_env_store = thisenv->env_ipc_from;
+// Like ipc_recv, but accept a page vector (see IPC_PERM_PAGES) of up to
+// 'npages' pages at 'pg'.  The number of pages actually mapped is stored
+// in *npages_store if that is nonnull.
 
-		if (perm_store != NULL)
-			*perm_store = thisenv->env_ipc_perm;
 
-		return thisenv->env_ipc_value;
-	}
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, int npages,
+	       int *npages_store)
+{
+	int res;
 
-	else {
-		if (from_env_store != NULL)
-			*from_env_store = 0;
+	if (pg == NULL)
+		pg = (void*) UTOP + 0x1;
 
-		if (perm_store != NULL)
-			*perm_store = 0;
-		
-		return res;
-	}
+	while (ipc_malloc_request(res = sys_ipc_recv_pages(pg, npages)))
+		;
+	if (npages_store != NULL)
+		*npages_store = res ? 0 : thisenv->env_ipc_npages;
+	return ipc_result(res, from_env_store, NULL);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its answer, which is received as by ipc_recv(NULL, rcv_pg,
+// perm_store).  Both halves happen in a single system call.
+// Returns the answer, or < 0 if the system call fails.
 
+
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int res;
+
+	if (pg == NULL)
+		pg = (void*) UTOP + 0x1;
+	if (rcv_pg == NULL)
+		rcv_pg = (void*) UTOP + 0x1;
+
+	res = sys_ipc_call(to_env, val, pg, perm, rcv_pg);
+	// Receive again with the same window of pages.
+	while (ipc_malloc_request(res))
+		res = sys_ipc_recv_pages(rcv_pg, IPC_PERM_RECVPAGES(perm));
+	return ipc_result(res, NULL, perm_store);
+}
+
+// Server side of ipc_call: reply 'val' (and 'pg' with 'perm', if 'pg' is
+// nonnull) to 'to_env', then wait for the next request as ipc_recv does.
+// Pass to_env == 0 when there is nobody to reply to.  The reply is
+// dropped rather than waited on if 'to_env' is not ready for it.
+
+
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int res;
+
+	if (pg == NULL)
+		pg = (void*) UTOP + 0x1;
+	if (rcv_pg == NULL)
+		rcv_pg = (void*) UTOP + 0x1;
+
+	res = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg);
+	while (ipc_malloc_request(res))
+		res = sys_ipc_recv_pages(rcv_pg, IPC_PERM_RECVPAGES(perm));
+	return ipc_result(res, from_env_store, perm_store);
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// panic() on any error other than -E_IPC_NOT_RECV.
+// The kernel buffers the message if 'toenv' is not receiving yet, and
+// only puts us to sleep if toenv's queue is full.
+// panic() on any error.
 
 
 void
@@ -57,27 +158,54 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if (pg == NULL)
 		pg = (void*) UTOP + 0x1; //address bigger then UTOP means not sending page
 	
-	int res = sys_ipc_try_send(to_env, val, pg, perm);
-	while (res != 0){
-
-		if ((res < 0) && res != -E_IPC_NOT_RECV)// error different then -E_IPC_NOT_RECV
-			panic("ipc_send: bad error - not waiting error (thisEnv %x -> toEnv %x) - %e\n", thisenv->env_id ,to_env ,res);
+	int res = sys_ipc_send(to_env, val, pg, perm);
+	if (res < 0)
+		panic("ipc_send: (thisEnv %x -> toEnv %x) - %e\n", thisenv->env_id ,to_env ,res);
+}
 
+// Copy the words carried by the last message received (see
+// IPC_PERM_WORDS) into 'words', which must have room for IPC_NWORDS,
+// and return how many there were.
+int
+ipc_get_words(uint32_t *words)
+{
+	uint32_t i, n = thisenv->env_ipc_nwords;
 
-		sys_yield();
-		res = sys_ipc_try_send(to_env, val, pg, perm);
-	}
+	for (i = 0; i < n; i++)
+		words[i] = thisenv->env_ipc_words[i];
+	return n;
 }
 
-// Find the first environment of the given type.  We'll use this to
-// find special environments.
+// Find an environment of the given type.  We'll use this to find
+// special environments; the system servers are looked up by name in
+// the service registry instead of scanning envs[].
 // Returns 0 if no such environment exists.
 envid_t
 ipc_find_env(enum EnvType type)
 {
 	int i;
-	for (i = 0; i < NENV; i++)
-		if (envs[i].env_type == type)
-			return envs[i].env_id;
-	return 0;
+
+	switch (type) {
+	case ENV_TYPE_FS:
+		return ipc_find_service("fs");
+	case ENV_TYPE_NS:
+		return ipc_find_service("ns");
+	default:
+		for (i = 0; i < NENV; i++)
+			if (envs[i].env_type == type)
+				return envs[i].env_id;
+		return 0;
+	}
+}
+
+// Look up an environment serving 'name' in the kernel's service
+// registry.  If several envs serve it, successive lookups rotate among
+// them, so callers should look a service up once and keep the envid.
+// Returns 0 if no environment serves the name.
+envid_t
+ipc_find_service(const char *name)
+{
+	envid_t envid = sys_svc_lookup(name);
+
+	return envid < 0 ? 0 : envid;
 }
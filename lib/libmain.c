@@ -5,12 +5,18 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
 libmain(int argc, char **argv)
 {
+	// The main thread's TLS; libmain never returns.
+	struct Tls main_tls;
+
+	main_tls.tls_self = &main_tls;
+	main_tls.tls_thread = NULL;
+	sys_env_set_tls(0, &main_tls);
+
 	// set thisenv to point at our Env structure in envs[].
 	thisenv = (envs + ENVX(sys_getenvid()));
 	
@@ -2,29 +2,95 @@
 #include <inc/lib.h>
 
 /*
- * Simple malloc/free.
+ * Segregated size-class malloc/free.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * The heap lives between mbegin and mend, a page at a time.  Every
+ * heap page starts with a struct MHeader, so free finds an object's
+ * bookkeeping by rounding its address down to the page.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Requests up to MAXSMALL bytes are rounded up to one of the size
+ * classes in class_size and carved out of slab pages, each holding
+ * objects of a single class.  A slab's free objects are chained
+ * through their first word; slabs with free objects sit on their
+ * class's partial list, so malloc takes the head without searching.
+ * A slab whose objects are all freed goes back to the page pool,
+ * unless it is the last one its class has.
+ *
+ * Larger requests get a run of pages of their own, with the header
+ * at the start of the first page.  Freed runs are unmapped.
+ *
+ * Free single pages are kept mapped in a pool of up to POOLMAX pages
+ * rather than returned to the kernel, and the heap grows POOLBATCH
+ * pages at a time, so steady churn costs no system calls at all.
+ * Address space is found next-fit over unmapped pages, so freed runs
+ * are reused too.
+ *
+ * malloc_stats prints what the heap holds: objects and slabs per class,
+ * live bytes and their peak, and the pages mapped to hold them.  While
+ * malloc_trace is on, every allocation's caller is also recorded in a
+ * hash table beside the heap, and malloc_stats lists the callers of
+ * the objects still live, which finds leaks.  A running program can be
+ * asked for both by IPC (see ipc_malloc_request and user/mstat.c).
  */
 enum
 {
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
+	MAXMALLOC = 1024*1024,	/* max size of one allocated chunk */
+	MHDRSIZE = 32,		/* bytes of MHeader at the start of a page */
+	MAXSMALL = 1008,	/* largest size-class request */
+	NCLASS = 12,
+	POOLMAX = 32,		/* free pages kept mapped */
+	POOLBATCH = 8,		/* pages mapped at once when the pool is dry */
+	NTRACE = 4096,		/* allocations malloc_trace can record */
+	NSITES = 16		/* callers malloc_stats lists */
+};
+
+#define MSLAB	0x534c4142	/* "SLAB" */
+#define MLARGE	0x4c415247	/* "LARG" */
+
+struct MHeader {
+	uint32_t mh_magic;		// MSLAB or MLARGE
+	uint32_t mh_npages;		// Large: pages in the run
+	uint32_t mh_size;		// Large: bytes asked for
+	uint16_t mh_class;		// Slab: index into class_size
+	uint16_t mh_nused;		// Slab: objects handed out
+	void *mh_free;			// Slab: chain of free objects
+	struct MHeader *mh_next;	// Slab: on its class's partial list
+	struct MHeader *mh_prev;
 };
 
-#define PTE_CONTINUED 0x200
+static const uint16_t class_size[NCLASS] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 672, MAXSMALL
+};
+static uint8_t size_class[MAXSMALL / 16 + 1];	// (n + 15) / 16 -> class
+static bool size_class_built;
+static struct MHeader *partial[NCLASS];		// Slabs with free objects
+static uint32_t nslabs[NCLASS];
 
 static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
-static uint8_t *mptr;
+static uint8_t *mptr;			// Where the next-fit search starts
+static void *pool;			// Free pages, chained through their first word
+static uint32_t npool;
+
+static pthread_mutex_t mlock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+static uint32_t class_live[NCLASS];	// Objects handed out, per class
+static uint32_t class_allocs[NCLASS];	// malloc calls, per class
+static uint32_t large_live, large_pages, large_allocs;
+static size_t live_bytes, peak_bytes;	// Small objects count in full
+static uint32_t nmapped;		// Heap pages mapped, pool included
+
+// Allocation sites, while tracing: open addressing on the object's
+// address, with linear probing.
+struct MTrace {
+	void *mt_obj;			// NULL if the slot is free
+	uintptr_t mt_site;		// malloc's caller
+	uint32_t mt_size;
+};
+static struct MTrace *mtrace;
+static bool mtracing;
+static uint32_t ntraced, nuntraced;	// Live records; allocations missed
 
 static int
 isfree(void *v, size_t n)
@@ -38,103 +104,399 @@ isfree(void *v, size_t n)
 	return 1;
 }
 
-void*
-malloc(size_t n)
+// Map npages fresh pages at unused heap addresses.
+// Returns the first, or NULL if we are out of address space or memory.
+static void *
+run_alloc(uint32_t npages)
 {
-	int i, cont;
+	uint8_t *v;
+	uint32_t i;
 	int nwrap;
-	uint32_t *ref;
-	void *v;
 
 	if (mptr == 0)
 		mptr = mbegin;
 
-	n = ROUNDUP(n, 4);
-
-	if (n >= MAXMALLOC)
-		return 0;
-
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
-		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
-	}
-
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
 	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
-			break;
+	while (mptr + npages * PGSIZE > mend || !isfree(mptr, npages * PGSIZE)) {
 		mptr += PGSIZE;
-		if (mptr == mend) {
+		if (mptr + npages * PGSIZE > mend) {
 			mptr = mbegin;
 			if (++nwrap == 2)
 				return 0;	/* out of address space */
 		}
 	}
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
+	v = mptr;
+	for (i = 0; i < npages; i++)
+		if (sys_page_alloc(0, v + i * PGSIZE, PTE_P|PTE_U|PTE_W) < 0) {
+			while (i-- > 0)
+				sys_page_unmap(0, v + i * PGSIZE);
 			return 0;	/* out of physical memory */
 		}
+	mptr = v + npages * PGSIZE;
+	return v;
+}
+
+static void
+run_free(void *v, uint32_t npages)
+{
+	uint32_t i;
+
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, (uint8_t *) v + i * PGSIZE);
+}
+
+// Take a page from the pool, refilling it POOLBATCH pages at a time.
+static void *
+page_get(void)
+{
+	uint8_t *v;
+	uint32_t n, i;
+
+	if (!pool) {
+		for (n = POOLBATCH; n > 0 && !(v = run_alloc(n)); n /= 2)
+			;
+		if (n == 0)
+			return 0;
+		for (i = 0; i < n; i++) {
+			*(void **) (v + i * PGSIZE) = pool;
+			pool = v + i * PGSIZE;
+		}
+		npool += n;
+		nmapped += n;
 	}
+	v = pool;
+	pool = *(void **) v;
+	npool--;
+	return v;
+}
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
+static void
+page_put(void *v)
+{
+	if (npool == POOLMAX) {
+		sys_page_unmap(0, v);
+		nmapped--;
+		return;
+	}
+	*(void **) v = pool;
+	pool = v;
+	npool++;
+}
+
+static void
+partial_remove(struct MHeader *h)
+{
+	if (h->mh_prev)
+		h->mh_prev->mh_next = h->mh_next;
+	else
+		partial[h->mh_class] = h->mh_next;
+	if (h->mh_next)
+		h->mh_next->mh_prev = h->mh_prev;
+}
+
+static void
+partial_push(struct MHeader *h)
+{
+	h->mh_prev = 0;
+	h->mh_next = partial[h->mh_class];
+	if (h->mh_next)
+		h->mh_next->mh_prev = h;
+	partial[h->mh_class] = h;
+}
+
+// Turn a fresh page into a slab of class c.
+static struct MHeader *
+slab_new(int c)
+{
+	struct MHeader *h;
+	int i;
+
+	if (!(h = page_get()))
+		return 0;
+	h->mh_magic = MSLAB;
+	h->mh_npages = 1;
+	h->mh_class = c;
+	h->mh_nused = 0;
+	h->mh_free = 0;
+	// Chain the objects so the lowest is handed out first.
+	for (i = (PGSIZE - MHDRSIZE) / class_size[c] - 1; i >= 0; i--) {
+		*(void **) ((uint8_t *) h + MHDRSIZE + i * class_size[c]) = h->mh_free;
+		h->mh_free = (uint8_t *) h + MHDRSIZE + i * class_size[c];
+	}
+	nslabs[c]++;
+	partial_push(h);
+	return h;
+}
+
+static void *
+small_alloc(size_t n)
+{
+	struct MHeader *h;
+	void *v;
+	int c, i;
+
+	if (!size_class_built) {
+		for (i = 0, c = 0; i <= MAXSMALL / 16; i++) {
+			while (i * 16 > class_size[c])
+				c++;
+			size_class[i] = c;
+		}
+		size_class_built = 1;
+	}
+
+	c = size_class[(n + 15) / 16];
+	if (!(h = partial[c]) && !(h = slab_new(c)))
+		return 0;
+	v = h->mh_free;
+	h->mh_free = *(void **) v;
+	h->mh_nused++;
+	if (!h->mh_free)
+		partial_remove(h);
+	class_live[c]++;
+	class_allocs[c]++;
+	live_bytes += class_size[c];
+	return v;
+}
+
+static void
+small_free(struct MHeader *h, void *v)
+{
+	int c = h->mh_class;
+
+	assert(((uint8_t *) v - (uint8_t *) h - MHDRSIZE) % class_size[c] == 0);
+	if (!h->mh_free)
+		partial_push(h);
+	*(void **) v = h->mh_free;
+	h->mh_free = v;
+	class_live[c]--;
+	live_bytes -= class_size[c];
+
+	// Keep one slab per class to avoid thrashing at the boundary.
+	if (--h->mh_nused == 0 && nslabs[c] > 1) {
+		partial_remove(h);
+		h->mh_magic = 0;
+		nslabs[c]--;
+		page_put(h);
+	}
+}
+
+static void *
+large_alloc(size_t n)
+{
+	struct MHeader *h;
+	uint32_t npages;
+
+	npages = ROUNDUP(n + MHDRSIZE, PGSIZE) / PGSIZE;
+	h = npages == 1 ? page_get() : run_alloc(npages);
+	if (!h)
+		return 0;
+	if (npages > 1)
+		nmapped += npages;
+	h->mh_magic = MLARGE;
+	h->mh_npages = npages;
+	h->mh_size = n;
+	large_live++;
+	large_pages += npages;
+	large_allocs++;
+	live_bytes += n;
+	return (uint8_t *) h + MHDRSIZE;
+}
+
+static void
+large_free(struct MHeader *h, void *v)
+{
+	assert(v == (uint8_t *) h + MHDRSIZE);
+	h->mh_magic = 0;
+	large_live--;
+	large_pages -= h->mh_npages;
+	live_bytes -= h->mh_size;
+	if (h->mh_npages == 1)
+		page_put(h);
+	else {
+		run_free(h, h->mh_npages);
+		nmapped -= h->mh_npages;
+	}
+}
+
+static uint32_t
+trace_hash(void *v)
+{
+	return ((uintptr_t) v * 2654435761U) >> 20 & (NTRACE - 1);
+}
+
+static void
+trace_add(void *v, size_t n, uintptr_t site)
+{
+	uint32_t i;
+
+	if (ntraced == NTRACE - 1) {
+		nuntraced++;
+		return;
+	}
+	for (i = trace_hash(v); mtrace[i].mt_obj; i = (i + 1) % NTRACE)
+		;
+	mtrace[i].mt_obj = v;
+	mtrace[i].mt_site = site;
+	mtrace[i].mt_size = n;
+	ntraced++;
+}
+
+static void
+trace_remove(void *v)
+{
+	uint32_t i, j, home;
+
+	for (i = trace_hash(v); mtrace[i].mt_obj != v; i = (i + 1) % NTRACE)
+		if (!mtrace[i].mt_obj)
+			return;		// Allocated before tracing began
+	ntraced--;
+
+	// Shift later records of the probe sequence back into the hole.
+	for (j = (i + 1) % NTRACE; mtrace[j].mt_obj; j = (j + 1) % NTRACE) {
+		home = trace_hash(mtrace[j].mt_obj);
+		if ((j - home) % NTRACE >= (j - i) % NTRACE) {
+			mtrace[i] = mtrace[j];
+			i = j;
+		}
+	}
+	mtrace[i].mt_obj = 0;
+}
+
+void*
+malloc(size_t n)
+{
+	void *v;
+
+	if (n >= MAXMALLOC)
+		return 0;
+
+	pthread_mutex_lock(&mlock);
+	v = n <= MAXSMALL ? small_alloc(n) : large_alloc(n);
+	if (live_bytes > peak_bytes)
+		peak_bytes = live_bytes;
+	if (v && mtracing)
+		trace_add(v, n, (uintptr_t) __builtin_return_address(0));
+	pthread_mutex_unlock(&mlock);
 	return v;
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	struct MHeader *h;
 
 	if (v == 0)
 		return;
 	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
 
-	c = ROUNDDOWN(v, PGSIZE);
+	h = ROUNDDOWN(v, PGSIZE);
+	pthread_mutex_lock(&mlock);
+	if (mtrace && ntraced)
+		trace_remove(v);
+	if (h->mh_magic == MSLAB)
+		small_free(h, v);
+	else if (h->mh_magic == MLARGE)
+		large_free(h, v);
+	else
+		panic("free: %p was not allocated by malloc", v);
+	pthread_mutex_unlock(&mlock);
+}
+
+// Start or stop recording allocation sites.  Stopping forgets every
+// record; objects allocated while tracing was off are never listed.
+// Returns 0 on success, -E_NO_MEM if there is no room for the table.
+int
+malloc_trace(bool on)
+{
+	pthread_mutex_lock(&mlock);
+	if (on && !mtrace
+	    && !(mtrace = run_alloc(ROUNDUP(NTRACE * sizeof(struct MTrace),
+					    PGSIZE) / PGSIZE))) {
+		pthread_mutex_unlock(&mlock);
+		return -E_NO_MEM;
+	}
+	if (!on && mtrace) {
+		run_free(mtrace, ROUNDUP(NTRACE * sizeof(struct MTrace),
+					 PGSIZE) / PGSIZE);
+		mtrace = 0;
+		ntraced = nuntraced = 0;
+	}
+	mtracing = on;
+	pthread_mutex_unlock(&mlock);
+	return 0;
+}
+
+// List the callers of the traced objects that are still live, most
+// bytes first.  Callers beyond the first NSITES found are lumped
+// together.
+static void
+stats_sites(void)
+{
+	struct Site {
+		uintptr_t site;
+		uint32_t nobj;
+		size_t bytes;
+	} sites[NSITES + 1], t;
+	uint32_t i, j, nsites = 0;
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	memset(&sites[NSITES], 0, sizeof(sites[NSITES]));
+	for (i = 0; i < NTRACE; i++) {
+		if (!mtrace[i].mt_obj)
+			continue;
+		for (j = 0; j < nsites; j++)
+			if (sites[j].site == mtrace[i].mt_site)
+				break;
+		if (j == nsites && nsites < NSITES) {
+			sites[j].site = mtrace[i].mt_site;
+			sites[j].nobj = sites[j].bytes = 0;
+			nsites++;
+		}
+		sites[j].nobj++;
+		sites[j].bytes += mtrace[i].mt_size;
 	}
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	for (i = 0; i < nsites; i++)
+		for (j = i + 1; j < nsites; j++)
+			if (sites[j].bytes > sites[i].bytes) {
+				t = sites[i];
+				sites[i] = sites[j];
+				sites[j] = t;
+			}
+
+	cprintf("  live traced objects by caller:\n");
+	for (j = 0; j < nsites; j++)
+		cprintf("    %08x: %u bytes in %u objects\n",
+			sites[j].site, sites[j].bytes, sites[j].nobj);
+	if (sites[NSITES].nobj)
+		cprintf("    others: %u bytes in %u objects\n",
+			sites[NSITES].bytes, sites[NSITES].nobj);
+	if (nuntraced)
+		cprintf("    (table full: %u allocations not traced)\n",
+			nuntraced);
 }
 
+// Print the heap's statistics to the console.
+void
+malloc_stats(void)
+{
+	int c;
+
+	pthread_mutex_lock(&mlock);
+	cprintf("[%08x] malloc stats\n", sys_getenvid());
+	cprintf("  class  size  slabs   live  allocs\n");
+	for (c = 0; c < NCLASS; c++)
+		if (class_allocs[c])
+			cprintf("  %5d %5d %6u %6u %7u\n", c, class_size[c],
+				nslabs[c], class_live[c], class_allocs[c]);
+	cprintf("  large: %u live in %u pages, %u allocs\n",
+		large_live, large_pages, large_allocs);
+	cprintf("  live %u bytes, peak %u bytes\n", live_bytes, peak_bytes);
+	cprintf("  mapped %u pages (%u bytes, %u%% live, %u pooled)\n",
+		nmapped, nmapped * PGSIZE,
+		nmapped ? (uint32_t) (live_bytes * 100 / (nmapped * PGSIZE)) : 0,
+		npool);
+	if (mtrace)
+		stats_sites();
+	pthread_mutex_unlock(&mlock);
+}
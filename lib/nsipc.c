@@ -8,6 +8,18 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
+// The network server we talk to.  Look it up once, so that all of our
+// requests go to the same instance of the service.
+static envid_t
+ns_env(void)
+{
+	static envid_t nsenv;
+
+	if (nsenv == 0)
+		nsenv = ipc_find_service("ns");
+	return nsenv;
+}
+
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
@@ -16,17 +28,28 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 nsipc(unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
-
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(ns_env(), type, &nsipcbuf, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+// Like nsipc, for requests whose first 'reqlen' bytes of nsipcbuf fit in
+// IPC_NWORDS words and whose reply is just the result.  The request is
+// copied into the message itself instead of mapping nsipcbuf.
+static int
+nsipc_small(unsigned type, size_t reqlen)
+{
+	int nwords = ROUNDUP(reqlen, sizeof(uint32_t)) / sizeof(uint32_t);
+
+	assert(nwords > 0 && nwords <= IPC_NWORDS);
+
+	if (debug)
+		cprintf("[%08x] nsipc_small %d\n", thisenv->env_id, type);
+
+	return ipc_call(ns_env(), type, &nsipcbuf, IPC_PERM_WORDS(nwords), NULL, NULL);
 }
 
 int
@@ -50,7 +73,7 @@ nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 	nsipcbuf.bind.req_s = s;
 	memmove(&nsipcbuf.bind.req_name, name, namelen);
 	nsipcbuf.bind.req_namelen = namelen;
-	return nsipc(NSREQ_BIND);
+	return nsipc_small(NSREQ_BIND, sizeof(nsipcbuf.bind));
 }
 
 int
@@ -58,14 +81,14 @@ nsipc_shutdown(int s, int how)
 {
 	nsipcbuf.shutdown.req_s = s;
 	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	return nsipc_small(NSREQ_SHUTDOWN, sizeof(nsipcbuf.shutdown));
 }
 
 int
 nsipc_close(int s)
 {
 	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	return nsipc_small(NSREQ_CLOSE, sizeof(nsipcbuf.close));
 }
 
 int
@@ -74,7 +97,7 @@ nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 	nsipcbuf.connect.req_s = s;
 	memmove(&nsipcbuf.connect.req_name, name, namelen);
 	nsipcbuf.connect.req_namelen = namelen;
-	return nsipc(NSREQ_CONNECT);
+	return nsipc_small(NSREQ_CONNECT, sizeof(nsipcbuf.connect));
 }
 
 int
@@ -82,7 +105,7 @@ nsipc_listen(int s, int backlog)
 {
 	nsipcbuf.listen.req_s = s;
 	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	return nsipc_small(NSREQ_LISTEN, sizeof(nsipcbuf.listen));
 }
 
 int
@@ -113,11 +136,33 @@ nsipc_send(int s, const void *buf, int size, unsigned int flags)
 	return nsipc(NSREQ_SEND);
 }
 
+// Send 'size' bytes starting 'off' bytes into the 'npages' pages that
+// follow the page 'pg'.  The request goes into 'pg', which must be
+// writable, and all the pages are lent to the network server instead
+// of being copied into nsipcbuf.
+int
+nsipc_send_pages(int s, void *pg, int npages, int off, int size,
+		 unsigned int flags)
+{
+	struct Nsreq_sendpages *req = pg;
+
+	if (npages <= 0 || npages >= IPC_MAXPAGES || off < 0
+	    || size < 0 || off + size > npages * PGSIZE)
+		return -E_INVAL;
+
+	req->req_s = s;
+	req->req_off = off;
+	req->req_size = size;
+	req->req_flags = flags;
+	return ipc_call(ns_env(), NSREQ_SENDPAGES, pg,
+			PTE_P|PTE_U|IPC_PERM_PAGES(1 + npages), NULL, NULL);
+}
+
 int
 nsipc_socket(int domain, int type, int protocol)
 {
 	nsipcbuf.socket.req_domain = domain;
 	nsipcbuf.socket.req_type = type;
 	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	return nsipc_small(NSREQ_SOCKET, sizeof(nsipcbuf.socket));
 }
@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -17,21 +18,75 @@ struct Dev devpipe =
 	.dev_stat =	devpipe_stat,
 };
 
-#define PIPEBUFSIZ 32		// small to provoke races
+// A pipe's data area holds the struct Pipe page followed by the ring
+// of PIPE_MAXSIZE bytes at most.  pipe() makes pipes of PIPEBUFSIZ.
+#define PIPEBUFSIZ	(8 * PGSIZE)
+
+// How long a blocked reader or writer sleeps before rechecking whether
+// the other end is gone.  Normally the other end wakes us much sooner;
+// this only matters if it was destroyed without closing the pipe.
+#define PIPE_WAIT_MSEC	100
 
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
-	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	uint32_t p_rpos;	// read position, wraps around freely
+	uint32_t p_wpos;	// write position, wraps around freely
+	uint32_t p_rsleep;	// a reader sleeps on p_wpos
+	uint32_t p_wsleep;	// a writer sleeps on p_rpos
+	uint32_t p_size;	// bytes in the ring
+	uint32_t p_rclosed;	// the last holder of the read end closed it
+	uint32_t p_wclosed;	// the last holder of the write end closed it
 };
 
+// The ring follows the struct Pipe page.
+#define PIPEBUF(p)	((uint8_t *) (p) + PGSIZE)
+
+// Keep the compiler from moving ring copies past position updates.
+#define pipe_barrier()	asm volatile("" ::: "memory")
+
+// Sleep until the other end moves '*pos' away from 'seen'.  Raising
+// '*sleeping' first tells it to wake us; xchg orders that store before
+// the kernel rereads '*pos', so a concurrent update is never missed.
+static void
+pipe_sleep(uint32_t *sleeping, uint32_t *pos, uint32_t seen)
+{
+	xchg(sleeping, 1);
+	sys_futex_wait(pos, seen, PIPE_WAIT_MSEC);
+}
+
+// We moved '*pos': wake whoever sleeps on it.
+static void
+pipe_wake(uint32_t *sleeping, uint32_t *pos)
+{
+	if (xchg(sleeping, 0))
+		sys_futex_wake(pos, NENV);
+}
+
 int
 pipe(int pfd[2])
+{
+	return pipe_sized(pfd, PIPEBUFSIZ);
+}
+
+// Create a pipe whose ring holds 'size' bytes, rounded up to whole
+// pages.  The ring size must then be a power of two, so positions can
+// wrap around 2^32 and still index the ring with a mask.  Larger rings let producer and consumer run longer before
+// either has to block.
+// Returns 0 on success, < 0 on error.
+int
+pipe_sized(int pfd[2], size_t size)
 {
 	int r;
 	struct Fd *fd0, *fd1;
+	struct Pipe *p;
+	size_t off;
 	void *va;
 
+	static_assert(PGSIZE + PIPE_MAXSIZE <= FDDATASIZE);
+
+	size = ROUNDUP(size, PGSIZE);
+	if (size == 0 || size > PIPE_MAXSIZE || (size & (size - 1)) != 0)
+		return -E_INVAL;
+
 	// allocate the file descriptor table entries
 	if ((r = fd_alloc(&fd0)) < 0
 	    || (r = sys_page_alloc(0, fd0, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
@@ -41,12 +96,15 @@ pipe(int pfd[2])
 	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err1;
 
-	// allocate the pipe structure as first data page in both
+	// allocate the pipe structure and its ring as the data area of both
 	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err3;
+	for (off = 0; off < PGSIZE + size; off += PGSIZE)
+		if ((r = sys_page_alloc(0, va + off, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0
+		    || (r = sys_page_map(0, va + off, 0, fd2data(fd1) + off,
+					 PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err2;
+	p = (struct Pipe *) va;
+	p->p_size = size;
 
 	// set up fd structures
 	fd0->fd_dev_id = devpipe.dev_id;
@@ -62,9 +120,11 @@ pipe(int pfd[2])
 	pfd[1] = fd2num(fd1);
 	return 0;
 
-    err3:
-	sys_page_unmap(0, va);
     err2:
+	for (off = 0; off < PGSIZE + size; off += PGSIZE) {
+		sys_page_unmap(0, va + off);
+		sys_page_unmap(0, fd2data(fd1) + off);
+	}
 	sys_page_unmap(0, fd1);
     err1:
 	sys_page_unmap(0, fd0);
@@ -77,6 +137,10 @@ _pipeisclosed(struct Fd *fd, struct Pipe *p)
 {
 	int n, nn, ret;
 
+	// The other end says it is gone before it wakes us, while its
+	// mappings, which pageref counts, are still there.
+	if (fd->fd_omode == O_RDONLY ? p->p_wclosed : p->p_rclosed)
+		return 1;
 	while (1) {
 		n = thisenv->env_runs;
 		ret = pageref(fd) == pageref(p);
@@ -101,11 +165,26 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Copy 'n' bytes between 'buf' and the ring at ring offset 'pos',
+// in at most two spans around the end of the ring.
+static void
+pipe_copy(struct Pipe *p, uint32_t pos, void *buf, size_t n, bool toring)
+{
+	size_t off = pos & (p->p_size - 1), first = MIN(n, p->p_size - off);
+
+	if (toring) {
+		memcpy(PIPEBUF(p) + off, buf, first);
+		memcpy(PIPEBUF(p), (uint8_t *) buf + first, n - first);
+	} else {
+		memcpy(buf, PIPEBUF(p) + off, first);
+		memcpy((uint8_t *) buf + first, PIPEBUF(p), n - first);
+	}
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	uint8_t *buf;
-	size_t i;
+	size_t avail;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -113,34 +192,36 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 		cprintf("[%08x] devpipe_read %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
-	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
-			// pipe is empty
-			// if we got any data, return it
-			if (i > 0)
-				return i;
-			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
-		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+	if (n == 0)
+		return 0;
+	while ((avail = p->p_wpos - p->p_rpos) == 0) {
+		// pipe is empty
+		// if all the writers are gone, note eof
+		if (_pipeisclosed(fd, p))
+			return 0;
+		// sleep until a writer moves wpos
+		if (debug)
+			cprintf("devpipe_read sleep\n");
+		pipe_sleep(&p->p_rsleep, &p->p_wpos, p->p_rpos);
 	}
-	return i;
+
+	// take whatever is there, up to n bytes.
+	// wait to advance rpos until the bytes are taken!
+	n = MIN(n, avail);
+	pipe_barrier();
+	pipe_copy(p, p->p_rpos, vbuf, n, 0);
+	pipe_barrier();
+	p->p_rpos += n;
+
+	pipe_wake(&p->p_wsleep, &p->p_rpos);
+	return n;
 }
 
 static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, room;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,25 +230,32 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	for (i = 0; i < n; i += room) {
+		while ((room = p->p_size - (p->p_wpos - p->p_rpos)) == 0) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// hand over what we wrote so far, then sleep
+			// until a reader moves rpos from where it was when
+			// we found the ring full: the reader we wake may
+			// have moved it already
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_wake(&p->p_rsleep, &p->p_wpos);
+			pipe_sleep(&p->p_wsleep, &p->p_rpos, p->p_wpos - p->p_size);
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// there's room.  store as much as fits.
+		// wait to advance wpos until the bytes are stored!
+		room = MIN(room, n - i);
+		pipe_copy(p, p->p_wpos, (void *) (buf + i), room, 1);
+		pipe_barrier();
+		p->p_wpos += room;
 	}
 
+	pipe_wake(&p->p_rsleep, &p->p_wpos);
 	return i;
 }
 
@@ -185,7 +273,19 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	size_t off, size = p->p_size;
+
+	// If ours is the last reference to this end, say so, so that a
+	// peer we wake need not wait for our mappings to go (futexes are
+	// found through the mapping of p, so it has to stay for the wake).
+	if (pageref(fd) == 1)
+		xchg(fd->fd_omode == O_RDONLY ? &p->p_rclosed : &p->p_wclosed, 1);
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	// let a sleeping peer see that we are gone
+	pipe_wake(&p->p_rsleep, &p->p_wpos);
+	pipe_wake(&p->p_wsleep, &p->p_rpos);
+	for (off = PGSIZE; off < PGSIZE + size; off += PGSIZE)
+		(void) sys_page_unmap(0, (uint8_t *) p + off);
+	return sys_page_unmap(0, p);
 }
-
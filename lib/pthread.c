@@ -0,0 +1,195 @@
+// Kernel-scheduled threads sharing one address space.
+//
+// pthread_create maps a slot of the thread area (see inc/pthread.h)
+// and starts a thread in it with sys_thread_create.  The struct pthread
+// at the top of the thread's stack is also its TLS block, so thisenv
+// and pthread_self work in every thread.  A thread ends by destroying
+// its env, not with exit(), which would close the file descriptors all
+// threads share; pthread_join waits for that and reclaims the slot.
+// Threads still running when the main thread exits keep running.
+// Mutexes sleep on futexes (see sys_futex_wait) when contended.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+struct pthread {
+	struct Tls pt_tls;		// The thread's TLS block; must be first
+	envid_t pt_env;			// The thread's env
+	void *(*pt_fn)(void *);		// What it runs, and on what
+	void *pt_arg;
+	void *pt_retval;		// What it returned or passed to pthread_exit
+	uint32_t pt_slot;		// Index of its slot
+};
+
+#define SLOT(i)			(PTHREAD_BASE + (i) * PTHREAD_SLOTSIZE)
+#define SLOT_UXSTACKTOP(i)	(SLOT(i) + 2 * PGSIZE)
+#define SLOT_PFTEMP(i)		(SLOT(i) + 2 * PGSIZE)
+#define SLOT_STACK(i)		(SLOT(i) + PTHREAD_SLOTSIZE - PTHREAD_STKPAGES * PGSIZE)
+
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t slot_used[PTHREAD_MAX / 32];
+
+static int
+slot_alloc(void)
+{
+	int i;
+
+	pthread_mutex_lock(&slot_lock);
+	for (i = 0; i < PTHREAD_MAX; i++)
+		if (!(slot_used[i / 32] & (1 << (i % 32)))) {
+			slot_used[i / 32] |= 1 << (i % 32);
+			break;
+		}
+	pthread_mutex_unlock(&slot_lock);
+	return i < PTHREAD_MAX ? i : -E_NO_MEM;
+}
+
+static void
+slot_free(uint32_t i)
+{
+	uintptr_t va;
+
+	for (va = SLOT(i); va < SLOT(i) + PTHREAD_SLOTSIZE; va += PGSIZE)
+		sys_page_unmap(0, (void *) va);
+	pthread_mutex_lock(&slot_lock);
+	slot_used[i / 32] &= ~(1 << (i % 32));
+	pthread_mutex_unlock(&slot_lock);
+}
+
+// The first code a new thread runs, on its own stack.
+static void
+pthread_start(struct pthread *t)
+{
+	t->pt_env = sys_getenvid();
+	thisenv = &envs[ENVX(t->pt_env)];
+	pthread_exit(t->pt_fn(t->pt_arg));
+}
+
+// Start a thread running fn(arg), and store its handle in *thread.
+// Returns 0 on success, < 0 on error.
+int
+pthread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	struct pthread *t;
+	uintptr_t *esp, va;
+	int slot, r;
+
+	if ((slot = slot_alloc()) < 0)
+		return slot;
+	if ((r = sys_page_alloc(0, (void *) (SLOT_UXSTACKTOP(slot) - PGSIZE),
+				PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	for (va = SLOT_STACK(slot); va < SLOT(slot) + PTHREAD_SLOTSIZE; va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			goto fail;
+
+	t = (struct pthread *) (SLOT(slot) + PTHREAD_SLOTSIZE) - 1;
+	t->pt_tls.tls_self = &t->pt_tls;
+	t->pt_tls.tls_env = NULL;
+	t->pt_tls.tls_thread = t;
+	t->pt_fn = fn;
+	t->pt_arg = arg;
+	t->pt_retval = NULL;
+	t->pt_slot = slot;
+
+	// Call pthread_start(t), with nowhere to return to.
+	esp = (uintptr_t *) ROUNDDOWN((uintptr_t) t, 16);
+	*--esp = (uintptr_t) t;
+	*--esp = 0;
+	if ((r = sys_thread_create(pthread_start, esp, &t->pt_tls,
+				   (void *) SLOT_UXSTACKTOP(slot))) < 0)
+		goto fail;
+	t->pt_env = r;
+	*thread = t;
+	return 0;
+
+fail:
+	slot_free(slot);
+	return r;
+}
+
+// Wait for 'thread' to end, store what it returned in *retval if
+// retval is not null, and release its resources.
+// Returns 0 on success, -E_INVAL if 'thread' is ourselves.
+int
+pthread_join(pthread_t thread, void **retval)
+{
+	if (thread == pthread_self())
+		return -E_INVAL;
+	wait(thread->pt_env);
+	if (retval)
+		*retval = thread->pt_retval;
+	slot_free(thread->pt_slot);
+	return 0;
+}
+
+// End the calling thread, handing 'retval' to pthread_join.
+// In the main thread, this is exit().
+void
+pthread_exit(void *retval)
+{
+	struct pthread *t = tls()->tls_thread;
+
+	if (!t)
+		exit();
+	t->pt_retval = retval;
+	sys_env_destroy(0);
+	panic("pthread_exit: still running");
+}
+
+// Return the calling thread's handle, or NULL in the main thread.
+pthread_t
+pthread_self(void)
+{
+	return tls()->tls_thread;
+}
+
+// Where the calling thread maps the copy of a copy-on-write page it
+// faulted on (see pgfault in fork.c).  Threads share the address space,
+// so each has a page of its own slot; the main thread uses PFTEMP.
+void *
+pthread_pftemp(void)
+{
+	pthread_t t = pthread_self();
+
+	return t ? (void *) SLOT_PFTEMP(t->pt_slot) : (void *) PFTEMP;
+}
+
+int
+pthread_mutex_init(pthread_mutex_t *m)
+{
+	m->m_state = 0;
+	return 0;
+}
+
+int
+pthread_mutex_lock(pthread_mutex_t *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return 0;
+	// Mark the mutex contended, so its holder wakes us.
+	if (c != 2)
+		c = xchg(&m->m_state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		c = xchg(&m->m_state, 2);
+	}
+	return 0;
+}
+
+// Returns 0 if we took the mutex, -E_AGAIN if it is held.
+int
+pthread_mutex_trylock(pthread_mutex_t *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0 ? 0 : -E_AGAIN;
+}
+
+int
+pthread_mutex_unlock(pthread_mutex_t *m)
+{
+	if (xchg(&m->m_state, 0) == 2)
+		sys_futex_wake(&m->m_state, 1);
+	return 0;
+}
@@ -5,139 +5,79 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Window at which spawn maps the program file to hand it to the kernel,
+// and the largest program it can map there.
+#define SPAWNVA			((uint8_t *) 0xC0000000)
+#define SPAWN_MAXSIZE		(0xCF000000 - 0xC0000000)
+
 // Helper functions for spawn.
-static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
-static int map_segment(envid_t child, uintptr_t va, size_t memsz,
-		       int fd, size_t filesz, off_t fileoffset, int perm);
-static int copy_shared_pages(envid_t child);
+static int init_stack(const char **argv, uintptr_t *init_esp);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
 // argv: pointer to null-terminated array of pointers to strings,
 // 	 which will be passed to the child as its command-line arguments.
 // Returns child envid on success, < 0 on failure.
+//
+// The program file is not read into this environment: its first page,
+// which holds the ELF headers, is borrowed from the file server's cache
+// with file_map, and a single sys_spawn_elf builds the child from it,
+// along with the stack page init_stack prepares and our PTE_SHARE
+// pages.  The child faults its text and data in from the file server
+// as it touches them (see kern/pager.c).  Executables whose segments
+// cannot be paged that way are mapped whole and loaded at once.
 int
 spawn(const char *prog, const char **argv)
 {
-	unsigned char elf_buf[512];
-	struct Trapframe child_tf;
-	envid_t child;
-
-	int fd, i, r;
-	struct Elf *elf;
-	struct Proghdr *ph;
-	int perm;
-
-	// This code follows this procedure:
-	//
-	//   - Open the program file.
-	//
-	//   - Read the ELF header, as you have before, and sanity check its
-	//     magic number.  (Check out your load_icode!)
-	//
-	//   - Use sys_exofork() to create a new environment.
-	//
-	//   - Set child_tf to an initial struct Trapframe for the child.
-	//
-	//   - Call the init_stack() function above to set up
-	//     the initial stack page for the child environment.
-	//
-	//   - Map all of the program's segments that are of p_type
-	//     ELF_PROG_LOAD into the new environment's address space.
-	//     Use the p_flags field in the Proghdr for each segment
-	//     to determine how to map the segment:
-	//
-	//	* If the ELF flags do not include ELF_PROG_FLAG_WRITE,
-	//	  then the segment contains text and read-only data.
-	//	  Use read_map() to read the contents of this segment,
-	//	  and map the pages it returns directly into the child
-	//    so that multiple instances of the same program
-	//	  will share the same copy of the program text.
-	//    Be sure to map the program text read-only in the child.
-	//    Read_map is like read but returns a pointer to the data in
-	//    *blk rather than copying the data into another buffer.
-	//
-	//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
-	//	  then the segment contains read/write data and bss.
-	//	  As with load_icode(), such an ELF segment
-	//	  occupies p_memsz bytes in memory, but only the FIRST
-	//	  p_filesz bytes of the segment are actually loaded
-	//	  from the executable file - you must clear the rest to zero.
-	//    For each page to be mapped for a read/write segment,
-	//    allocate a page in the parent temporarily at UTEMP,
-	//    read() the appropriate portion of the file into that page
-	//	  and/or use memset() to zero non-loaded portions.
-	//    Then insert the page mapping into the child.
-	//    Look at init_stack() for inspiration.
-	//    Be sure you understand why you can't use read_map() here.
-	//
-	//     Note: None of the segment addresses or lengths above
-	//     are guaranteed to be page-aligned, so you must deal with
-	//     these non-page-aligned values appropriately.
-	//     The ELF linker does, however, guarantee that no two segments
-	//     will overlap on the same page; and it guarantees that
-	//     PGOFF(ph->p_offset) == PGOFF(ph->p_va).
-	//
-	//   - Call sys_env_set_trapframe(child, &child_tf) to set up the
-	//     correct initial eip and esp values in the child.
-	//
-	//   - Start the child process running with sys_env_set_status().
+	struct Stat st;
+	struct Fd *fdp;
+	uintptr_t esp;
+	size_t off, mapped;
+	int fd, n, r;
 
 	if ((r = open(prog, O_RDONLY)) < 0)
 		return r;
 	fd = r;
 
-	// Read elf header
-	elf = (struct Elf*) elf_buf;
-	if (readn(fd, elf_buf, sizeof(elf_buf)) != sizeof(elf_buf)
-	    || elf->e_magic != ELF_MAGIC) {
-		close(fd);
-		cprintf("elf magic %08x want %08x\n", elf->e_magic, ELF_MAGIC);
-		return -E_NOT_EXEC;
+	mapped = 0;
+	if ((r = fstat(fd, &st)) < 0 || (r = fd_lookup(fd, &fdp)) < 0)
+		goto out;
+	if (st.st_size <= 0 || st.st_size > SPAWN_MAXSIZE) {
+		r = -E_NOT_EXEC;
+		goto out;
 	}
 
-	// Create new child environment
-	if ((r = sys_exofork()) < 0)
-		return r;
-	child = r;
-
-	// Set up trap frame, including initial stack.
-	child_tf = envs[ENVX(child)].env_tf;
-	child_tf.tf_eip = elf->e_entry;
-
-	if ((r = init_stack(child, argv, &child_tf.tf_esp)) < 0)
-		return r;
-
-	// Set up program segments as defined in ELF header.
-	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
-	for (i = 0; i < elf->e_phnum; i++, ph++) {
-		if (ph->p_type != ELF_PROG_LOAD)
-			continue;
-		perm = PTE_P | PTE_U;
-		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
-			perm |= PTE_W;
-		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
-			goto error;
+	if ((r = file_map(fd, 0, SPAWNVA, 1)) < 0)
+		goto out;
+	mapped = PGSIZE;
+	if ((r = init_stack(argv, &esp)) < 0)
+		goto out;
+	r = sys_spawn_elf(SPAWNVA, MIN(st.st_size, PGSIZE), (void *) UTEMP,
+			  esp, fdp);
+
+	if (r == -E_NOT_SUPP) {
+		for (off = mapped; off < st.st_size; off += n * PGSIZE) {
+			n = MIN(IPC_MAXPAGES, ROUNDUP(st.st_size - off, PGSIZE) / PGSIZE);
+			if ((r = file_map(fd, off, SPAWNVA + off, n)) < 0)
+				goto unstack;
+			mapped = off + n * PGSIZE;
+		}
+		// The child must not inherit our descriptor for the file.
+		close(fd);
+		fd = -1;
+		r = sys_spawn_elf(SPAWNVA, st.st_size, (void *) UTEMP, esp, NULL);
 	}
-	close(fd);
-	fd = -1;
-
-	// Copy shared library state.
-	if ((r = copy_shared_pages(child)) < 0)
-		panic("copy_shared_pages: %e", r);
-
-	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
-		panic("sys_env_set_trapframe: %e", r);
-
-	if ((r = sys_env_set_status(child, ENV_RUNNABLE)) < 0)
-		panic("sys_env_set_status: %e", r);
-
-	return child;
-
-error:
-	sys_env_destroy(child);
-	close(fd);
+	if (r == -E_NOT_EXEC)
+		cprintf("spawn: %s is not a valid executable\n", prog);
+
+unstack:
+	// On success the kernel moved the stack page into the child.
+	sys_page_unmap(0, (void *) UTEMP);
+out:
+	for (off = 0; off < mapped; off += PGSIZE)
+		sys_page_unmap(0, SPAWNVA + off);
+	if (fd >= 0)
+		close(fd);
 	return r;
 }
 
@@ -173,15 +113,16 @@ spawnl(const char *prog, const char *arg0, ...)
 }
 
 
-// Set up the initial stack page for the new child process with envid 'child'
+// Set up the initial stack page for a new child process at UTEMP,
 // using the arguments array pointed to by 'argv',
 // which is a null-terminated array of pointers to null-terminated strings.
+// The page is laid out to be mapped at (USTACKTOP - PGSIZE) in the child.
 //
 // On success, returns 0 and sets *init_esp
 // to the initial stack pointer with which the child should start.
 // Returns < 0 on failure.
 static int
-init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
+init_stack(const char **argv, uintptr_t *init_esp)
 {
 	size_t string_size;
 	int argc, i, r;
@@ -196,8 +137,8 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 
 	// Determine where to place the strings and the argv array.
 	// Set up pointers into the temporary page 'UTEMP'; we'll map a page
-	// there later, then remap that page into the child environment
-	// at (USTACKTOP - PGSIZE).
+	// there later, and sys_spawn_elf moves it into the child
+	// environment at (USTACKTOP - PGSIZE).
 	// strings is the topmost thing on the stack.
 	string_store = (char*) UTEMP + PGSIZE - string_size;
 	// argv is below that.  There's one argument pointer per argument, plus
@@ -242,73 +183,5 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 	argv_store[-2] = argc;
 
 	*init_esp = UTEMP2USTACK(&argv_store[-2]);
-
-	// After completing the stack, maps it into the child's address space
-	// and unmaps it from parents
-	if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-		goto error;
-	if ((r = sys_page_unmap(0, UTEMP)) < 0)
-		goto error;
-
 	return 0;
-
-error:
-	sys_page_unmap(0, UTEMP);
-	return r;
 }
-
-static int
-map_segment(envid_t child, uintptr_t va, size_t memsz,
-	int fd, size_t filesz, off_t fileoffset, int perm)
-{
-	int i, r;
-	void *blk;
-
-
-	if ((i = PGOFF(va))) {
-		va -= i;
-		memsz += i;
-		filesz += i;
-		fileoffset -= i;
-	}
-
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
-		}
-	}
-	return 0;
-}
-
-// Copy the mappings for shared pages into the child address space.
-static int
-copy_shared_pages(envid_t child)
-{
-	uintptr_t va = 0;
-	int res;
-
-	for (; va < USTACKTOP; va += PGSIZE){
-		if ((uvpd[PDX(va)] & PTE_P) && ((uvpt[PGNUM(va)] & (PTE_P|PTE_SHARE)) == (PTE_P|PTE_SHARE))){
-			res = sys_page_map(0, (void*)va, child, (void*)va, uvpt[PGNUM(va)] & PTE_SYSCALL);
-			if (res < 0)
-				panic("copy_shared_pages: failed to map pages that should be shared from parent env to child - %e", res);
-		}
-	}
-
-	return 0;
-
-}
-
@@ -0,0 +1,170 @@
+// Moving data between file descriptors without copying it through
+// user buffers.
+//
+// splice() asks the file server to lend it block cache pages
+// (file_map) instead of reading file data into fsipcbuf, and vmsplice()
+// starts from the caller's own pages.  Pages headed for a socket are
+// lent on to the network server (nsipc_send_pages), which hands them to
+// lwIP in place.  Any other destination gets a single copy, by write().
+
+#include <inc/lib.h>
+
+// Window the pages pass through.  The first page carries the request
+// for nsipc_send_pages; the data pages follow it.
+#define SPLICEVA	((uint8_t *) 0xCFF00000)
+#define SPLICEDATA	(SPLICEVA + PGSIZE)
+#define SPLICE_NPAGES	(IPC_MAXPAGES - 1)
+
+static void
+splice_unmap(int npages)
+{
+	int i;
+
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, SPLICEDATA + i * PGSIZE);
+}
+
+// Write the 'n' bytes at 'data', which lie in the window's data pages,
+// to the open file 'out'.  Returns the number of bytes written, which
+// is only short if the destination stops taking data, or < 0.
+static ssize_t
+splice_out(struct Fd *out, const uint8_t *data, size_t n)
+{
+	int npages, off, r;
+	size_t done;
+
+	off = data - SPLICEDATA;
+	npages = ROUNDUP(off + n, PGSIZE) / PGSIZE;
+	for (done = 0; done < n; done += r) {
+		if (out->fd_dev_id == devsock.dev_id)
+			r = nsipc_send_pages(out->fd_sock.sockid, SPLICEVA, npages,
+					     off + done, n - done, 0);
+		else
+			r = write(fd2num(out), data + done, n - done);
+		if (r < 0)
+			return done > 0 ? done : r;
+		if (r == 0)
+			break;
+	}
+	return done;
+}
+
+static int
+splice_fds(int fdin, int fdout, struct Fd **in, struct Fd **out)
+{
+	int r;
+
+	if ((fdin >= 0 && (r = fd_lookup(fdin, in)) < 0)
+	    || (r = fd_lookup(fdout, out)) < 0)
+		return r;
+	if ((fdin >= 0 && ((*in)->fd_omode & O_ACCMODE) == O_WRONLY)
+	    || ((*out)->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	return sys_page_alloc(0, SPLICEVA, PTE_P|PTE_U|PTE_W);
+}
+
+// Move up to 'n' bytes from 'fdin' to 'fdout', advancing both seek
+// positions.  From a file, the data is never copied into this
+// environment: the file server's cache pages are mapped and passed on.
+// Returns the number of bytes moved, which is less than 'n' only at
+// end of input or if 'fdout' stops taking data, or < 0 on error.
+ssize_t
+splice(int fdin, int fdout, size_t n)
+{
+	struct Fd *in, *out;
+	const uint8_t *data;
+	size_t done, m;
+	int i, r, npages;
+
+	if ((r = splice_fds(fdin, fdout, &in, &out)) < 0)
+		return r;
+
+	for (done = 0; done < n; done += m) {
+		if (in->fd_dev_id == devfile.dev_id) {
+			off_t pgoff = PGOFF(in->fd_offset);
+
+			npages = MIN(SPLICE_NPAGES,
+				     ROUNDUP(pgoff + n - done, PGSIZE) / PGSIZE);
+			if ((r = file_map(fdin, in->fd_offset, SPLICEDATA, npages)) <= pgoff) {
+				splice_unmap(npages);
+				break;
+			}
+			data = SPLICEDATA + pgoff;
+			m = MIN(r - pgoff, n - done);
+		} else {
+			// Nothing to borrow: read into fresh window pages.
+			npages = MIN(SPLICE_NPAGES, ROUNDUP(n - done, PGSIZE) / PGSIZE);
+			for (i = 0, r = 0; i < npages && r >= 0; i++)
+				r = sys_page_alloc(0, SPLICEDATA + i * PGSIZE, PTE_P|PTE_U|PTE_W);
+			if (r < 0
+			    || (r = read(fdin, SPLICEDATA, MIN(n - done, npages * PGSIZE))) <= 0) {
+				splice_unmap(npages);
+				break;
+			}
+			data = SPLICEDATA;
+			m = r;
+		}
+
+		r = splice_out(out, data, m);
+		splice_unmap(npages);
+		if (r < 0)
+			break;
+		if (in->fd_dev_id == devfile.dev_id)
+			in->fd_offset += r;
+		if ((size_t) r < m) {
+			done += r;
+			break;
+		}
+	}
+
+	sys_page_unmap(0, SPLICEVA);
+	return (done > 0 || r >= 0) ? done : r;
+}
+
+// Write the 'n' bytes at 'buf' to 'fdout'.  If 'fdout' is a socket the
+// pages holding 'buf' are lent to the network server instead of being
+// copied into a request.  Returns the number of bytes written, or < 0.
+ssize_t
+vmsplice(int fdout, const void *buf, size_t n)
+{
+	struct Fd *out;
+	const uint8_t *p;
+	size_t done, m;
+	int i, r, npages, off;
+
+	if ((r = splice_fds(-1, fdout, NULL, &out)) < 0)
+		return r;
+
+	for (done = 0; done < n; done += m) {
+		p = (const uint8_t *) buf + done;
+		off = PGOFF(p);
+		m = MIN(n - done, SPLICE_NPAGES * PGSIZE - off);
+		if (out->fd_dev_id != devsock.dev_id) {
+			if ((r = write(fdout, p, m)) <= 0)
+				break;
+			m = r;
+			continue;
+		}
+
+		npages = ROUNDUP(off + m, PGSIZE) / PGSIZE;
+		p -= off;
+		for (i = 0, r = 0; i < npages && r >= 0; i++) {
+			// Fault the page in, then lend it without write access.
+			(void) *(volatile const uint8_t *) (p + i * PGSIZE);
+			r = sys_page_map(0, (void *) (p + i * PGSIZE),
+					 0, SPLICEDATA + i * PGSIZE, PTE_P|PTE_U);
+		}
+		if (r >= 0)
+			r = splice_out(out, SPLICEDATA + off, m);
+		splice_unmap(npages);
+		if (r <= 0)
+			break;
+		if ((size_t) r < m) {
+			done += r;
+			break;
+		}
+	}
+
+	sys_page_unmap(0, SPLICEVA);
+	return (done > 0 || r >= 0) ? done : r;
+}
@@ -105,6 +105,18 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_tls(envid_t envid, void *tls)
+{
+	return syscall(SYS_env_set_tls, 1, envid, (uint32_t) tls, 0, 0, 0);
+}
+
+envid_t
+sys_thread_create(void *eip, void *esp, void *tls, void *uxstacktop)
+{
+	return syscall(SYS_thread_create, 0, (uint32_t) eip, (uint32_t) esp, (uint32_t) tls, (uint32_t) uxstacktop, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
@@ -117,6 +129,103 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_pages(void *dstva, int npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, 0, 0, 0);
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, unsigned int timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_svc_register(const char *name)
+{
+	return syscall(SYS_svc_register, 0, (uint32_t) name, strlen(name), 0, 0, 0);
+}
+
+int
+sys_svc_unregister(const char *name)
+{
+	return syscall(SYS_svc_unregister, 0, (uint32_t) name, strlen(name), 0, 0, 0);
+}
+
+envid_t
+sys_svc_lookup(const char *name)
+{
+	return syscall(SYS_svc_lookup, 0, (uint32_t) name, strlen(name), 0, 0, 0);
+}
+
+envid_t
+sys_spawn_elf(const void *binary, size_t size, void *stackva, uintptr_t esp,
+	      struct Fd *fd)
+{
+	return syscall(SYS_spawn_elf, 0, (uint32_t) binary, size, (uint32_t) stackva, esp, (uint32_t) fd);
+}
+
+int
+sys_pager_supply(envid_t envid, void *va, void *srcva, int perm)
+{
+	return syscall(SYS_pager_supply, 1, envid, (uint32_t) va, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ide_bmbase(void)
+{
+	return syscall(SYS_ide_bmbase, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(int irq)
+{
+	return syscall(SYS_irq_wait, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_dma_paddr(void *va)
+{
+	return syscall(SYS_dma_paddr, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_dma_alloc(void *va, size_t npages)
+{
+	return syscall(SYS_dma_alloc, 0, (uint32_t) va, npages, 0, 0, 0);
+}
+
+int
+sys_virtio_blk_info(uint32_t *port, uint32_t *irq)
+{
+	return syscall(SYS_virtio_blk_info, 0, (uint32_t) port, (uint32_t) irq, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
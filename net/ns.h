@@ -8,8 +8,10 @@
 #define TIMER_INTERVAL 250
 
 // Virtual address at which to receive page mappings containing client requests.
+// Each request gets a slot with room for a page vector (NSREQ_SENDPAGES).
 #define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define REQSLOT		(IPC_MAXPAGES * PGSIZE)
+#define REQVA		(0x0ffff000 - QUEUE_SIZE * REQSLOT)
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
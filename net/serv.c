@@ -64,7 +64,7 @@ get_buffer(void) {
 		return 0;
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
+	va = (void *)(REQVA + i * REQSLOT);
 	buse[i] = 1;
 
 	return va;
@@ -72,7 +72,7 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	int i = ((uint32_t)va - REQVA) / REQSLOT;
 	buse[i] = 0;
 }
 
@@ -181,13 +181,16 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	void *va;			// Argument page, or NULL for a small request
+	int npages;			// Pages received at va
+	uint32_t words[IPC_NWORDS];	// Small request sent as IPC words
 };
 
 static void
 serve_thread(uint32_t a) {
 	struct st_args *args = (struct st_args *)a;
 	union Nsipc *req = args->req;
-	int r;
+	int i, r;
 
 	switch (args->reqno) {
 	case NSREQ_ACCEPT:
@@ -226,6 +229,17 @@ serve_thread(uint32_t a) {
 		r = lwip_send(req->send.req_s, &req->send.req_buf,
 			      req->send.req_size, req->send.req_flags);
 		break;
+	case NSREQ_SENDPAGES:
+		if (req->sendpages.req_off < 0 || req->sendpages.req_size < 0
+		    || req->sendpages.req_off + req->sendpages.req_size
+		       > (args->npages - 1) * PGSIZE)
+			r = -E_INVAL;
+		else
+			r = lwip_send(req->sendpages.req_s,
+				      (char *) req + PGSIZE + req->sendpages.req_off,
+				      req->sendpages.req_size,
+				      req->sendpages.req_flags);
+		break;
 	case NSREQ_SOCKET:
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
@@ -249,8 +263,11 @@ serve_thread(uint32_t a) {
 	if (args->reqno != NSREQ_INPUT)
 		ipc_send(args->whom, r, 0, 0);
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	if (args->va) {
+		for (i = 0; i < args->npages; i++)
+			sys_page_unmap(0, args->va + i * PGSIZE);
+		put_buffer(args->va);
+	}
 	free(args);
 }
 
@@ -258,7 +275,7 @@ void
 serve(void) {
 	int32_t reqno;
 	uint32_t whom;
-	int i, perm;
+	int i, npages;
 	void *va;
 
 	while (1) {
@@ -268,9 +285,8 @@ serve(void) {
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
-		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		reqno = ipc_recv_pages((int32_t *) &whom, va, IPC_MAXPAGES, &npages);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -282,12 +298,6 @@ serve(void) {
 			continue;
 		}
 
-		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n", whom);
-			continue; // just leave it hanging...
-		}
-
 		// Since some lwIP socket calls will block, create a thread and
 		// process the rest of the request in the thread.
 		struct st_args *args = malloc(sizeof(struct st_args));
@@ -296,7 +306,23 @@ serve(void) {
 
 		args->reqno = reqno;
 		args->whom = whom;
-		args->req = va;
+
+		// All remaining requests must contain an argument page,
+		// or be small enough to come as words (see nsipc_small)
+		if (ipc_get_words(args->words) > 0) {
+			put_buffer(va);
+			args->va = NULL;
+			args->req = (union Nsipc *) args->words;
+		} else if (npages > 0) {
+			args->va = va;
+			args->npages = npages;
+			args->req = va;
+		} else {
+			cprintf("Invalid request from %08x: no argument page\n", whom);
+			put_buffer(va);
+			free(args);
+			continue; // just leave it hanging...
+		}
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -9,12 +9,14 @@
 #define E_BAD_REQ	1000
 
 #define BUFFSIZE 512
+#define SENDBUFSIZE 8192
 #define MAXPENDING 5	// Max connection requests
 
 struct http_request {
 	int sock;
 	char *url;
 	char *version;
+	struct Arena *arena;	// Everything allocated for the request
 };
 
 struct responce_header {
@@ -45,13 +47,6 @@ die(char *m)
 	exit();
 }
 
-static void
-req_free(struct http_request *req)
-{
-	free(req->url);
-	free(req->version);
-}
-
 static int
 send_header(struct http_request *req, int code)
 {
@@ -76,29 +71,20 @@ send_header(struct http_request *req, int code)
 static int
 send_data(struct http_request *req, int fd)
 {
-	
-	struct Stat fileStatistics;
-	fstat(fd, &fileStatistics);
+	char *packet;
+	int n;
 
-	void *packet = malloc(fileStatistics.st_size);
+	packet = arena_alloc(req->arena, SENDBUFSIZE);
 	if (!packet)
-		die("send_data: malloc failed");
-	
+		die("send_data: arena_alloc failed");
 
-	if (readn(fd, packet, fileStatistics.st_size) != fileStatistics.st_size) {
-		free(packet);
+	while ((n = read(fd, packet, SENDBUFSIZE)) > 0)
+		if (write(req->sock, packet, n) != n)
+			die("send_data: write failed");
+	if (n < 0)
 		die("send_data: read failed");
-	}
-
-  	if (write(req->sock, packet, fileStatistics.st_size) != fileStatistics.st_size) {
-		free(packet);
-		die("send_data: write failed");
-	}
-
-	free(packet);
 
 	return 0;
-
 }
 
 static int
@@ -179,7 +165,9 @@ http_request_parse(struct http_request *req, char *request)
 		request++;
 	url_len = request - url;
 
-	req->url = malloc(url_len + 1);
+	req->url = arena_alloc(req->arena, url_len + 1);
+	if (!req->url)
+		return -E_NO_MEM;
 	memmove(req->url, url, url_len);
 	req->url[url_len] = '\0';
 
@@ -191,7 +179,9 @@ http_request_parse(struct http_request *req, char *request)
 		request++;
 	version_len = request - version;
 
-	req->version = malloc(version_len + 1);
+	req->version = arena_alloc(req->arena, version_len + 1);
+	if (!req->version)
+		return -E_NO_MEM;
 	memmove(req->version, version, version_len);
 	req->version[version_len] = '\0';
 
@@ -277,7 +267,7 @@ end:
 }
 
 static void
-handle_client(int sock)
+handle_client(int sock, struct Arena *arena)
 {
 	struct http_request con_d;
 	int r;
@@ -294,6 +284,7 @@ handle_client(int sock)
 		memset(req, 0, sizeof(req));
 
 		req->sock = sock;
+		req->arena = arena;
 
 		r = http_request_parse(req, buffer);
 		if (r == -E_BAD_REQ)
@@ -303,7 +294,7 @@ handle_client(int sock)
 		else
 			send_file(req);
 
-		req_free(req);
+		arena_reset(arena);
 
 		// no keep alive
 		break;
@@ -317,9 +308,13 @@ umain(int argc, char **argv)
 {
 	int serversock, clientsock;
 	struct sockaddr_in server, client;
+	struct Arena *arena;
 
 	binaryname = "jhttpd";
 
+	if (!(arena = arena_create()))
+		die("Failed to create request arena");
+
 	// Create the TCP socket
 	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
 		die("Failed to create socket");
@@ -349,7 +344,7 @@ umain(int argc, char **argv)
 		if ((clientsock = accept(serversock,(struct sockaddr *) &client,&clientlen)) < 0){
 			die("Failed to accept client connection");
 		}
-		handle_client(clientsock);
+		handle_client(clientsock, arena);
 	}
 
 	close(serversock);
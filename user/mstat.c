@@ -0,0 +1,41 @@
+// Ask a running program for its heap statistics, which it prints to the
+// console (see malloc_stats).  -t starts tracing allocation sites in it
+// first, and -T stops.
+
+#include <inc/lib.h>
+
+void
+usage(void)
+{
+	printf("usage: mstat [-tT] envid\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, trace = 0;
+	envid_t envid;
+	struct Argstate args;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 't':
+			trace = MALLOC_IPC_TRACE_ON;
+			break;
+		case 'T':
+			trace = MALLOC_IPC_TRACE_OFF;
+			break;
+		default:
+			usage();
+		}
+	if (argc != 2)
+		usage();
+
+	envid = strtol(argv[1], 0, 16);
+	if (trace)
+		ipc_send(envid, trace, 0, 0);
+	else
+		ipc_send(envid, MALLOC_IPC_STATS, 0, 0);
+}
@@ -0,0 +1,47 @@
+// Test arenas: allocations are aligned and do not overlap, even across
+// chunks, objects bigger than a chunk work, and after arena_reset the
+// same memory is handed out again.
+
+#include <inc/lib.h>
+
+#define NOBJ	500
+
+static char *objs[NOBJ];
+
+void
+umain(int argc, char **argv)
+{
+	struct Arena *a;
+	char *first = 0, *big;
+	int round, i, j;
+
+	if (!(a = arena_create()))
+		panic("arena_create failed");
+
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < NOBJ; i++) {
+			if (!(objs[i] = arena_alloc(a, 1 + i % 100)))
+				panic("arena_alloc %d failed", 1 + i % 100);
+			if ((uintptr_t) objs[i] % 8)
+				panic("arena_alloc returned unaligned %p", objs[i]);
+			memset(objs[i], i, 1 + i % 100);
+		}
+		if (!(big = arena_alloc(a, 10 * PGSIZE)))
+			panic("big arena_alloc failed");
+		memset(big, 0xff, 10 * PGSIZE);
+
+		for (i = 0; i < NOBJ; i++)
+			for (j = 0; j < 1 + i % 100; j++)
+				if (objs[i][j] != (char) i)
+					panic("object %d was overwritten", i);
+
+		if (round == 0)
+			first = objs[0];
+		else if (objs[0] != first)
+			panic("arena_reset did not rewind: %p, not %p",
+			      objs[0], first);
+		arena_reset(a);
+	}
+	arena_destroy(a);
+	cprintf("arena ok\n");
+}
@@ -0,0 +1,64 @@
+// Stream records from a child to its parent through a channel and check
+// that they arrive complete and in order.
+
+#include <inc/lib.h>
+
+#define CHANVA		((void *) 0xa00000)
+#define NRECS		256
+#define TOTAL		100000
+#define BATCH		32
+
+void
+umain(int argc, char **argv)
+{
+	struct Chan ch;
+	uint32_t buf[BATCH], next, i;
+	unsigned start, elapsed;
+	envid_t child;
+	int n, r;
+
+	if ((r = chan_create(&ch, CHANVA, sizeof(uint32_t), NRECS, 0)) < 0)
+		panic("chan_create: %e", r);
+	if (chan_recv(&ch, buf, BATCH) != 0)
+		panic("empty channel returned records");
+	for (i = 0; i < NRECS + 1; i++)
+		if (chan_send(&ch, &i, 1) != (i < NRECS))
+			panic("non-blocking channel accepted record %d", i);
+	if (chan_send_wait(&ch, &i, 1) != -E_INVAL)
+		panic("chan_send_wait on a non-blocking channel");
+	chan_destroy(&ch);
+
+	if ((r = chan_create(&ch, CHANVA, sizeof(uint32_t), NRECS, CHAN_BLOCK)) < 0)
+		panic("chan_create: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = chan_attach(&ch, CHANVA)) < 0)
+			panic("chan_attach: %e", r);
+		for (next = 0; next < TOTAL; ) {
+			for (i = 0; i < BATCH && next < TOTAL; i++)
+				buf[i] = next++;
+			if ((r = chan_send_wait(&ch, buf, i)) < 0)
+				panic("chan_send_wait: %e", r);
+		}
+		chan_close(&ch);
+		return;
+	}
+
+	start = sys_time_msec();
+	next = 0;
+	while ((n = chan_recv_wait(&ch, buf, BATCH)) > 0)
+		for (i = 0; i < n; i++, next++)
+			if (buf[i] != next)
+				panic("got record %d, expected %d", buf[i], next);
+	if (n < 0)
+		panic("chan_recv_wait: %e", n);
+	if (next != TOTAL)
+		panic("channel closed after %d records", next);
+	elapsed = sys_time_msec() - start;
+	cprintf("%d records in %d msec\n", TOTAL, elapsed);
+	wait(child);
+	chan_destroy(&ch);
+	cprintf("channel OK\n");
+}
@@ -3,6 +3,7 @@
 const char *msg = "This is the NEW message of the day!\n\n";
 
 #define FVA ((struct Fd*)0xCCCCC000)
+#define HUGEOFF	(6 * 1024 * 1024)
 
 static int
 xopen(const char *path, int mode)
@@ -124,5 +125,28 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
+
+	// A block past 4MB is reached through the double-indirect block.
+	// The disk is smaller than that, so the file is sparse.
+	if ((f = open("/huge", O_RDWR|O_CREAT)) < 0)
+		panic("creat /huge: %e", f);
+	*(int*)buf = 0x4A05;
+	seek(f, HUGEOFF);
+	if ((r = write(f, buf, sizeof(buf))) != sizeof(buf))
+		panic("write /huge: %e", r);
+	memset(buf, 0, sizeof(buf));
+	seek(f, HUGEOFF);
+	if ((r = readn(f, buf, sizeof(buf))) != sizeof(buf))
+		panic("read /huge: %e", r);
+	if (*(int*)buf != 0x4A05)
+		panic("read /huge returned bad data %d", *(int*)buf);
+	if ((r = fstat(f, &st)) < 0)
+		panic("fstat /huge: %e", r);
+	if (st.st_size != HUGEOFF + sizeof(buf))
+		panic("/huge has size %d", st.st_size);
+	if ((r = ftruncate(f, 0)) < 0)
+		panic("ftruncate /huge: %e", r);
+	close(f);
+	cprintf("huge file is good\n");
 }
 
@@ -0,0 +1,53 @@
+// Test sys_futex_wait/sys_futex_wake between two envs that share a page
+// at different addresses.
+
+#include <inc/lib.h>
+
+#define SHARED		((volatile uint32_t *) 0xa00000)
+#define SHARED_CHILD	((volatile uint32_t *) 0xb00000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	unsigned start;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	// Value mismatch and timeout.
+	if ((r = sys_futex_wait(SHARED, 1, 0)) != -E_AGAIN)
+		panic("futex_wait on a changed value returned %e", r);
+	start = sys_time_msec();
+	if ((r = sys_futex_wait(SHARED, 0, 50)) != -E_TIMEOUT)
+		panic("futex_wait with a timeout returned %e", r);
+	if (sys_time_msec() - start < 50)
+		panic("futex_wait timed out early");
+
+	if ((child = fork()) == 0) {
+		if ((r = sys_page_map(0, (void *) SHARED, 0, (void *) SHARED_CHILD,
+				      PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			panic("sys_page_map: %e", r);
+		while (*SHARED_CHILD == 0)
+			sys_futex_wait(SHARED_CHILD, 0, 0);
+		cprintf("child woke with %d\n", *SHARED_CHILD);
+		*SHARED_CHILD = 2;
+		sys_futex_wake(SHARED_CHILD, 1);
+		return;
+	}
+
+	// Wait until the child sleeps, then wake it through our mapping.
+	while (envs[ENVX(child)].env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+	*SHARED = 1;
+	if ((r = sys_futex_wake(SHARED, 1)) != 1)
+		panic("futex_wake woke %d envs", r);
+
+	while (*SHARED != 2)
+		sys_futex_wait(SHARED, 1, 0);
+
+	// wait() sleeps on the child's env_status until it is freed.
+	wait(child);
+	cprintf("testfutex OK\n");
+}
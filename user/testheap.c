@@ -0,0 +1,83 @@
+// Test malloc: a freed object is handed out again while the rest of its
+// page is in use, objects of mixed sizes never overlap, and churn
+// through large objects does not use up the heap.  Then trace some
+// allocations and have a child ask for malloc_stats by IPC.
+
+#include <inc/lib.h>
+
+#define NOBJ	200
+#define SIZE(i, pass)	(1 + ((i) * 37 + (pass) * 101) % 3000)
+
+static void *objs[NOBJ];
+
+void
+umain(int argc, char **argv)
+{
+	void *a, *b, *keep;
+	uint8_t *big;
+	int i, j, r;
+	envid_t child;
+
+	// Freed memory on a page that is still in use comes right back.
+	keep = malloc(40);
+	a = malloc(40);
+	free(a);
+	if ((b = malloc(33)) != a)
+		panic("malloc did not reuse %p, got %p", a, b);
+	free(b);
+	free(keep);
+
+	// Mixed sizes: fill, free every other one, refill those with new
+	// sizes, and check that no two objects overlap.
+	for (i = 0; i < NOBJ; i++)
+		if (!(objs[i] = malloc(SIZE(i, 0))))
+			panic("malloc %d failed", SIZE(i, 0));
+	for (i = 0; i < NOBJ; i += 2)
+		free(objs[i]);
+	for (i = 0; i < NOBJ; i += 2)
+		if (!(objs[i] = malloc(SIZE(i, 1))))
+			panic("malloc %d failed", SIZE(i, 1));
+	for (i = 0; i < NOBJ; i++)
+		memset(objs[i], i, SIZE(i, i % 2 == 0));
+	for (i = 0; i < NOBJ; i++)
+		for (j = 0; j < SIZE(i, i % 2 == 0); j++)
+			if (((uint8_t *) objs[i])[j] != (uint8_t) i)
+				panic("object %d was overwritten", i);
+	for (i = 0; i < NOBJ; i++)
+		free(objs[i]);
+	cprintf("malloc reuse ok\n");
+
+	// Large runs are unmapped when freed, so this cannot run out of
+	// address space.
+	for (i = 0; i < 300; i++) {
+		if (!(big = malloc(512 * 1024)))
+			panic("large malloc %d failed", i);
+		big[512 * 1024 - 1] = 1;
+		free(big);
+	}
+	if ((uvpd[PDX(big)] & PTE_P) && (uvpt[PGNUM(big)] & PTE_P))
+		panic("freed run at %p is still mapped", big);
+	cprintf("malloc large ok\n");
+
+	// Churn through the trace table, leaving 20 objects live.
+	if (malloc_trace(1) < 0)
+		panic("malloc_trace failed");
+	for (i = 0; i < NOBJ; i++)
+		objs[i] = malloc(SIZE(i, 0));
+	for (i = 20; i < NOBJ; i++)
+		free(objs[i]);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		ipc_send(thisenv->env_parent_id, MALLOC_IPC_STATS, 0, 0);
+		ipc_send(thisenv->env_parent_id, 42, 0, 0);
+		exit();
+	}
+	// The statistics request is answered inside ipc_recv.
+	if ((r = ipc_recv(0, 0, 0)) != 42)
+		panic("ipc_recv got %08x, not 42", r);
+	for (i = 0; i < 20; i++)
+		free(objs[i]);
+	malloc_trace(0);
+	cprintf("malloc stats ok\n");
+}
@@ -0,0 +1,65 @@
+// Test ipc_call/ipc_reply_wait: the child runs a tiny RPC server that
+// doubles its argument and the parent calls it in a loop.  Odd calls
+// pass the argument as two IPC words instead, which the server adds.
+
+#include <inc/lib.h>
+
+#define NCALLS		1000
+#define TEMP_ADDR	((char*)0xa00000)
+
+static void
+server(void)
+{
+	envid_t whom = 0;
+	int32_t req, r = 0;
+	uint32_t words[IPC_NWORDS];
+
+	while (1) {
+		req = ipc_reply_wait(whom, r, 0, 0, &whom, 0, 0);
+		if (req < 0)
+			panic("ipc_reply_wait: %e", req);
+		if (ipc_get_words(words) == 2)
+			r = words[0] + words[1];
+		else
+			r = 2 * req;
+		if (req == NCALLS - 1)
+			break;
+	}
+	// Final answer goes back with a page.
+	sys_page_alloc(0, TEMP_ADDR, PTE_P|PTE_U|PTE_W);
+	strcpy(TEMP_ADDR, "server done");
+	ipc_send(whom, r, TEMP_ADDR, PTE_P|PTE_U|PTE_W);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	unsigned start;
+	int32_t i, r;
+	int perm;
+	uint32_t words[2];
+
+	if ((who = fork()) == 0) {
+		server();
+		return;
+	}
+
+	start = sys_time_msec();
+	for (i = 0; i < NCALLS - 1; i++) {
+		if (i % 2) {
+			words[0] = words[1] = i;
+			r = ipc_call(who, i, words, IPC_PERM_WORDS(2), 0, 0);
+		} else
+			r = ipc_call(who, i, 0, 0, 0, 0);
+		if (r != 2 * i)
+			panic("call %d returned %d", i, r);
+	}
+
+	r = ipc_call(who, i, 0, 0, TEMP_ADDR, &perm);
+	if (r != 2 * i || !perm || strcmp(TEMP_ADDR, "server done") != 0)
+		panic("last call returned %d perm %x", r, perm);
+
+	cprintf("%d calls in %d msec\n", NCALLS, sys_time_msec() - start);
+	cprintf("testipccall OK\n");
+}
@@ -0,0 +1,50 @@
+// Test page-vector IPC: send many pages in one message and check that
+// the receiver gets them in order, and no more than it asked for.
+
+#include <inc/lib.h>
+
+#define SRC_ADDR	((char*)0xa00000)
+#define DST_ADDR	((char*)0xc00000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i, n, r;
+
+	if ((who = fork()) == 0) {
+		// Full window: all IPC_MAXPAGES pages arrive.
+		r = ipc_recv_pages(&who, DST_ADDR, IPC_MAXPAGES, &n);
+		if (r != 1 || n != IPC_MAXPAGES)
+			panic("first message: value %d, %d pages", r, n);
+		for (i = 0; i < n; i++)
+			if (*(int*)(DST_ADDR + i * PGSIZE) != i)
+				panic("page %d holds %d", i, *(int*)(DST_ADDR + i * PGSIZE));
+
+		// Smaller window: the rest of the vector is dropped.
+		r = ipc_recv_pages(&who, DST_ADDR, 4, &n);
+		if (r != 2 || n != 4)
+			panic("second message: value %d, %d pages", r, n);
+
+		// The pages are shared, so the parent sees our mark.
+		*(int*)DST_ADDR = -1;
+		ipc_send(who, 0, 0, 0);
+		return;
+	}
+
+	for (i = 0; i < IPC_MAXPAGES; i++) {
+		if ((r = sys_page_alloc(0, SRC_ADDR + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		*(int*)(SRC_ADDR + i * PGSIZE) = i;
+	}
+
+	if ((r = sys_ipc_try_send(who, 0, SRC_ADDR, PTE_P|PTE_U|IPC_PERM_PAGES(IPC_MAXPAGES + 1))) != -E_INVAL)
+		panic("oversized page vector: %e", r);
+
+	ipc_send(who, 1, SRC_ADDR, PTE_P|PTE_U|PTE_W|IPC_PERM_PAGES(IPC_MAXPAGES));
+	ipc_send(who, 2, SRC_ADDR, PTE_P|PTE_U|PTE_W|IPC_PERM_PAGES(8));
+	ipc_recv(0, 0, 0);
+	if (*(int*)SRC_ADDR != -1)
+		panic("child's write did not show through");
+	cprintf("testipcpages OK\n");
+}
@@ -0,0 +1,68 @@
+// Test demand-paged spawn: a child spawned from the file system finds
+// its data and bss missing until it touches them, then finds them
+// right, for itself, for system calls on its behalf, and for a forked
+// child of its own.
+
+#include <inc/lib.h>
+
+#define NDATA	(8 * PGSIZE / sizeof(uint32_t))
+#define MSG	"testlazy: message from a lazy page\n"
+
+static uint32_t data[NDATA] = { [0] = 1, [NDATA / 2] = 2, [NDATA - 1] = 3 };
+static char bss[8 * PGSIZE];
+static char msg[2 * PGSIZE] = MSG;
+
+static bool
+mapped(const void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+static void
+child(void)
+{
+	envid_t env;
+
+	if (!mapped((void *) ENV_EXECFD))
+		panic("executable's Fd page is not mapped");
+	if (mapped(&data[NDATA / 2]) || mapped(&bss[4 * PGSIZE]))
+		panic("untouched pages are already mapped");
+
+	if (data[NDATA / 2] != 2)
+		panic("paged-in data is %d, not 2", data[NDATA / 2]);
+	data[NDATA / 2] = 4;
+	if (bss[4 * PGSIZE] != 0)
+		panic("paged-in bss is not zero");
+	bss[4 * PGSIZE] = 1;
+	if (!mapped(&data[NDATA / 2]) || !mapped(&bss[4 * PGSIZE]))
+		panic("touched pages are not mapped");
+
+	// The kernel pages msg in for the system call.
+	sys_cputs(msg, sizeof(MSG) - 1);
+
+	if ((env = fork()) < 0)
+		panic("fork: %e", env);
+	if (env == 0) {
+		if (data[NDATA - 1] != 3 || data[NDATA / 2] != 4)
+			panic("forked child sees wrong data");
+		exit();
+	}
+	wait(env);
+	cprintf("testlazy: child OK\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t env;
+
+	if (argc > 1 && strcmp(argv[1], "child") == 0) {
+		child();
+		return;
+	}
+
+	if ((env = spawnl("/testlazy", "testlazy", "child", 0)) < 0)
+		panic("spawn /testlazy: %e", env);
+	wait(env);
+	cprintf("testlazy OK\n");
+}
@@ -0,0 +1,64 @@
+// Test kernel-buffered IPC: sends to an env that is not receiving are
+// queued, in order, and senders sleep once the queue is full.
+
+#include <inc/lib.h>
+
+#define NMSG		(3 * IPC_QUEUE_LEN)
+#define TEMP_ADDR	((char*)0xa00000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, from;
+	int i, r, perm;
+	uint32_t v;
+
+	if ((who = fork()) == 0) {
+		// Wait until our queue is full and the parent sleeps in
+		// ipc_send before receiving anything.
+		from = thisenv->env_parent_id;
+		while (thisenv->env_ipc_qcount < IPC_QUEUE_LEN
+		       || envs[ENVX(from)].env_ipc_sendto == NULL)
+			sys_yield();
+
+		for (i = 0; i < NMSG; i++) {
+			v = ipc_recv(&from, TEMP_ADDR, &perm);
+			if (v != i)
+				panic("got message %d, expected %d", v, i);
+			if (i >= IPC_QUEUE_LEN && i % 2 == 0) {
+				if (!perm)
+					panic("message %d lost its page", i);
+				if (*(int*)TEMP_ADDR != i)
+					panic("message %d page holds %d", i, *(int*)TEMP_ADDR);
+			} else if (perm)
+				panic("message %d carried an unexpected page", i);
+		}
+		cprintf("child received %d messages in order\n", NMSG);
+		ipc_send(from, 0, 0, 0);
+		return;
+	}
+
+	// Fill the child's queue without blocking.
+	for (i = 0; i < IPC_QUEUE_LEN; i++)
+		if ((r = sys_ipc_try_send(who, i, (void*) UTOP + 1, 0)) < 0)
+			panic("try_send %d: %e", i, r);
+	if ((r = sys_ipc_try_send(who, i, (void*) UTOP + 1, 0)) != -E_IPC_NOT_RECV)
+		panic("try_send to a full queue returned %e", r);
+
+	// The rest block until the child makes room.  Every other message
+	// carries a page, which we unmap right away: the kernel's reference
+	// must keep it alive until it is delivered.
+	for (i = IPC_QUEUE_LEN; i < NMSG; i++) {
+		if (i % 2 == 0) {
+			if ((r = sys_page_alloc(0, TEMP_ADDR, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+			*(int*)TEMP_ADDR = i;
+			ipc_send(who, i, TEMP_ADDR, PTE_P|PTE_U|PTE_W);
+			sys_page_unmap(0, TEMP_ADDR);
+		} else
+			ipc_send(who, i, 0, 0);
+	}
+
+	ipc_recv(0, 0, 0);
+	cprintf("testmailbox OK\n");
+}
@@ -0,0 +1,53 @@
+// Stream a megabyte through a large pipe and check that it arrives
+// intact, with writes and reads of sizes that straddle the ring's end.
+
+#include <inc/lib.h>
+
+#define TOTAL	(1024 * 1024)
+
+char buf[8192 + 13];
+
+void
+umain(int argc, char **argv)
+{
+	int p[2], r, n;
+	unsigned i, got, start;
+	envid_t child;
+
+	if ((r = pipe_sized(p, PIPE_MAXSIZE + 1)) != -E_INVAL)
+		panic("oversized pipe returned %e", r);
+	if ((r = pipe_sized(p, 3 * PGSIZE)) != -E_INVAL)
+		panic("three-page pipe returned %e", r);
+	if ((r = pipe_sized(p, PIPE_MAXSIZE)) < 0)
+		panic("pipe_sized: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(p[0]);
+		for (i = 0; i < TOTAL; i += n) {
+			n = MIN(sizeof(buf), TOTAL - i);
+			for (r = 0; r < n; r++)
+				buf[r] = (i + r) % 251;
+			if ((r = write(p[1], buf, n)) != n)
+				panic("write: %e", r);
+		}
+		close(p[1]);
+		return;
+	}
+
+	close(p[1]);
+	start = sys_time_msec();
+	for (got = 0; (n = read(p[0], buf, sizeof(buf) - 26)) > 0; got += n)
+		for (r = 0; r < n; r++)
+			if ((uint8_t) buf[r] != (got + r) % 251)
+				panic("byte %d is %d", got + r, (uint8_t) buf[r]);
+	if (n < 0)
+		panic("read: %e", n);
+	if (got != TOTAL)
+		panic("got %d bytes, expected %d", got, TOTAL);
+	cprintf("%d bytes in %d msec\n", TOTAL, sys_time_msec() - start);
+	close(p[0]);
+	wait(child);
+	cprintf("pipe size OK\n");
+}
@@ -0,0 +1,81 @@
+// Test threads: several threads bump a shared counter under a mutex,
+// each sees its own thisenv, and join hands back their results.  A
+// thread spinning on a page must see the main thread remap it, even
+// from another CPU.
+
+#include <inc/lib.h>
+
+#define NTHREAD	4
+#define NITER	1000
+#define REMAPVA	((volatile uint32_t *) 0x0f000000)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t counter;
+
+static void *
+bump(void *arg)
+{
+	int i;
+
+	if (thisenv->env_id != sys_getenvid())
+		panic("thread's thisenv is %08x, not %08x",
+		      thisenv->env_id, sys_getenvid());
+	for (i = 0; i < NITER; i++) {
+		pthread_mutex_lock(&lock);
+		counter++;
+		if (i % 100 == 0)
+			sys_yield();
+		pthread_mutex_unlock(&lock);
+	}
+	return arg;
+}
+
+static void *
+watch(void *arg)
+{
+	unsigned start = sys_time_msec();
+
+	while (*REMAPVA != 2)
+		if (sys_time_msec() - start > 5000)
+			return (void *) -1;
+	return NULL;
+}
+
+void
+umain(int argc, char **argv)
+{
+	pthread_t t[NTHREAD];
+	void *ret;
+	int i, r;
+
+	for (i = 0; i < NTHREAD; i++)
+		if ((r = pthread_create(&t[i], bump, (void *) i)) < 0)
+			panic("pthread_create: %e", r);
+	for (i = 0; i < NTHREAD; i++) {
+		if ((r = pthread_join(t[i], &ret)) < 0)
+			panic("pthread_join: %e", r);
+		if ((int) ret != i)
+			panic("thread %d returned %d", i, (int) ret);
+	}
+	if (counter != NTHREAD * NITER)
+		panic("counter is %d, not %d", counter, NTHREAD * NITER);
+	if (thisenv->env_id != sys_getenvid() || pthread_self() != NULL)
+		panic("main thread lost its TLS");
+
+	if ((r = sys_page_alloc(0, (void *) REMAPVA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*REMAPVA = 1;
+	if ((r = pthread_create(&t[0], watch, NULL)) < 0)
+		panic("pthread_create: %e", r);
+	sys_yield();
+	if ((r = sys_page_alloc(0, (void *) UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*(uint32_t *) UTEMP = 2;
+	if ((r = sys_page_map(0, (void *) UTEMP, 0, (void *) REMAPVA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+	pthread_join(t[0], &ret);
+	if (ret != NULL)
+		panic("thread never saw the page remapped");
+
+	cprintf("pthread OK\n");
+}
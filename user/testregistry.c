@@ -0,0 +1,54 @@
+// Test the service registry: registration, round-robin lookup over
+// several instances, and unregistration when an instance exits.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	envid_t me = thisenv->env_id, parent = me, child, a, b;
+	int r;
+
+	if (ipc_find_service("fs") != ipc_find_env(ENV_TYPE_FS))
+		panic("fs lookup disagrees with ipc_find_env");
+	if ((r = sys_svc_register("fs")) != -E_BAD_ENV)
+		panic("user env registered as fs: %e", r);
+	if ((r = sys_svc_lookup("testregistry")) != -E_NOT_FOUND)
+		panic("lookup of unregistered name returned %e", r);
+
+	if ((r = sys_svc_register("testregistry")) < 0)
+		panic("sys_svc_register: %e", r);
+	if ((r = sys_svc_register("testregistry")) != -E_FILE_EXISTS)
+		panic("double registration returned %e", r);
+	if (ipc_find_service("testregistry") != me)
+		panic("lookup did not find us");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = sys_svc_register("testregistry")) < 0)
+			panic("child sys_svc_register: %e", r);
+		ipc_send(parent, 0, NULL, 0);
+		ipc_recv(NULL, NULL, NULL);
+		return;
+	}
+	ipc_recv(NULL, NULL, NULL);
+
+	a = ipc_find_service("testregistry");
+	b = ipc_find_service("testregistry");
+	if (a == b || (a != me && a != child) || (b != me && b != child))
+		panic("lookups did not rotate: %08x %08x", a, b);
+
+	// The child's registration goes away with it.
+	ipc_send(child, 0, NULL, 0);
+	wait(child);
+	if (ipc_find_service("testregistry") != me
+	    || ipc_find_service("testregistry") != me)
+		panic("exited instance still registered");
+
+	if ((r = sys_svc_unregister("testregistry")) < 0)
+		panic("sys_svc_unregister: %e", r);
+	if ((r = sys_svc_lookup("testregistry")) != -E_NOT_FOUND)
+		panic("lookup after unregister returned %e", r);
+	cprintf("registry OK\n");
+}
@@ -0,0 +1,34 @@
+// Test spawn through sys_spawn_elf: bad images are refused, and a
+// batch of children start and exit.  Also check that our own text,
+// loaded by the kernel, is shared through its image cache.
+
+#include <inc/lib.h>
+
+#define NSPAWN	20
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	unsigned start;
+	int i, r;
+
+	if (pageref(umain) < 2)
+		panic("text page is not shared with the kernel's image cache");
+	if (uvpt[PGNUM(umain)] & PTE_W)
+		panic("text page is writable");
+
+	if ((r = spawnl("/motd", "motd", 0)) != -E_NOT_EXEC)
+		panic("spawning a text file returned %e", r);
+	if ((r = sys_spawn_elf((void *) UTOP, PGSIZE, (void *) UTEMP, USTACKTOP, NULL)) != -E_INVAL)
+		panic("sys_spawn_elf without a stack page returned %e", r);
+
+	start = sys_time_msec();
+	for (i = 0; i < NSPAWN; i++) {
+		if ((child = spawnl("/hello", "hello", 0)) < 0)
+			panic("spawn /hello: %e", child);
+		wait(child);
+	}
+	cprintf("%d spawns in %d msec\n", NSPAWN, sys_time_msec() - start);
+	cprintf("spawn OK\n");
+}
@@ -0,0 +1,73 @@
+// Test file_map and splice: map file pages from the file server, and
+// splice a file, from an unaligned offset, into a pipe.
+
+#include <inc/lib.h>
+
+#define FILESIZE	40000
+#define START		100
+#define MAPVA		((uint8_t *) 0xa00000)
+
+static uint8_t buf[8192];
+
+static uint8_t
+pattern(unsigned i)
+{
+	return (i * 7 + i / 4096) % 253;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int f, p[2], r, n;
+	unsigned i, got;
+	envid_t child;
+
+	if ((f = open("/splicetest", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /splicetest: %e", f);
+	for (i = 0; i < FILESIZE; i += n) {
+		n = MIN(sizeof(buf), FILESIZE - i);
+		for (r = 0; r < n; r++)
+			buf[r] = pattern(i + r);
+		if ((r = write(f, buf, n)) != n)
+			panic("write /splicetest: %e", r);
+	}
+
+	// The mapping covers whole pages from the page holding the offset,
+	// read-only.
+	if ((r = file_map(f, 3 * PGSIZE + 5, MAPVA, 2)) != 2 * PGSIZE)
+		panic("file_map returned %e", r);
+	if (uvpt[PGNUM(MAPVA)] & PTE_W)
+		panic("file_map gave us a writable page");
+	for (i = 0; i < 2 * PGSIZE; i++)
+		if (MAPVA[i] != pattern(3 * PGSIZE + i))
+			panic("mapped byte %d is %d", i, MAPVA[i]);
+	sys_page_unmap(0, MAPVA);
+	sys_page_unmap(0, MAPVA + PGSIZE);
+	if ((r = file_map(f, FILESIZE, MAPVA, 1)) != 0)
+		panic("file_map at end of file returned %e", r);
+	cprintf("file_map OK\n");
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(p[1]);
+		for (got = START; (n = read(p[0], buf, sizeof(buf))) > 0; got += n)
+			for (r = 0; r < n; r++)
+				if (buf[r] != pattern(got + r))
+					panic("byte %d is %d", got + r, buf[r]);
+		if (got != FILESIZE)
+			panic("pipe ended at %d", got);
+		return;
+	}
+
+	close(p[0]);
+	seek(f, START);
+	if ((r = splice(f, p[1], FILESIZE)) != FILESIZE - START)
+		panic("splice returned %e", r);
+	close(p[1]);
+	close(f);
+	wait(child);
+	cprintf("splice OK\n");
+}